@@ -0,0 +1,187 @@
+/*
+ * Greybus Simulator: interface activation
+ *
+ * Track where each interface is in its power-up sequence (VSYS, REFCLK,
+ * UniPro, activation) and answer the SVC requests driving it after the
+ * time the step takes on real hardware.  Responses are sent from the
+ * timer thread, so the SVC keeps serving other interfaces meanwhile and
+ * several modules can come up in parallel.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gbsim.h"
+
+enum {
+	STEP_VSYS,
+	STEP_REFCLK,
+	STEP_UNIPRO,
+	STEP_ACTIVATE,
+	STEP_RESUME,
+	STEP_COUNT,
+};
+
+static const char * const step_names[STEP_COUNT] = {
+	"vsys", "refclk", "unipro", "activate", "resume",
+};
+
+/* Per step delays in microseconds */
+static unsigned int step_delay_us[STEP_COUNT] = {
+	[STEP_VSYS]	= 10000,
+	[STEP_REFCLK]	= 1000,
+	[STEP_UNIPRO]	= 20000,
+	[STEP_ACTIVATE]	= 50000,
+	[STEP_RESUME]	= 20000,
+};
+
+struct delayed_response {
+	struct gbsim_timer timer;
+	uint16_t hd_cport_id;
+	uint16_t operation_id;
+	uint8_t type;
+	uint16_t message_size;
+	struct op_msg msg;
+};
+
+/* Parse "vsys,refclk,unipro,activate,resume", delays in ms */
+int intf_activate_setup(char *spec)
+{
+	char *tok, *saveptr = NULL;
+	int i = 0;
+
+	for (tok = strtok_r(spec, ",", &saveptr); tok;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		if (i == STEP_COUNT) {
+			gbsim_error("activate: too many delays\n");
+			return -EINVAL;
+		}
+		step_delay_us[i++] = strtoul(tok, NULL, 0) * 1000;
+	}
+
+	for (i = 0; i < STEP_COUNT; i++)
+		gbsim_debug("activate: %s delay %uus\n", step_names[i],
+			    step_delay_us[i]);
+
+	return 0;
+}
+
+static int intf_activate_step(uint8_t type)
+{
+	switch (type) {
+	case GB_SVC_TYPE_INTF_VSYS_ENABLE:
+	case GB_SVC_TYPE_INTF_VSYS_DISABLE:
+		return STEP_VSYS;
+	case GB_SVC_TYPE_INTF_REFCLK_ENABLE:
+	case GB_SVC_TYPE_INTF_REFCLK_DISABLE:
+		return STEP_REFCLK;
+	case GB_SVC_TYPE_INTF_UNIPRO_ENABLE:
+	case GB_SVC_TYPE_INTF_UNIPRO_DISABLE:
+		return STEP_UNIPRO;
+	case GB_SVC_TYPE_INTF_ACTIVATE:
+		return STEP_ACTIVATE;
+	case GB_SVC_TYPE_INTF_RESUME:
+		return STEP_RESUME;
+	default:
+		return -EINVAL;
+	}
+}
+
+/*
+ * Move @intf through the power-up sequence for request @type.  Returns the
+ * result code of the response, a step out of order fails like on hardware.
+ */
+uint8_t intf_activate(struct gbsim_interface *intf, uint8_t type)
+{
+	int state = intf->activation;
+	uint8_t result = GB_SVC_OP_SUCCESS;
+
+	switch (type) {
+	case GB_SVC_TYPE_INTF_VSYS_ENABLE:
+		if (state < INTF_STATE_VSYS)
+			state = INTF_STATE_VSYS;
+		break;
+	case GB_SVC_TYPE_INTF_VSYS_DISABLE:
+		state = INTF_STATE_OFF;
+		break;
+	case GB_SVC_TYPE_INTF_REFCLK_ENABLE:
+		if (state < INTF_STATE_VSYS)
+			result = GB_SVC_INTF_REFCLK_FAIL;
+		else if (state < INTF_STATE_REFCLK)
+			state = INTF_STATE_REFCLK;
+		break;
+	case GB_SVC_TYPE_INTF_REFCLK_DISABLE:
+		if (state > INTF_STATE_VSYS)
+			state = INTF_STATE_VSYS;
+		break;
+	case GB_SVC_TYPE_INTF_UNIPRO_ENABLE:
+		if (state < INTF_STATE_REFCLK)
+			result = GB_SVC_INTF_UNIPRO_FAIL;
+		else if (state < INTF_STATE_UNIPRO)
+			state = INTF_STATE_UNIPRO;
+		break;
+	case GB_SVC_TYPE_INTF_UNIPRO_DISABLE:
+		if (state > INTF_STATE_REFCLK)
+			state = INTF_STATE_REFCLK;
+		break;
+	case GB_SVC_TYPE_INTF_ACTIVATE:
+	case GB_SVC_TYPE_INTF_RESUME:
+		if (state < INTF_STATE_UNIPRO)
+			result = GB_SVC_INTF_NO_UPRO_LINK;
+		else
+			state = INTF_STATE_ACTIVE;
+		break;
+	}
+
+	gbsim_debug("interface %u activation %d -> %d (result %u)\n",
+		    intf->interface_id, intf->activation, state, result);
+	intf->activation = state;
+
+	return result;
+}
+
+static void delayed_response_send(void *data)
+{
+	struct delayed_response *rsp = data;
+
+	send_response(rsp->hd_cport_id, &rsp->msg, rsp->message_size,
+		      rsp->operation_id, rsp->type, PROTOCOL_STATUS_SUCCESS);
+	free(rsp);
+}
+
+/*
+ * Send the response to an activation request once the step it stands for
+ * is done.  The message is copied, the caller's buffer can be reused.
+ */
+int intf_activate_respond(uint16_t hd_cport_id, struct op_msg *msg,
+			  uint16_t message_size, uint16_t operation_id,
+			  uint8_t type)
+{
+	struct delayed_response *rsp;
+	int step = intf_activate_step(type);
+
+	if (step < 0 || !step_delay_us[step] || message_size > sizeof(rsp->msg))
+		return send_response(hd_cport_id, msg, message_size,
+				     operation_id, type,
+				     PROTOCOL_STATUS_SUCCESS);
+
+	rsp = malloc(sizeof(*rsp));
+	if (!rsp)
+		return -ENOMEM;
+
+	rsp->hd_cport_id = hd_cport_id;
+	rsp->operation_id = operation_id;
+	rsp->type = type;
+	rsp->message_size = message_size;
+	memcpy(&rsp->msg, msg, message_size);
+
+	memset(&rsp->timer, 0, sizeof(rsp->timer));
+	rsp->timer.fn = delayed_response_send;
+	rsp->timer.data = rsp;
+	timer_add(&rsp->timer, step_delay_us[step] * 1000ULL);
+
+	return 0;
+}
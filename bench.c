@@ -0,0 +1,386 @@
+/*
+ * Greybus Simulator: hotplug storm benchmark
+ *
+ * Insert and remove a number of modules at a fixed rate, through the same
+ * interface hotplug path the inotify watcher uses, and measure how long the
+ * AP takes to enumerate them and to tear them down.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gbsim.h"
+
+/* How long to wait for the AP once all modules are inserted (or removed) */
+#define BENCH_TIMEOUT_S		30
+
+struct bench_sample {
+	int intf_id;
+	int cports_expected;
+	int cports_created;
+	struct timespec inserted;	/* MODULE_INSERTED sent */
+	struct timespec control;	/* control CPort CONN_CREATE */
+	struct timespec enumerated;	/* last bundle CPort CONN_CREATE */
+	struct timespec removed;	/* MODULE_REMOVED sent */
+	struct timespec torn_down;	/* interface released by the AP */
+};
+
+static struct bench_sample *samples;
+static struct bench_sample *active[256];
+static int bench_count;
+static int bench_inserted;
+static unsigned int bench_rate;
+static struct greybus_manifest_header *bench_manifest;
+static int bench_cports;
+
+static int enumerated_count;
+static int torn_down_count;
+static bool bench_running;
+static pthread_mutex_t bench_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bench_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t bench_pthread;
+static int thread_started;
+
+/* The benchmark runs on the first bridge to say hello */
+static struct gbsim_svc *bench_svc;
+
+static double ts_diff_us(struct timespec *end, struct timespec *start)
+{
+	return (end->tv_sec - start->tv_sec) * 1e6 +
+	       (end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+static void ts_add_ns(struct timespec *ts, uint64_t ns)
+{
+	ts->tv_sec += ns / 1000000000;
+	ts->tv_nsec += ns % 1000000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/* Number of non-control CPorts the AP is expected to connect */
+static int bench_count_cports(struct greybus_manifest_header *mh)
+{
+	struct gbsim_interface intf = {
+		.manifest = mh,
+		.manifest_size = le16toh(mh->size),
+	};
+	struct greybus_descriptor *desc;
+	int count = 0;
+	int skip = 0;
+
+	while ((desc = manifest_get_descriptor(&intf, GREYBUS_TYPE_CPORT,
+					       skip++)))
+		if (le16toh(desc->cport.id) != GB_CONTROL_CPORT_ID)
+			count++;
+
+	return count;
+}
+
+/* Called from the SVC handler when the AP creates a connection */
+void hotplug_bench_conn_create(struct gbsim_interface *intf, uint16_t cport_id)
+{
+	struct bench_sample *s;
+	struct timespec now;
+
+	if (!bench_running || intf->svc != bench_svc)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&bench_lock);
+	s = active[intf->interface_id];
+	if (!s || s->enumerated.tv_sec)
+		goto out;
+
+	if (cport_id == GB_CONTROL_CPORT_ID) {
+		s->control = now;
+		if (s->cports_expected)
+			goto out;
+	} else if (++s->cports_created < s->cports_expected) {
+		goto out;
+	}
+
+	s->enumerated = now;
+	enumerated_count++;
+	pthread_cond_signal(&bench_cond);
+out:
+	pthread_mutex_unlock(&bench_lock);
+}
+
+/* Called when the AP releases an interface (VSYS disable) */
+void hotplug_bench_intf_free(struct gbsim_interface *intf)
+{
+	struct bench_sample *s;
+
+	if (!bench_running || intf->svc != bench_svc)
+		return;
+
+	pthread_mutex_lock(&bench_lock);
+	s = active[intf->interface_id];
+	if (s && s->removed.tv_sec) {
+		clock_gettime(CLOCK_MONOTONIC, &s->torn_down);
+		active[intf->interface_id] = NULL;
+		torn_down_count++;
+		pthread_cond_signal(&bench_cond);
+	}
+	pthread_mutex_unlock(&bench_lock);
+}
+
+static void bench_wait(int *counter, int target)
+{
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += BENCH_TIMEOUT_S;
+
+	pthread_mutex_lock(&bench_lock);
+	pthread_cleanup_push((void (*)(void *))pthread_mutex_unlock,
+			     &bench_lock);
+	while (*counter < target)
+		if (pthread_cond_timedwait(&bench_cond, &bench_lock,
+					   &deadline) == ETIMEDOUT)
+			break;
+	pthread_cleanup_pop(1);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+
+	return da < db ? -1 : da > db;
+}
+
+static void bench_report_latency(const char *name, double *v, int n)
+{
+	if (!n) {
+		gbsim_info("bench: %-12s no samples\n", name);
+		return;
+	}
+
+	qsort(v, n, sizeof(*v), cmp_double);
+	gbsim_info("bench: %-12s n=%d p50=%.0fus p90=%.0fus p99=%.0fus max=%.0fus\n",
+		   name, n, v[(n - 1) * 50 / 100], v[(n - 1) * 90 / 100],
+		   v[(n - 1) * 99 / 100], v[n - 1]);
+}
+
+static void bench_report(void)
+{
+	struct timespec first, last_enum = { 0 }, last_down = { 0 };
+	struct timespec first_removed;
+	double *ctrl, *enumerated, *teardown;
+	int nc = 0, ne = 0, nt = 0;
+	struct bench_sample *s;
+	int i;
+
+	ctrl = calloc(3 * bench_count, sizeof(*ctrl));
+	if (!ctrl)
+		return;
+	enumerated = ctrl + bench_count;
+	teardown = enumerated + bench_count;
+
+	first = samples[0].inserted;
+	first_removed = samples[0].removed;
+
+	pthread_mutex_lock(&bench_lock);
+	for (i = 0; i < bench_count; i++) {
+		s = &samples[i];
+		if (s->control.tv_sec)
+			ctrl[nc++] = ts_diff_us(&s->control, &s->inserted);
+		if (s->enumerated.tv_sec) {
+			enumerated[ne++] = ts_diff_us(&s->enumerated,
+						      &s->inserted);
+			if (ts_diff_us(&s->enumerated, &last_enum) > 0)
+				last_enum = s->enumerated;
+		}
+		if (s->torn_down.tv_sec) {
+			teardown[nt++] = ts_diff_us(&s->torn_down, &s->removed);
+			if (ts_diff_us(&s->torn_down, &last_down) > 0)
+				last_down = s->torn_down;
+		}
+	}
+	pthread_mutex_unlock(&bench_lock);
+
+	gbsim_info("bench: %d/%d modules inserted, %u inserts/s requested, %d CPorts each\n",
+		   bench_inserted, bench_count, bench_rate, bench_cports);
+	bench_report_latency("control", ctrl, nc);
+	bench_report_latency("enumerated", enumerated, ne);
+	bench_report_latency("teardown", teardown, nt);
+
+	if (ne)
+		gbsim_info("bench: sustained %.1f hotplugs/s (%d/%d enumerated)\n",
+			   ne * 1e6 / ts_diff_us(&last_enum, &first), ne,
+			   bench_inserted);
+	if (nt)
+		gbsim_info("bench: sustained %.1f removals/s (%d/%d torn down)\n",
+			   nt * 1e6 / ts_diff_us(&last_down, &first_removed),
+			   nt, bench_inserted);
+
+	free(ctrl);
+}
+
+static void *bench_thread(void *param)
+{
+	struct gbsim_svc *svc = param;
+	struct gbsim_interface *intf;
+	struct bench_sample *s;
+	struct timespec next;
+	uint64_t period_ns = 1000000000ULL / bench_rate;
+	void *blob;
+	size_t size = le16toh(bench_manifest->size);
+	int i;
+
+	gbsim_info("bench: inserting %d modules at %u/s\n", bench_count,
+		   bench_rate);
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (i = 0; i < bench_count; i++) {
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		ts_add_ns(&next, period_ns);
+
+		blob = malloc(size);
+		if (!blob) {
+			gbsim_error("bench: can't allocate manifest of module %d\n",
+				    i + 1);
+			break;
+		}
+		memcpy(blob, bench_manifest, size);
+
+		s = &samples[i];
+		s->cports_expected = bench_cports;
+
+		pthread_mutex_lock(&bench_lock);
+		s->intf_id = svc_get_next_intf_id(svc);
+		active[s->intf_id] = s;
+		clock_gettime(CLOCK_MONOTONIC, &s->inserted);
+		pthread_mutex_unlock(&bench_lock);
+
+		intf = interface_hotplug(svc, s->intf_id, 0, blob, NULL, 0);
+		if (!intf) {
+			gbsim_error("bench: can't insert module %d on interface %u\n",
+				    i + 1, s->intf_id);
+			pthread_mutex_lock(&bench_lock);
+			active[s->intf_id] = NULL;
+			pthread_mutex_unlock(&bench_lock);
+			break;
+		}
+	}
+
+	/* Only wait for, and later remove, what actually went in */
+	bench_inserted = i;
+	if (bench_inserted < bench_count)
+		gbsim_error("bench: only %d of %d modules inserted\n",
+			    bench_inserted, bench_count);
+
+	bench_wait(&enumerated_count, bench_inserted);
+
+	gbsim_info("bench: removing %d modules at %u/s\n", bench_inserted,
+		   bench_rate);
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (i = 0; i < bench_inserted; i++) {
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		ts_add_ns(&next, period_ns);
+
+		s = &samples[i];
+		intf = interface_get_by_id(svc, s->intf_id);
+		if (!intf)
+			continue;
+
+		pthread_mutex_lock(&bench_lock);
+		clock_gettime(CLOCK_MONOTONIC, &s->removed);
+		pthread_mutex_unlock(&bench_lock);
+
+		interface_hotunplug(svc, intf);
+	}
+
+	bench_wait(&torn_down_count, bench_inserted);
+	bench_running = false;
+
+	bench_report();
+
+	return NULL;
+}
+
+/* Parse "count:rate:manifest" */
+int hotplug_bench_setup(char *spec)
+{
+	char *rate, *manifest;
+
+	rate = strchr(spec, ':');
+	manifest = rate ? strchr(rate + 1, ':') : NULL;
+	if (!manifest) {
+		gbsim_error("bench: expected count:rate:manifest\n");
+		return -EINVAL;
+	}
+	*rate++ = '\0';
+	*manifest++ = '\0';
+
+	bench_count = strtol(spec, NULL, 0);
+	bench_rate = strtoul(rate, NULL, 0);
+	if (bench_count <= 0 || bench_count > 254 || !bench_rate) {
+		gbsim_error("bench: bad count (1-254) or rate\n");
+		return -EINVAL;
+	}
+
+	bench_manifest = manifest_load(manifest);
+	if (!bench_manifest)
+		return -EINVAL;
+	bench_cports = bench_count_cports(bench_manifest);
+
+	samples = calloc(bench_count, sizeof(*samples));
+	if (!samples)
+		return -ENOMEM;
+
+	return 0;
+}
+
+int hotplug_bench_start(struct gbsim_svc *svc)
+{
+	int ret;
+
+	if (!samples)
+		return 0;
+
+	pthread_mutex_lock(&bench_lock);
+	if (bench_svc) {
+		pthread_mutex_unlock(&bench_lock);
+		return 0;
+	}
+	bench_svc = svc;
+	pthread_mutex_unlock(&bench_lock);
+
+	bench_running = true;
+	ret = pthread_create(&bench_pthread, NULL, bench_thread, svc);
+	if (ret) {
+		gbsim_error("can't create bench thread: %s\n", strerror(ret));
+		bench_running = false;
+		return -ret;
+	}
+	thread_started = 1;
+
+	return 0;
+}
+
+void hotplug_bench_cleanup(void)
+{
+	bench_running = false;
+	if (thread_started) {
+		pthread_cancel(bench_pthread);
+		pthread_join(bench_pthread, NULL);
+		thread_started = 0;
+	}
+
+	free(samples);
+	samples = NULL;
+	free(bench_manifest);
+	bench_manifest = NULL;
+}
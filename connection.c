@@ -7,6 +7,7 @@
  * Provided under the three clause BSD license found in the LICENSE file.
  */
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <linux/types.h>
@@ -18,22 +19,27 @@
 #include "gbsim.h"
 #include "gbsim_usb.h"
 
-#define ES1_MSG_SIZE	(2 * 1024)
-
-/* Receive buffer for all data arriving from the AP */
-static char cport_rbuf[ES1_MSG_SIZE];
-static char cport_tbuf[ES1_MSG_SIZE];
+/*
+ * Every bridge has its own receive thread, but the protocol models keep
+ * process wide state: serialize the handlers of a protocol across bridges.
+ * The SVC and control handlers only touch per bridge state, and loopback
+ * keeps its state per connection.
+ */
+#define MODEL_LOCK_COUNT	0x20
 
-extern struct gbsim_svc *svc;
+static pthread_mutex_t model_lock[MODEL_LOCK_COUNT] = {
+	[0 ... MODEL_LOCK_COUNT - 1] = PTHREAD_MUTEX_INITIALIZER,
+};
 
 /*
  * We (ab)use the operation-message header pad bytes to transfer the
- * cport id in order to minimise overhead.
+ * cport id in order to minimise overhead.  Only the AP's own cport number
+ * goes on the wire, the bridge is implied by the endpoint.
  */
 static void
 gbsim_message_cport_pack(struct gb_operation_msg_hdr *header, uint16_t cport_id)
 {
-	header->pad[0] = cport_id;
+	header->pad[0] = HD_CPORT_AP(cport_id);
 }
 
 /* Clear the pad bytes used for the CPort id */
@@ -50,10 +56,14 @@ static uint16_t gbsim_message_cport_unpack(struct gb_operation_msg_hdr *header)
 
 struct gbsim_connection *connection_find(uint16_t cport_id)
 {
+	struct gbsim_bridge *bridge = bridge_get(HD_CPORT_BRIDGE(cport_id));
 	struct gbsim_connection *connection;
 	struct gbsim_interface *intf;
 
-	TAILQ_FOREACH(intf, &svc->intfs, intf_node)
+	if (!bridge || !bridge->svc)
+		return NULL;
+
+	TAILQ_FOREACH(intf, &bridge->svc->intfs, intf_node)
 		TAILQ_FOREACH(connection, &intf->connections, cnode)
 			if (connection->hd_cport_id == cport_id)
 				return connection;
@@ -61,7 +71,7 @@ struct gbsim_connection *connection_find(uint16_t cport_id)
 	return NULL;
 }
 
-uint16_t find_hd_cport_for_protocol(int protocol_id)
+uint16_t find_hd_cport_for_protocol(struct gbsim_svc *svc, int protocol_id)
 {
 	struct gbsim_connection *connection;
 	struct gbsim_interface *intf;
@@ -86,6 +96,18 @@ void connection_set_protocol(struct gbsim_connection *connection,
 	connection->protocol = protocol_id;
 }
 
+static const struct gbsim_cport_params *
+connection_find_params(struct gbsim_interface *intf, uint16_t cport_id)
+{
+	int i;
+
+	for (i = 0; i < intf->cport_params_count; i++)
+		if (intf->cport_params[i].cport_id == cport_id)
+			return &intf->cport_params[i];
+
+	return NULL;
+}
+
 struct gbsim_connection *allocate_connection(struct gbsim_interface *intf,
 					     uint16_t cport_id,
 					     uint16_t hd_cport_id)
@@ -106,6 +128,7 @@ struct gbsim_connection *allocate_connection(struct gbsim_interface *intf,
 		intf->control_conn = connection;
 
 	connection->intf = intf;
+	connection->params = connection_find_params(intf, cport_id);
 
 	return connection;
 }
@@ -114,7 +137,13 @@ void free_connection(struct gbsim_connection *connection)
 {
 	struct gbsim_interface *intf = connection->intf;
 
+	if (connection->protocol == GREYBUS_PROTOCOL_LOOPBACK)
+		loopback_conn_destroy(connection);
+	else if (connection->protocol == GREYBUS_PROTOCOL_UART)
+		uart_conn_destroy(connection);
+
 	TAILQ_REMOVE(&intf->connections, connection, cnode);
+	route_connection_unbind(connection);
 	free(connection);
 }
 
@@ -198,10 +227,17 @@ static int send_msg_to_ap(uint16_t hd_cport_id,
 			struct op_msg *message, uint16_t message_size,
 			uint16_t operation_id, uint8_t type, uint8_t result)
 {
+	struct gbsim_bridge *bridge = bridge_get(HD_CPORT_BRIDGE(hd_cport_id));
 	struct gb_operation_msg_hdr *header = &message->header;
+	struct gbsim_connection *connection;
+	struct gbsim_route *route = NULL;
 	char *protocol, *operation;
+	uint64_t start_ns;
 	ssize_t nbytes;
 
+	if (!bridge)
+		return -ENODEV;
+
 	header->size = htole16(message_size);
 	header->operation_id = operation_id;
 	header->type = type;
@@ -212,17 +248,36 @@ static int send_msg_to_ap(uint16_t hd_cport_id,
 	get_protocol_operation(hd_cport_id, &protocol, &operation,
 			       type & ~OP_RESPONSE);
 	if (type & OP_RESPONSE)
-		gbsim_debug("Module -> AP CPort %hu %s %s response\n",
-			    hd_cport_id, protocol, operation);
+		gbsim_debug("Module -> AP %d CPort %hu %s %s response\n",
+			    bridge->id, HD_CPORT_AP(hd_cport_id), protocol,
+			    operation);
 	else
-		gbsim_debug("Module -> AP CPort %hu %s %s request\n",
-			    hd_cport_id, protocol, operation);
+		gbsim_debug("Module -> AP %d CPort %hu %s %s request\n",
+			    bridge->id, HD_CPORT_AP(hd_cport_id), protocol,
+			    operation);
 
 	/* Send the response to the AP */
 	if (verbose)
 		gbsim_dump(message, message_size);
 
-	nbytes = write(to_ap, message, message_size);
+	/* Module traffic has to go through the switch */
+	connection = connection_find(hd_cport_id);
+	if (connection && connection->intf->interface_id) {
+		route = route_begin(connection, &start_ns);
+		if (!route) {
+			gbsim_error("no route for CPort %hu, message dropped\n",
+				    hd_cport_id);
+			return -EHOSTUNREACH;
+		}
+
+		pwrmon_account(connection->intf, message_size);
+
+		/* Held for as long as the UniPro link would take */
+		return link_send(connection->intf, bridge->to_ap, message,
+				 message_size, route, start_ns);
+	}
+
+	nbytes = write(bridge->to_ap, message, message_size);
 	if (nbytes < 0)
 		return nbytes;
 
@@ -245,14 +300,10 @@ int send_request(uint16_t hd_cport_id,
 				operation_id, type, 0);
 }
 
-static int connection_recv_handler(struct gbsim_connection *connection,
-				void *rbuf, size_t rsize)
+static int __connection_recv_handler(struct gbsim_connection *connection,
+				     void *rbuf, size_t rsize,
+				     void *tbuf, size_t tsize)
 {
-	void *tbuf = &cport_tbuf[0];
-	size_t tsize = sizeof(cport_tbuf);
-
-	memset(tbuf, 0, tsize);	/* Zero buffer before use */
-
 	switch (connection->protocol) {
 	case GREYBUS_PROTOCOL_CONTROL:
 		return control_handler(connection, rbuf, rsize, tbuf, tsize);
@@ -289,12 +340,48 @@ static int connection_recv_handler(struct gbsim_connection *connection,
 	}
 }
 
-static void recv_handler(void *rbuf, size_t rsize)
+static int connection_recv_handler(struct gbsim_bridge *bridge,
+				   struct gbsim_connection *connection,
+				   void *rbuf, size_t rsize)
+{
+	void *tbuf = &bridge->tbuf[0];
+	size_t tsize = sizeof(bridge->tbuf);
+	pthread_mutex_t *lock = NULL;
+	int ret;
+
+	switch (connection->protocol) {
+	case GREYBUS_PROTOCOL_LOOPBACK:
+		/* Answers in place in rbuf and leaves tbuf alone */
+		break;
+	case GREYBUS_PROTOCOL_CONTROL:
+	case GREYBUS_PROTOCOL_SVC:
+		memset(tbuf, 0, tsize);	/* Zero buffer before use */
+		break;
+	default:
+		memset(tbuf, 0, tsize);	/* Zero buffer before use */
+		if (connection->protocol >= 0 &&
+		    connection->protocol < MODEL_LOCK_COUNT)
+			lock = &model_lock[connection->protocol];
+		break;
+	}
+
+	if (lock)
+		pthread_mutex_lock(lock);
+	ret = __connection_recv_handler(connection, rbuf, rsize, tbuf, tsize);
+	if (lock)
+		pthread_mutex_unlock(lock);
+
+	return ret;
+}
+
+static void recv_handler(struct gbsim_bridge *bridge, void *rbuf, size_t rsize)
 {
 	struct gb_operation_msg_hdr *hdr = rbuf;
 	uint16_t hd_cport_id;
 	struct gbsim_connection *connection;
+	struct gbsim_route *route = NULL;
 	char *protocol, *operation, *type;
+	uint64_t start_ns;
 	int ret;
 
 	if (rsize < sizeof(*hdr)) {
@@ -303,12 +390,12 @@ static void recv_handler(void *rbuf, size_t rsize)
 	}
 
 	/* Retreive the cport id stored in the header pad bytes */
-	hd_cport_id = gbsim_message_cport_unpack(hdr);
+	hd_cport_id = HD_CPORT(bridge->id, gbsim_message_cport_unpack(hdr));
 
 	connection = connection_find(hd_cport_id);
 	if (!connection) {
-		gbsim_error("message received for unknown cport id %u\n",
-			hd_cport_id);
+		gbsim_error("message received for unknown cport id %u on bridge %d\n",
+			HD_CPORT_AP(hd_cport_id), bridge->id);
 		return;
 	}
 
@@ -326,37 +413,53 @@ static void recv_handler(void *rbuf, size_t rsize)
 
 	gbsim_message_cport_clear(hdr);
 
-	ret = connection_recv_handler(connection, rbuf, rsize);
+	if (connection->intf->interface_id) {
+		route = route_begin(connection, &start_ns);
+		if (!route) {
+			gbsim_error("no route for CPort %hu, message dropped\n",
+				    hd_cport_id);
+			return;
+		}
+		pwrmon_account(connection->intf, rsize);
+	}
+
+	ret = connection_recv_handler(bridge, connection, rbuf, rsize);
+	if (route)
+		route_end(route, false, rsize, start_ns);
 	if (ret)
 		gbsim_debug("connection_recv_handler() returned %d\n", ret);
 }
 
 void recv_thread_cleanup(void *arg)
 {
-	cleanup_endpoint(to_ap, "to_ap");
-	cleanup_endpoint(from_ap, "from_ap");
+	struct gbsim_bridge *bridge = arg;
+
+	cleanup_endpoint(bridge->to_ap, "to_ap");
+	cleanup_endpoint(bridge->from_ap, "from_ap");
 }
 
 /*
  * Repeatedly perform blocking reads to receive messages arriving
- * from the AP.
+ * from the AP on one bridge.
  */
 void *recv_thread(void *param)
 {
-	void *rbuf = &cport_rbuf[0];
-	size_t rbuf_size = sizeof(cport_rbuf);
+	struct gbsim_bridge *bridge = param;
+	void *rbuf = &bridge->rbuf[0];
+	size_t rbuf_size = sizeof(bridge->rbuf);
 
 	while (1) {
 		ssize_t rsize;
 
-		memset(rbuf, 0, rbuf_size);	/* Zero buffer before use */
-
-		rsize = read(from_ap, rbuf, rbuf_size);
+		rsize = read(bridge->from_ap, rbuf, rbuf_size);
 		if (rsize < 0) {
 			gbsim_error("error %zd receiving from AP\n", rsize);
 			return NULL;
 		}
 
-		recv_handler(rbuf, rsize);
+		/* Stopped between messages, never halfway through one */
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		recv_handler(bridge, rbuf, rsize);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 	}
 }
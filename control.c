@@ -33,9 +33,12 @@ int control_handler(struct gbsim_connection *connection, void *rbuf,
 	struct op_msg *op_rsp = tbuf;
 	struct gb_operation_msg_hdr *oph = &op_req->header;
 	struct gbsim_interface *intf = connection->intf;
+	struct gb_control_timesync_enable_request *ts_enable;
+	uint64_t frame_time[GB_TIMESYNC_MAX_STROBES];
 	size_t payload_size;
 	uint16_t message_size = sizeof(*oph);
 	uint16_t hd_cport_id = connection->hd_cport_id;
+	int i;
 
 	switch (oph->type) {
 	case GB_REQUEST_TYPE_CPORT_SHUTDOWN:
@@ -80,6 +83,30 @@ int control_handler(struct gbsim_connection *connection, void *rbuf,
 	case GB_CONTROL_TYPE_DISCONNECTING:
 		payload_size = 0;
 		break;
+	case GB_CONTROL_TYPE_TIMESYNC_ENABLE:
+		payload_size = 0;
+		ts_enable = &op_req->control_ts_enable_req;
+		timesync_intf_enable(intf, ts_enable->count,
+				     le64toh(ts_enable->frame_time),
+				     le32toh(ts_enable->strobe_delay),
+				     le32toh(ts_enable->refclk));
+		break;
+	case GB_CONTROL_TYPE_TIMESYNC_DISABLE:
+		payload_size = 0;
+		timesync_intf_disable(intf);
+		break;
+	case GB_CONTROL_TYPE_TIMESYNC_AUTHORITATIVE:
+		payload_size = 0;
+		for (i = 0; i < GB_TIMESYNC_MAX_STROBES; i++)
+			frame_time[i] =
+				le64toh(op_req->control_ts_auth_req.frame_time[i]);
+		timesync_intf_authoritative(intf, frame_time);
+		break;
+	case GB_CONTROL_TYPE_TIMESYNC_GET_LAST_EVENT:
+		payload_size = sizeof(op_rsp->control_ts_last_event_rsp);
+		op_rsp->control_ts_last_event_rsp.frame_time =
+			htole64(timesync_intf_last_event(intf));
+		break;
 	default:
 		gbsim_error("control operation type %02x not supported\n", oph->type);
 		return -EINVAL;
@@ -120,6 +147,14 @@ char *control_get_operation(uint8_t type)
 		return "GB_CONTROL_TYPE_BUNDLE_RESUME";
 	case GB_CONTROL_TYPE_INTF_SUSPEND_PREPARE:
 		return "GB_CONTROL_TYPE_INTF_SUSPEND_PREPARE";
+	case GB_CONTROL_TYPE_TIMESYNC_ENABLE:
+		return "GB_CONTROL_TYPE_TIMESYNC_ENABLE";
+	case GB_CONTROL_TYPE_TIMESYNC_DISABLE:
+		return "GB_CONTROL_TYPE_TIMESYNC_DISABLE";
+	case GB_CONTROL_TYPE_TIMESYNC_AUTHORITATIVE:
+		return "GB_CONTROL_TYPE_TIMESYNC_AUTHORITATIVE";
+	case GB_CONTROL_TYPE_TIMESYNC_GET_LAST_EVENT:
+		return "GB_CONTROL_TYPE_TIMESYNC_GET_LAST_EVENT";
 	default:
 		return "(Unknown operation)";
 	}
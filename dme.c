@@ -0,0 +1,262 @@
+/*
+ * Greybus Simulator: UniPro DME attribute store
+ *
+ * Every interface carries its own set of UniPro attributes, as seen by the
+ * SVC through DME peer get/set.  Attributes are kept in a small open
+ * addressing hash table keyed by (attribute, selector), seeded with the
+ * values a Toshiba ES3 bridge reports after boot.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gbsim.h"
+
+/* Standard UniPro attributes */
+#define DME_DDBL1_REVISION		0x5000
+#define DME_DDBL1_LEVEL			0x5001
+#define DME_DDBL1_DEVICECLASS		0x5002
+#define DME_DDBL1_MANUFACTURERID	0x5003
+#define DME_DDBL1_PRODUCTID		0x5004
+#define DME_DDBL1_LENGTH		0x5005
+
+#define PA_ACTIVETXDATALANES		0x1560
+#define PA_CONNECTEDTXDATALANES		0x1561
+#define PA_TXGEAR			0x1568
+#define PA_HSSERIES			0x156a
+#define PA_PWRMODE			0x1571
+#define PA_ACTIVERXDATALANES		0x1580
+#define PA_CONNECTEDRXDATALANES		0x1581
+#define PA_RXGEAR			0x1583
+
+#define T_TSTSRCINCREMENT		0x4083
+
+/* Toshiba bridge specific attributes */
+#define DME_TOSHIBA_GMP_VID		0x6000
+#define DME_TOSHIBA_GMP_PID		0x6001
+#define DME_TOSHIBA_GMP_SN0		0x6002
+#define DME_TOSHIBA_GMP_SN1		0x6003
+#define DME_TOSHIBA_GMP_INIT_STATUS	0x6101
+
+#define TOSHIBA_DMID			0x0126
+#define TOSHIBA_ES3_GBPHY_DPID		0x1002
+
+#define DME_SELECTOR_INDEX_NULL		0
+
+/* PA_PWRMode holds the RX mode in the high nibble, TX in the low one */
+#define PA_PWRMODE_TX(m)		((m) & 0xf)
+#define PA_PWRMODE_RX(m)		(((m) >> 4) & 0xf)
+#define PA_PWRMODE_VAL(rx, tx)		((((rx) & 0xf) << 4) | ((tx) & 0xf))
+
+#define DME_KEY(attr, sel)		(((uint32_t)(attr) << 16) | (sel))
+#define DME_KEY_EMPTY			0xffffffff
+#define DME_MIN_SLOTS			32
+
+static const struct {
+	uint16_t attr;
+	uint32_t value;
+} dme_defaults[] = {
+	{ DME_DDBL1_REVISION,		0x0010 },
+	{ DME_DDBL1_LEVEL,		0x0003 },
+	{ DME_DDBL1_DEVICECLASS,	0x0000 },
+	{ DME_DDBL1_MANUFACTURERID,	TOSHIBA_DMID },
+	{ DME_DDBL1_PRODUCTID,		TOSHIBA_ES3_GBPHY_DPID },
+	{ DME_DDBL1_LENGTH,		0x0000 },
+	{ DME_TOSHIBA_GMP_VID,		0x0000 },
+	{ DME_TOSHIBA_GMP_PID,		0x0000 },
+	{ DME_TOSHIBA_GMP_SN1,		0x0000 },
+	/* Link comes up in slow auto mode, gear 1, on a single lane */
+	{ PA_CONNECTEDTXDATALANES,	1 },
+	{ PA_CONNECTEDRXDATALANES,	1 },
+	{ PA_ACTIVETXDATALANES,		1 },
+	{ PA_ACTIVERXDATALANES,		1 },
+	{ PA_TXGEAR,			1 },
+	{ PA_RXGEAR,			1 },
+	{ PA_HSSERIES,			GB_SVC_UNIPRO_HS_SERIES_A },
+	{ PA_PWRMODE,			PA_PWRMODE_VAL(GB_SVC_UNIPRO_SLOW_AUTO_MODE,
+						       GB_SVC_UNIPRO_SLOW_AUTO_MODE) },
+};
+
+static inline unsigned int dme_hash(uint32_t key, unsigned int mask)
+{
+	/* Fibonacci hashing, attributes are clustered by layer */
+	return (key * 0x9e3779b1u) >> 16 & mask;
+}
+
+static struct gbsim_dme_entry *dme_slot(struct gbsim_dme *dme, uint32_t key)
+{
+	unsigned int i = dme_hash(key, dme->mask);
+
+	while (dme->slots[i].key != key && dme->slots[i].key != DME_KEY_EMPTY)
+		i = (i + 1) & dme->mask;
+
+	return &dme->slots[i];
+}
+
+static int dme_resize(struct gbsim_dme *dme, unsigned int nslots)
+{
+	struct gbsim_dme_entry *old = dme->slots;
+	unsigned int old_nslots = old ? dme->mask + 1 : 0;
+	struct gbsim_dme_entry *slot;
+	unsigned int i;
+
+	dme->slots = malloc(nslots * sizeof(*dme->slots));
+	if (!dme->slots) {
+		dme->slots = old;
+		return -ENOMEM;
+	}
+	memset(dme->slots, 0xff, nslots * sizeof(*dme->slots));
+	dme->mask = nslots - 1;
+
+	for (i = 0; i < old_nslots; i++) {
+		if (old[i].key == DME_KEY_EMPTY)
+			continue;
+		slot = dme_slot(dme, old[i].key);
+		*slot = old[i];
+	}
+	free(old);
+
+	return 0;
+}
+
+int dme_set(struct gbsim_dme *dme, uint16_t attr, uint16_t selector,
+	    uint32_t value)
+{
+	uint32_t key = DME_KEY(attr, selector);
+	struct gbsim_dme_entry *slot;
+	int ret;
+
+	/* That key marks free slots, and UniPro has no such attribute */
+	if (key == DME_KEY_EMPTY)
+		return -EINVAL;
+
+	slot = dme_slot(dme, key);
+	if (slot->key == DME_KEY_EMPTY) {
+		/* Keep the load factor under 3/4 */
+		if ((dme->count + 1) * 4 > (dme->mask + 1) * 3) {
+			ret = dme_resize(dme, (dme->mask + 1) * 2);
+			if (ret)
+				return ret;
+			slot = dme_slot(dme, key);
+		}
+		slot->key = key;
+		dme->count++;
+	}
+	slot->value = value;
+
+	return 0;
+}
+
+/* Attributes never written read back as zero, like reset UniPro registers */
+uint32_t dme_get(struct gbsim_dme *dme, uint16_t attr, uint16_t selector)
+{
+	struct gbsim_dme_entry *slot;
+
+	if (!dme->slots)
+		return 0;
+
+	slot = dme_slot(dme, DME_KEY(attr, selector));
+
+	return slot->key == DME_KEY_EMPTY ? 0 : slot->value;
+}
+
+/*
+ * Reload what the bridge firmware reports when it has just booted: the
+ * init status the AP checks (and clears) on every activation.
+ */
+void dme_boot(struct gbsim_dme *dme)
+{
+	uint32_t status = GB_INIT_TRUSTED_SPI_BOOT_FINISHED << 24;
+
+	dme_set(dme, DME_TOSHIBA_GMP_INIT_STATUS, DME_SELECTOR_INDEX_NULL,
+		status);
+	dme_set(dme, T_TSTSRCINCREMENT, DME_SELECTOR_INDEX_NULL, status);
+}
+
+int dme_init(struct gbsim_dme *dme, uint8_t intf_id)
+{
+	int ret;
+	int i;
+
+	dme->slots = NULL;
+	dme->count = 0;
+
+	ret = dme_resize(dme, DME_MIN_SLOTS);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < sizeof(dme_defaults) / sizeof(dme_defaults[0]); i++)
+		dme_set(dme, dme_defaults[i].attr, DME_SELECTOR_INDEX_NULL,
+			dme_defaults[i].value);
+
+	/* Give each interface a distinct serial number */
+	dme_set(dme, DME_TOSHIBA_GMP_SN0, DME_SELECTOR_INDEX_NULL, intf_id);
+	dme_boot(dme);
+
+	return 0;
+}
+
+void dme_free(struct gbsim_dme *dme)
+{
+	free(dme->slots);
+	dme->slots = NULL;
+	dme->count = 0;
+}
+
+void dme_get_pwr_mode(struct gbsim_dme *dme, struct gbsim_pwr_mode *pm)
+{
+	uint32_t pwrmode = dme_get(dme, PA_PWRMODE, DME_SELECTOR_INDEX_NULL);
+
+	pm->tx_mode = PA_PWRMODE_TX(pwrmode);
+	pm->rx_mode = PA_PWRMODE_RX(pwrmode);
+	pm->tx_gear = dme_get(dme, PA_TXGEAR, DME_SELECTOR_INDEX_NULL);
+	pm->rx_gear = dme_get(dme, PA_RXGEAR, DME_SELECTOR_INDEX_NULL);
+	pm->tx_nlanes = dme_get(dme, PA_ACTIVETXDATALANES,
+				DME_SELECTOR_INDEX_NULL);
+	pm->rx_nlanes = dme_get(dme, PA_ACTIVERXDATALANES,
+				DME_SELECTOR_INDEX_NULL);
+	pm->hs_series = dme_get(dme, PA_HSSERIES, DME_SELECTOR_INDEX_NULL);
+}
+
+void dme_set_pwr_mode(struct gbsim_dme *dme, const struct gbsim_pwr_mode *pm)
+{
+	dme_set(dme, PA_TXGEAR, DME_SELECTOR_INDEX_NULL, pm->tx_gear);
+	dme_set(dme, PA_RXGEAR, DME_SELECTOR_INDEX_NULL, pm->rx_gear);
+	dme_set(dme, PA_ACTIVETXDATALANES, DME_SELECTOR_INDEX_NULL,
+		pm->tx_nlanes);
+	dme_set(dme, PA_ACTIVERXDATALANES, DME_SELECTOR_INDEX_NULL,
+		pm->rx_nlanes);
+	dme_set(dme, PA_HSSERIES, DME_SELECTOR_INDEX_NULL, pm->hs_series);
+	dme_set(dme, PA_PWRMODE, DME_SELECTOR_INDEX_NULL,
+		PA_PWRMODE_VAL(pm->rx_mode, pm->tx_mode));
+}
+
+int dme_snapshot_save(struct gbsim_dme *dme, struct gbsim_snapshot *snap,
+		      uint32_t id)
+{
+	return snapshot_write(snap, SNAPSHOT_TAG('D', 'M', 'E', ' '), id,
+			      dme->slots, (dme->mask + 1) * sizeof(*dme->slots));
+}
+
+/* Set every attribute saved for @intf_id, on top of the defaults */
+void dme_snapshot_restore(struct gbsim_dme *dme, struct gbsim_snapshot *snap,
+			  uint32_t id)
+{
+	struct gbsim_dme_entry *slots;
+	size_t size = 0;
+	int i;
+
+	slots = snapshot_load(snap, SNAPSHOT_TAG('D', 'M', 'E', ' '), id,
+			      &size);
+	if (!slots)
+		return;
+
+	for (i = 0; i < size / sizeof(*slots); i++)
+		if (slots[i].key != DME_KEY_EMPTY)
+			dme_set(dme, slots[i].key >> 16, slots[i].key & 0xffff,
+				slots[i].value);
+	free(slots);
+}
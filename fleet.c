@@ -0,0 +1,444 @@
+/*
+ * Greybus Simulator: fleet configuration
+ *
+ * Instantiate a set of modules described in a libconfig file directly in
+ * memory, without going through the inotify hotplug directory.  Every
+ * bridge gets the whole fleet, replayed by a thread of its own.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <libconfig.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gbsim.h"
+
+/*
+ * Example:
+ *
+ * modules = (
+ *	{
+ *		manifest = "simple-i2c-module.mnfb";
+ *		interface_id = 3;	# optional, next free id otherwise
+ *		count = 4;		# optional, instantiate 4 copies
+ *		insert_ms = 0;		# delay after the SVC hello
+ *		interval_ms = 100;	# delay between two copies
+ *		remove_ms = 5000;	# optional, lifetime of each copy
+ *		cports = (
+ *			{ id = 1; i2c_adapter = 2; }
+ *		);
+ *	}
+ * );
+ *
+ * Manifest paths are relative to the directory holding the configuration
+ * file.
+ */
+
+#define FLEET_MODULES_MAX	256
+
+struct fleet_manifest {
+	char *path;
+	struct greybus_manifest_header *mh;
+};
+
+struct fleet_module {
+	struct fleet_manifest *manifest;
+	int intf_id;
+	unsigned int insert_ms;
+	unsigned int remove_ms;
+	struct gbsim_cport_params *cports;
+	int ncports;
+};
+
+struct fleet_event {
+	unsigned int when_ms;
+	bool insert;
+	struct fleet_module *module;
+};
+
+static struct fleet_manifest manifests[FLEET_MODULES_MAX];
+static int manifest_count;
+static struct fleet_module modules[FLEET_MODULES_MAX];
+static int module_count;
+static struct fleet_event events[2 * FLEET_MODULES_MAX];
+static int event_count;
+
+static pthread_t fleet_pthread[GBSIM_MAX_BRIDGES];
+static int thread_started[GBSIM_MAX_BRIDGES];
+
+/* Interface ids each bridge ended up with, by module, -1 if not inserted */
+static int fleet_intf_ids[GBSIM_MAX_BRIDGES][FLEET_MODULES_MAX];
+
+static struct fleet_manifest *fleet_get_manifest(const char *dir,
+						 const char *name)
+{
+	char path[PATH_MAX];
+	int i;
+
+	if (name[0] == '/')
+		snprintf(path, sizeof(path), "%s", name);
+	else
+		snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+	for (i = 0; i < manifest_count; i++)
+		if (!strcmp(manifests[i].path, path))
+			return &manifests[i];
+
+	if (manifest_count == FLEET_MODULES_MAX) {
+		gbsim_error("fleet: too many manifests (max %d)\n",
+			    FLEET_MODULES_MAX);
+		return NULL;
+	}
+
+	manifests[i].mh = manifest_load(path);
+	if (!manifests[i].mh)
+		return NULL;
+	manifests[i].path = strdup(path);
+	manifest_count++;
+
+	return &manifests[i];
+}
+
+static int fleet_parse_cports(config_setting_t *list,
+			      struct gbsim_cport_params **cports)
+{
+	config_setting_t *elem;
+	struct gbsim_cport_params *p;
+	int count, i, id;
+
+	*cports = NULL;
+	if (!list)
+		return 0;
+
+	count = config_setting_length(list);
+	if (!count)
+		return 0;
+
+	p = calloc(count, sizeof(*p));
+	if (!p)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i++) {
+		elem = config_setting_get_elem(list, i);
+		if (!config_setting_lookup_int(elem, "id", &id)) {
+			gbsim_error("fleet: cport entry %d has no id\n", i);
+			free(p);
+			return -EINVAL;
+		}
+		p[i].cport_id = id;
+		p[i].i2c_adapter = -1;
+		p[i].uart_portno = -1;
+		config_setting_lookup_int(elem, "i2c_adapter", &p[i].i2c_adapter);
+		config_setting_lookup_int(elem, "uart_portno", &p[i].uart_portno);
+	}
+
+	*cports = p;
+	return count;
+}
+
+static int fleet_parse_module(config_setting_t *entry, const char *dir)
+{
+	struct fleet_manifest *manifest;
+	struct gbsim_cport_params *cports;
+	struct fleet_module *module;
+	const char *name;
+	int intf_id = -1, count = 1, insert_ms = 0, interval_ms = 0;
+	int remove_ms = 0;
+	int ncports, i;
+
+	if (!config_setting_lookup_string(entry, "manifest", &name)) {
+		gbsim_error("fleet: module without manifest (line %d)\n",
+			    config_setting_source_line(entry));
+		return -EINVAL;
+	}
+
+	manifest = fleet_get_manifest(dir, name);
+	if (!manifest)
+		return -EINVAL;
+
+	config_setting_lookup_int(entry, "interface_id", &intf_id);
+	config_setting_lookup_int(entry, "count", &count);
+	config_setting_lookup_int(entry, "insert_ms", &insert_ms);
+	config_setting_lookup_int(entry, "interval_ms", &interval_ms);
+	config_setting_lookup_int(entry, "remove_ms", &remove_ms);
+
+	ncports = fleet_parse_cports(config_setting_get_member(entry, "cports"),
+				     &cports);
+	if (ncports < 0)
+		return ncports;
+
+	if (count <= 0) {
+		free(cports);
+		return 0;
+	}
+
+	/* Interface 0 is the SVC's */
+	if (intf_id >= 0 && (intf_id < 1 || intf_id + count - 1 > 255)) {
+		gbsim_error("fleet: interface ids %d to %d out of 1..255 (line %d)\n",
+			    intf_id, intf_id + count - 1,
+			    config_setting_source_line(entry));
+		free(cports);
+		return -EINVAL;
+	}
+
+	/* The copies share cports, all of them fit or none */
+	if (count > FLEET_MODULES_MAX - module_count) {
+		gbsim_error("fleet: too many modules (max %d)\n",
+			    FLEET_MODULES_MAX);
+		free(cports);
+		return -ENOSPC;
+	}
+
+	for (i = 0; i < count; i++) {
+		module = &modules[module_count++];
+		module->manifest = manifest;
+		module->intf_id = intf_id < 0 ? -1 : intf_id + i;
+		module->insert_ms = insert_ms + i * interval_ms;
+		module->remove_ms = remove_ms > 0 ?
+				    module->insert_ms + remove_ms : 0;
+		module->cports = cports;
+		module->ncports = ncports;
+	}
+
+	return 0;
+}
+
+static int fleet_event_cmp(const void *a, const void *b)
+{
+	const struct fleet_event *ea = a, *eb = b;
+
+	if (ea->when_ms != eb->when_ms)
+		return ea->when_ms < eb->when_ms ? -1 : 1;
+
+	/* Keep insertions ahead of removals happening at the same time */
+	return eb->insert - ea->insert;
+}
+
+static void fleet_build_schedule(void)
+{
+	struct fleet_module *module;
+	int i;
+
+	for (i = 0; i < module_count; i++) {
+		module = &modules[i];
+
+		events[event_count].when_ms = module->insert_ms;
+		events[event_count].insert = true;
+		events[event_count++].module = module;
+
+		if (!module->remove_ms)
+			continue;
+
+		events[event_count].when_ms = module->remove_ms;
+		events[event_count].insert = false;
+		events[event_count++].module = module;
+	}
+
+	qsort(events, event_count, sizeof(events[0]), fleet_event_cmp);
+}
+
+int fleet_load(const char *path)
+{
+	config_setting_t *list;
+	config_t cfg;
+	char *tmp, *dir;
+	int count, i;
+	int ret = 0;
+
+	config_init(&cfg);
+	if (!config_read_file(&cfg, path)) {
+		gbsim_error("fleet: %s:%d: %s\n", path, config_error_line(&cfg),
+			    config_error_text(&cfg));
+		config_destroy(&cfg);
+		return -EINVAL;
+	}
+
+	list = config_lookup(&cfg, "modules");
+	if (!list) {
+		gbsim_error("fleet: %s has no modules list\n", path);
+		config_destroy(&cfg);
+		return -EINVAL;
+	}
+
+	tmp = strdup(path);
+	if (!tmp) {
+		config_destroy(&cfg);
+		return -ENOMEM;
+	}
+	dir = dirname(tmp);
+
+	count = config_setting_length(list);
+	for (i = 0; i < count; i++) {
+		ret = fleet_parse_module(config_setting_get_elem(list, i), dir);
+		if (ret < 0)
+			break;
+	}
+
+	free(tmp);
+	config_destroy(&cfg);
+
+	if (ret < 0)
+		return ret;
+
+	fleet_build_schedule();
+	gbsim_info("fleet: %d modules from %s\n", module_count, path);
+
+	return 0;
+}
+
+static struct gbsim_cport_params *fleet_copy_cports(struct fleet_module *module)
+{
+	struct gbsim_cport_params *p;
+	size_t size = module->ncports * sizeof(*p);
+
+	if (!size)
+		return NULL;
+
+	p = malloc(size);
+	if (p)
+		memcpy(p, module->cports, size);
+
+	return p;
+}
+
+static void fleet_insert(struct gbsim_svc *svc, struct fleet_module *module)
+{
+	struct greybus_manifest_header *mh = module->manifest->mh;
+	struct gbsim_cport_params *cports;
+	struct gbsim_interface *intf;
+	void *blob;
+	int intf_id;
+	int *remembered = &fleet_intf_ids[svc->bridge->id][module - modules];
+
+	blob = malloc(le16toh(mh->size));
+	if (!blob)
+		return;
+	memcpy(blob, mh, le16toh(mh->size));
+
+	intf_id = module->intf_id;
+	if (intf_id < 0)
+		intf_id = svc_get_next_intf_id(svc);
+
+	cports = fleet_copy_cports(module);
+	intf = interface_hotplug(svc, intf_id, 0, blob, cports,
+				 cports ? module->ncports : 0);
+	if (!intf)
+		return;
+
+	/* Remember the id we ended up with, for the removal */
+	*remembered = intf_id;
+	gbsim_info("%s Interface %d inserted\n", module->manifest->path,
+		   intf_id);
+}
+
+static void fleet_remove(struct gbsim_svc *svc, struct fleet_module *module)
+{
+	int *remembered = &fleet_intf_ids[svc->bridge->id][module - modules];
+	int intf_id = *remembered;
+	struct gbsim_interface *intf;
+
+	/* The insert failed or was skipped, there's nothing to remove */
+	if (intf_id < 0)
+		return;
+	*remembered = -1;
+
+	intf = interface_get_by_id(svc, intf_id);
+	if (!intf) {
+		gbsim_error("fleet: interface %d not present\n", intf_id);
+		return;
+	}
+
+	interface_hotunplug(svc, intf);
+	gbsim_info("Interface %d removed\n", intf_id);
+}
+
+static void *fleet_thread(void *param)
+{
+	struct gbsim_svc *svc = param;
+	struct fleet_event *event;
+	struct timespec start, ts;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < event_count; i++) {
+		event = &events[i];
+
+		ts.tv_sec = start.tv_sec + event->when_ms / 1000;
+		ts.tv_nsec = start.tv_nsec + (event->when_ms % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+				       NULL) == EINTR)
+			;
+
+		if (event->insert)
+			fleet_insert(svc, event->module);
+		else
+			fleet_remove(svc, event->module);
+	}
+
+	return NULL;
+}
+
+int fleet_start(struct gbsim_svc *svc)
+{
+	int id = svc->bridge->id;
+	int i, ret;
+
+	if (!event_count || thread_started[id])
+		return 0;
+
+	/* Nothing inserted yet */
+	for (i = 0; i < module_count; i++)
+		fleet_intf_ids[id][i] = -1;
+
+	ret = pthread_create(&fleet_pthread[id], NULL, fleet_thread, svc);
+	if (ret) {
+		gbsim_error("can't create fleet thread: %s\n", strerror(ret));
+		return -ret;
+	}
+	thread_started[id] = 1;
+
+	return 0;
+}
+
+void fleet_cleanup(void)
+{
+	struct gbsim_cport_params *cports = NULL;
+	int i;
+
+	for (i = 0; i < GBSIM_MAX_BRIDGES; i++) {
+		if (!thread_started[i])
+			continue;
+		pthread_cancel(fleet_pthread[i]);
+		pthread_join(fleet_pthread[i], NULL);
+		thread_started[i] = 0;
+	}
+
+	/* Copies of the same entry share their parameter array */
+	for (i = 0; i < module_count; i++) {
+		if (modules[i].cports != cports) {
+			cports = modules[i].cports;
+			free(cports);
+		}
+	}
+
+	for (i = 0; i < manifest_count; i++) {
+		free(manifests[i].path);
+		free(manifests[i].mh);
+	}
+
+	module_count = 0;
+	manifest_count = 0;
+	event_count = 0;
+}
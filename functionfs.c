@@ -7,11 +7,13 @@
  * Provided under the three clause BSD license found in the LICENSE file.
  */
 
+#define _GNU_SOURCE
 #include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,11 +30,11 @@
 #include "arpc.h"
 #include "config.h"
 
-#define FFS_PREFIX		"/dev/ffs-gbsim/"
-#define FFS_GBEMU_EP0		FFS_PREFIX"ep0"
-#define FFS_GBEMU_IN		FFS_PREFIX"ep1"
-#define FFS_GBEMU_IN_ARPC	FFS_PREFIX"ep2"
-#define FFS_GBEMU_OUT		FFS_PREFIX"ep3"
+#define FFS_PREFIX		"/dev/ffs-"
+#define FFS_GBEMU_EP0		"ep0"
+#define FFS_GBEMU_IN		"ep1"
+#define FFS_GBEMU_IN_ARPC	"ep2"
+#define FFS_GBEMU_OUT		"ep3"
 
 #define STR_INTERFACE	"gbsim"
 
@@ -54,13 +56,16 @@
 #define REQUEST_LATENCY_TAG_EN	0x06
 #define REQUEST_LATENCY_TAG_DIS	0x07
 
-int control = -ENXIO;
-int to_ap = -ENXIO;
-int to_ap_arpc = -ENXIO;
-int from_ap = -ENXIO;
+static struct gbsim_bridge bridges[GBSIM_MAX_BRIDGES];
+int bridge_count = 1;
 
-static pthread_t recv_pthread;
+struct gbsim_bridge *bridge_get(int id)
+{
+	if (id < 0 || id >= bridge_count)
+		return NULL;
 
+	return &bridges[id];
+}
 
 /*
  * Descriptors:
@@ -202,53 +207,73 @@ void cleanup_endpoint(int ep_fd, char *ep_name)
 		gbsim_error("%s: close \n", ep_name);
 }
 
-static int enable_endpoints(void)
+static int open_endpoint(struct gbsim_bridge *bridge, const char *name)
+{
+	char path[sizeof(bridge->ffs_path) + 4];
+
+	snprintf(path, sizeof(path), "%s%s", bridge->ffs_path, name);
+
+	return open(path, O_RDWR);
+}
+
+static int enable_endpoints(struct gbsim_bridge *bridge)
 {
 	int ret;
 
 	/* Start Bulk In/Out endpoints here */
-	gbsim_debug("Start Bulk In/Out endpoints\n");
+	gbsim_debug("Start Bulk In/Out endpoints of bridge %d\n", bridge->id);
 
-	to_ap = open(FFS_GBEMU_IN, O_RDWR);
-	if (to_ap < 0)
-		return to_ap;
+	bridge->to_ap = open_endpoint(bridge, FFS_GBEMU_IN);
+	if (bridge->to_ap < 0)
+		return bridge->to_ap;
 
-	to_ap_arpc = open(FFS_GBEMU_IN_ARPC, O_RDWR);
-	if (to_ap_arpc < 0)
-		return to_ap_arpc;
+	bridge->to_ap_arpc = open_endpoint(bridge, FFS_GBEMU_IN_ARPC);
+	if (bridge->to_ap_arpc < 0)
+		return bridge->to_ap_arpc;
 
-	from_ap = open(FFS_GBEMU_OUT, O_RDWR);
-	if (from_ap < 0)
-		return from_ap;
+	bridge->from_ap = open_endpoint(bridge, FFS_GBEMU_OUT);
+	if (bridge->from_ap < 0)
+		return bridge->from_ap;
 
-	ret = pthread_create(&recv_pthread, NULL, recv_thread, NULL);
-	if (ret < 0) {
-		perror("can't create cport thread");
-		return ret;
+	ret = pthread_create(&bridge->recv_pthread, NULL, recv_thread, bridge);
+	if (ret) {
+		gbsim_error("can't create cport thread: %s\n", strerror(ret));
+		return -ret;
 	}
+	bridge->recv_started = true;
 
 	return 0;
 }
 
-static void disable_endpoints(void)
+/* Stop handling the messages from the AP, the endpoints stay open */
+void functionfs_stop(struct gbsim_bridge *bridge)
+{
+	if (!bridge->recv_started)
+		return;
+
+	pthread_cancel(bridge->recv_pthread);
+	pthread_join(bridge->recv_pthread, NULL);
+	bridge->recv_started = false;
+}
+
+static void disable_endpoints(struct gbsim_bridge *bridge)
 {
-	gbsim_debug("Disable CPort endpoints\n");
+	gbsim_debug("Disable CPort endpoints of bridge %d\n", bridge->id);
 
-	if (to_ap < 0 || from_ap < 0)
+	if (bridge->to_ap < 0 || bridge->from_ap < 0)
 		return;
 
-	pthread_cancel(recv_pthread);
-	pthread_join(recv_pthread, NULL);
+	functionfs_stop(bridge);
 
-	close(from_ap);
-	from_ap = -EINVAL;
-	close(to_ap_arpc);
-	to_ap_arpc = -EINVAL;
-	close(to_ap);
-	to_ap = -EINVAL;
+	close(bridge->from_ap);
+	bridge->from_ap = -EINVAL;
+	close(bridge->to_ap_arpc);
+	bridge->to_ap_arpc = -EINVAL;
+	close(bridge->to_ap);
+	bridge->to_ap = -EINVAL;
 }
 
-static int dump_control_msg(const struct usb_ctrlrequest *setup)
+static int dump_control_msg(int control, const struct usb_ctrlrequest *setup)
 {
 	uint8_t buf[256];
 	int count, i;
@@ -268,7 +293,8 @@ static int dump_control_msg(const struct usb_ctrlrequest *setup)
 	return count;
 }
 
-static void arpc_response_send(const struct usb_ctrlrequest *setup)
+static void arpc_response_send(struct gbsim_bridge *bridge,
+			       const struct usb_ctrlrequest *setup)
 {
 	uint8_t buf[256];
 	struct arpc_request_message *arpc_req;
@@ -281,7 +307,7 @@ static void arpc_response_send(const struct usb_ctrlrequest *setup)
 		gbsim_debug("arpc run received with the wrong size: %u : %lu\n",
 			    arpc_size, sizeof(*arpc_req));
 
-	count = read(control, buf, arpc_size);
+	count = read(bridge->control, buf, arpc_size);
 	if (count < 0) {
 		perror("ARPC: Failed to read\n");
 		return;
@@ -302,19 +328,71 @@ static void arpc_response_send(const struct usb_ctrlrequest *setup)
 	arpc_rsp.id = arpc_req->id;
 	arpc_rsp.result = ARPC_SUCCESS;
 
-	count = write(to_ap_arpc, &arpc_rsp,
+	count = write(bridge->to_ap_arpc, &arpc_rsp,
 		      sizeof(struct arpc_response_message));
 	if (count < 0)
 		perror("ARPC: Failed to write\n");
 }
 
-static void handle_setup(const struct usb_ctrlrequest *setup)
+/* The AP bridge takes part in TimeSync as interface 0 */
+static void timesync_request(struct gbsim_bridge *bridge,
+			     const struct usb_ctrlrequest *setup)
 {
+	struct gbsim_interface *intf = bridge->svc->intf;
+	int control = bridge->control;
+	uint8_t buf[sizeof(struct gb_control_timesync_authoritative_request)];
+	struct gb_control_timesync_enable_request *enable = (void *)buf;
+	struct gb_control_timesync_authoritative_request *auth = (void *)buf;
+	uint64_t frame_time[GB_TIMESYNC_MAX_STROBES];
+	uint16_t len = le16toh(setup->wLength);
+	uint64_t last_event;
+	int i, ret;
+
+	memset(buf, 0, sizeof(buf));
+	if (len > sizeof(buf))
+		len = sizeof(buf);
+
+	switch (setup->bRequest) {
+	case GB_APB_REQUEST_TIMESYNC_ENABLE:
+		if (read(control, buf, len) < (ssize_t)sizeof(*enable)) {
+			gbsim_error("short timesync enable request\n");
+			return;
+		}
+		timesync_intf_enable(intf, enable->count,
+				     le64toh(enable->frame_time),
+				     le32toh(enable->strobe_delay),
+				     le32toh(enable->refclk));
+		break;
+	case GB_APB_REQUEST_TIMESYNC_DISABLE:
+		timesync_intf_disable(intf);
+		break;
+	case GB_APB_REQUEST_TIMESYNC_AUTHORITATIVE:
+		if (read(control, buf, len) < (ssize_t)sizeof(*auth)) {
+			gbsim_error("short timesync authoritative request\n");
+			return;
+		}
+		for (i = 0; i < GB_TIMESYNC_MAX_STROBES; i++)
+			frame_time[i] = le64toh(auth->frame_time[i]);
+		timesync_intf_authoritative(intf, frame_time);
+		break;
+	case GB_APB_REQUEST_TIMESYNC_GET_LAST_EVENT:
+		last_event = htole64(timesync_intf_last_event(intf));
+		ret = write(control, &last_event, sizeof(last_event));
+		if (ret < 0)
+			perror("timesync last event write failed\n");
+		break;
+	}
+}
+
+static void handle_setup(struct gbsim_bridge *bridge,
+			 const struct usb_ctrlrequest *setup)
+{
+	int control = bridge->control;
 	uint16_t count;
 	int ret;
 
 	if (verbose) {
-		gbsim_debug("AP->AP Bridge setup message:\n");
+		gbsim_debug("AP->AP Bridge %d setup message:\n", bridge->id);
 		gbsim_debug("  bRequestType = %02x\n", setup->bRequestType);
 		gbsim_debug("  bRequest     = %02x\n", setup->bRequest);
 		gbsim_debug("  wValue       = %04x\n", le16toh(setup->wValue));
@@ -332,7 +410,7 @@ static void handle_setup(const struct usb_ctrlrequest *setup)
 		gbsim_debug("log request, nothing to do\n");
 		break;
 	case REQUEST_EP_MAPPING:
-		dump_control_msg(setup);
+		dump_control_msg(control, setup);
 		gbsim_debug("ep_mapping request, nothing to do\n");
 		break;
 	case REQUEST_CPORT_COUNT:
@@ -346,39 +424,47 @@ static void handle_setup(const struct usb_ctrlrequest *setup)
 		 * - Send a svc protocol version request
 		 * - For a valid response, send the 'hello' message.
 		 */
-		ret = svc_request_send(GB_REQUEST_TYPE_PROTOCOL_VERSION, AP_INTF_ID);
+		ret = svc_request_send(bridge->svc,
+				       GB_REQUEST_TYPE_PROTOCOL_VERSION,
+				       AP_INTF_ID);
 		if (ret)
 			gbsim_error("Failed to send svc version request (%d)\n", ret);
 
 		break;
 	case REQUEST_RESET_CPORT:
-		dump_control_msg(setup);
+		dump_control_msg(control, setup);
 		gbsim_debug("reset_cport request for cport: %04x\n",
 			    le16toh(setup->wValue));
 		break;
 	case REQUEST_LATENCY_TAG_EN:
-		dump_control_msg(setup);
+		dump_control_msg(control, setup);
 		gbsim_debug("latency_tag_en request for cport: %04x\n",
 			    le16toh(setup->wValue));
 		break;
 	case REQUEST_LATENCY_TAG_DIS:
-		dump_control_msg(setup);
+		dump_control_msg(control, setup);
 		gbsim_debug("latency_tag_dis request for cport: %04x\n",
 			    le16toh(setup->wValue));
 		break;
 	case GB_APB_REQUEST_CPORT_FLAGS:
-		dump_control_msg(setup);
+		dump_control_msg(control, setup);
 		gbsim_debug("cport flags request, nothing to do\n");
 		break;
 	case GB_APB_REQUEST_ARPC_RUN:
-		arpc_response_send(setup);
+		arpc_response_send(bridge, setup);
+		break;
+	case GB_APB_REQUEST_TIMESYNC_ENABLE:
+	case GB_APB_REQUEST_TIMESYNC_DISABLE:
+	case GB_APB_REQUEST_TIMESYNC_AUTHORITATIVE:
+	case GB_APB_REQUEST_TIMESYNC_GET_LAST_EVENT:
+		timesync_request(bridge, setup);
 		break;
 	default:
 		gbsim_error("Invalid request type %02x\n", setup->bRequest);
 	}
 }
 
-static int read_control(void)
+static int read_control(struct gbsim_bridge *bridge)
 {
 	struct usb_functionfs_event event[NEVENT];
 	int i, nevent, ret;
@@ -393,7 +479,7 @@ static int read_control(void)
 		[FUNCTIONFS_RESUME] = "RESUME",
 	};
 
-	ret = read(control, &event, sizeof(event));
+	ret = read(bridge->control, &event, sizeof(event));
 	if (ret < 0) {
 		if (errno == EAGAIN) {
 			sleep(1);
@@ -405,7 +491,8 @@ static int read_control(void)
 	nevent = ret/ sizeof event[0];
 
 	for (i = 0; i < nevent; i++) {
-		gbsim_debug("USB %s\n", names[event[i].type]);
+		gbsim_debug("USB %s on bridge %d\n", names[event[i].type],
+			    bridge->id);
 
 		switch (event[i].type) {
 		case FUNCTIONFS_BIND:
@@ -413,13 +500,13 @@ static int read_control(void)
 		case FUNCTIONFS_UNBIND:
 			break;
 		case FUNCTIONFS_ENABLE:
-			enable_endpoints();
+			enable_endpoints(bridge);
 			break;
 		case FUNCTIONFS_DISABLE:
-			disable_endpoints();
+			disable_endpoints(bridge);
 			break;
 		case FUNCTIONFS_SETUP:
-			handle_setup(&event[i].u.setup);
+			handle_setup(bridge, &event[i].u.setup);
 			break;
 		case FUNCTIONFS_SUSPEND:
 			break;
@@ -433,60 +520,75 @@ static int read_control(void)
 	return ret;
 }
 
-static void functionfs_init_gb(void)
+static void functionfs_init_gb(struct gbsim_bridge *bridge)
 {
+	char path[sizeof(bridge->ffs_path) + 4];
 	int ret;
 
-	control = open(FFS_GBEMU_EP0, O_RDWR);
-	if (control < 0) {
-		perror(FFS_GBEMU_EP0);
-		control = -errno;
+	snprintf(path, sizeof(path), "%s%s", bridge->ffs_path, FFS_GBEMU_EP0);
+
+	bridge->control = open(path, O_RDWR);
+	if (bridge->control < 0) {
+		perror(path);
+		bridge->control = -errno;
 		return;
 	}
 
-	ret = write(control, &descriptors, sizeof(descriptors));
+	ret = write(bridge->control, &descriptors, sizeof(descriptors));
 	if (ret < 0) {
 		perror("write dev descriptors");
-		close(control);
-		control = -errno;
+		close(bridge->control);
+		bridge->control = -errno;
 		return;
 	}
 
-	ret = write(control, &strings, sizeof(strings));
+	ret = write(bridge->control, &strings, sizeof(strings));
 	if (ret < 0) {
 		perror("write dev strings");
-		close(control);
-		control = -errno;
+		close(bridge->control);
+		bridge->control = -errno;
 		return;
 	}
 
 	return;
 }
 
-int functionfs_loop(void)
+/*
+ * Serve the control endpoints of all the bridges.  The exit signals are
+ * blocked everywhere but here, so they only ever interrupt this poll and
+ * the main thread can shut down on its own.
+ */
+int functionfs_loop(const sigset_t *sigmask)
 {
-	struct pollfd ep_poll[1];
-	int ret;
+	struct pollfd ep_poll[GBSIM_MAX_BRIDGES];
+	int i, ret;
 
 	do {
 		/* Always listen on control */
-		ep_poll[0].fd = control;
-		ep_poll[0].events = POLLIN | POLLHUP;
+		for (i = 0; i < bridge_count; i++) {
+			ep_poll[i].fd = bridges[i].control;
+			ep_poll[i].events = POLLIN | POLLHUP;
+		}
 
-		ret = poll(ep_poll, 1, -1);
+		ret = ppoll(ep_poll, bridge_count, NULL, sigmask);
+		if (ret < 0 && errno == EINTR) {
+			if (exit_requested)
+				break;
+			continue;
+		}
 		if (ret < 0) {
 			perror("poll");
 			break;
 		}
 
-		/* TODO: What to do with HUP? */
-		if (ep_poll[0].revents & POLLIN) {
-			ret = read_control();
-			if (ret < 0) {
-				if (errno == EAGAIN)
-					continue;
+		for (i = 0; i < bridge_count; i++) {
+			/* TODO: What to do with HUP? */
+			if (!(ep_poll[i].revents & POLLIN))
+				continue;
+
+			ret = read_control(&bridges[i]);
+			if (ret < 0 && errno != EAGAIN)
 				goto done;
-			}
 		}
 	} while (1);
 
@@ -496,19 +598,46 @@ done:
 	return ret;
 }
 
-int functionfs_init(void)
+/*
+ * Bridge 0 keeps the "gbsim" instance name, the others are "gbsim1",
+ * "gbsim2", ... each mounted at /dev/ffs-<name>/.
+ */
+struct gbsim_bridge *bridge_init(int id)
+{
+	struct gbsim_bridge *bridge = &bridges[id];
+
+	bridge->id = id;
+	if (id)
+		snprintf(bridge->ffs_name, sizeof(bridge->ffs_name),
+			 STR_INTERFACE "%d", id);
+	else
+		snprintf(bridge->ffs_name, sizeof(bridge->ffs_name),
+			 STR_INTERFACE);
+	strcpy(bridge->ffs_path, FFS_PREFIX);
+	strcat(bridge->ffs_path, bridge->ffs_name);
+	strcat(bridge->ffs_path, "/");
+
+	bridge->control = -ENXIO;
+	bridge->to_ap = -ENXIO;
+	bridge->to_ap_arpc = -ENXIO;
+	bridge->from_ap = -ENXIO;
+
+	return bridge;
+}
+
+int functionfs_init(struct gbsim_bridge *bridge)
 {
 	/* Mount functionfs */
-	mkdir(FFS_PREFIX, S_IRWXU|S_IRWXG|S_IRWXO);
-	mount("gbsim", FFS_PREFIX, "functionfs", 0, NULL);
+	mkdir(bridge->ffs_path, S_IRWXU|S_IRWXG|S_IRWXO);
+	mount(bridge->ffs_name, bridge->ffs_path, "functionfs", 0, NULL);
 
 	/* Configure the Greybus emulator */
-	functionfs_init_gb();
+	functionfs_init_gb(bridge);
 
 	return 0;
 }
 
-void functionfs_cleanup(void)
+void functionfs_cleanup(struct gbsim_bridge *bridge)
 {
-	recv_thread_cleanup(NULL);
+	recv_thread_cleanup(bridge);
 }
@@ -102,6 +102,7 @@ static int fw_mgmt_handler_request(uint16_t cport_id, uint16_t hd_cport_id,
 	struct gb_fw_mgmt_backend_fw_version_response *fw_mgmt_backend_fw_ver_rsp;
 	struct gb_fw_mgmt_backend_fw_update_request *fw_mgmt_backend_fw_update_req;
 	uint16_t fw_download_hd_cport_id;
+	struct gbsim_svc *svc;
 	uint16_t message_size = sizeof(*oph);
 	size_t payload_size = 0;
 	uint8_t request_id = 0;
@@ -164,7 +165,9 @@ static int fw_mgmt_handler_request(uint16_t cport_id, uint16_t hd_cport_id,
 	if (ret)
 		return ret;
 
-	fw_download_hd_cport_id = find_hd_cport_for_protocol(0x17);
+	/* The download cport lives on the same bridge */
+	svc = connection_find(hd_cport_id)->intf->svc;
+	fw_download_hd_cport_id = find_hd_cport_for_protocol(svc, 0x17);
 
 	if (!fw_download_hd_cport_id) {
 		gbsim_error("%s: couldn't find hd_cport_id for firmware download cport (%d)\n",
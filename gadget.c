@@ -17,10 +17,28 @@
 #define VENDOR		0x18d1
 #define PRODUCT		0x1eaf
 
-int gadget_create(usbg_state **s, usbg_gadget **g)
+int gadget_init(usbg_state **s)
+{
+	int usbg_ret;
+
+	usbg_ret = usbg_init("/sys/kernel/config", s);
+	if (usbg_ret != USBG_SUCCESS) {
+		gbsim_error("Error on USB gadget init\n");
+		gbsim_error("Error: %s : %s\n", usbg_error_name(usbg_ret),
+			    usbg_strerror(usbg_ret));
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* Gadget "g<id + 1>" exposing the functionfs instance @ffs_name */
+int gadget_create(usbg_state *s, int id, const char *ffs_name,
+		  usbg_gadget **g)
 {
 	usbg_config *c;
 	usbg_function *f;
+	char name[16];
 	int ret = -EINVAL;
 	int usbg_ret;
 
@@ -45,15 +63,9 @@ int gadget_create(usbg_state **s, usbg_gadget **g)
 			"AP Bridge"
 	};
 
-	usbg_ret = usbg_init("/sys/kernel/config", s);
-	if (usbg_ret != USBG_SUCCESS) {
-		gbsim_error("Error on USB gadget init\n");
-		gbsim_error("Error: %s : %s\n", usbg_error_name(usbg_ret),
-			    usbg_strerror(usbg_ret));
-		goto out1;
-	}
+	snprintf(name, sizeof(name), "g%d", id + 1);
 
-	usbg_ret = usbg_create_gadget(*s, "g1", &g_attrs, &g_strs, g);
+	usbg_ret = usbg_create_gadget(s, name, &g_attrs, &g_strs, g);
 	if (usbg_ret != USBG_SUCCESS) {
 		gbsim_error("Error on create gadget\n");
 		gbsim_error("Error: %s : %s\n", usbg_error_name(usbg_ret),
@@ -61,7 +73,7 @@ int gadget_create(usbg_state **s, usbg_gadget **g)
 		goto out2;
 	}
 
-	usbg_ret = usbg_create_function(*g, F_FFS, "gbsim", NULL, &f);
+	usbg_ret = usbg_create_function(*g, F_FFS, ffs_name, NULL, &f);
 	if (usbg_ret != USBG_SUCCESS) {
 		gbsim_error("Error creating gbsim function\n");
 		gbsim_error("Error: %s : %s\n", usbg_error_name(usbg_ret),
@@ -77,7 +89,7 @@ int gadget_create(usbg_state **s, usbg_gadget **g)
 		goto out2;
 	}
 
-	usbg_ret = usbg_add_config_function(c, "gbsim", f);
+	usbg_ret = usbg_add_config_function(c, ffs_name, f);
 	if (usbg_ret != USBG_SUCCESS) {
 		gbsim_error("Error adding gbsim configuration\n");
 		gbsim_error("Error: %s : %s\n", usbg_error_name(usbg_ret),
@@ -85,23 +97,37 @@ int gadget_create(usbg_state **s, usbg_gadget **g)
 		goto out2;
 	}
 
-	gbsim_info("USB gadget created\n");
+	gbsim_info("USB gadget %s created\n", name);
 
 	return 0;
 
 out2:
-	gadget_cleanup(*s, *g);
+	gadget_cleanup(*g);
 
-out1:
 	return ret;
 }
 
-int gadget_enable(usbg_gadget *g)
+/* Bind gadget @id to the @id-th UDC, each bridge needs its own */
+int gadget_enable(usbg_state *s, int id, usbg_gadget *g)
 {
-	return usbg_enable_gadget(g, NULL);
+	usbg_udc *udc;
+	int i;
+
+	if (!id)
+		return usbg_enable_gadget(g, NULL);
+
+	udc = usbg_get_first_udc(s);
+	for (i = 0; udc && i < id; i++)
+		udc = usbg_get_next_udc(udc);
+	if (!udc) {
+		gbsim_error("no UDC left for gadget g%d\n", id + 1);
+		return -ENODEV;
+	}
+
+	return usbg_enable_gadget(g, udc);
 }
 
-void gadget_cleanup(usbg_state *s, usbg_gadget *g)
+void gadget_cleanup(usbg_gadget *g)
 {
 	gbsim_debug("gadget_cleanup\n");
 
@@ -109,6 +135,4 @@ void gadget_cleanup(usbg_state *s, usbg_gadget *g)
 		usbg_disable_gadget(g);
 		usbg_rm_gadget(g, USBG_RM_RECURSE);
 	}
-
-	usbg_cleanup(s);
 }
@@ -14,11 +14,14 @@
 #define __packed  __attribute__((__packed__))
 
 #include <endian.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <sys/queue.h>
 #include <stdint.h>
 #include <linux/types.h>
+#include <time.h>
 
 
 #ifndef BIT
@@ -37,7 +40,11 @@ extern int i2c_adapter;
 extern int uart_portno;
 extern int uart_count;
 extern int verbose;
+extern int link_model;
 extern char *hotplug_basedir;
+extern char *fleet_config;
+extern char *manifest_cache_dir;
+extern volatile sig_atomic_t exit_requested;
 
 /* Matches up with the Greybus Protocol specification document */
 #define GB_REQUEST_TYPE_PROTOCOL_VERSION 0x01
@@ -48,9 +55,61 @@ extern char *hotplug_basedir;
 #define ENDO_ID 0x4755
 #define AP_INTF_ID 0x5
 
-extern int control;
-extern int to_ap;
-extern int from_ap;
+/*
+ * AP bridges.  Each one is a USB gadget with its own functionfs instance,
+ * endpoints, receive thread and SVC, so the AP sees a separate Greybus
+ * host device for every bridge.  The AP numbers CPorts per bridge: inside
+ * the simulator a connection's hd_cport_id carries the bridge index in its
+ * high byte, which keeps it unique across bridges.
+ */
+#define GBSIM_MAX_BRIDGES	8
+#define ES1_MSG_SIZE		(2 * 1024)
+
+#define HD_CPORT(bridge, cport)	((uint16_t)((bridge) << 8 | (cport)))
+#define HD_CPORT_BRIDGE(hd)	((hd) >> 8)
+#define HD_CPORT_AP(hd)		((hd) & 0xff)
+
+struct gbsim_svc;
+
+struct gbsim_bridge {
+	int id;
+	char ffs_name[16];
+	char ffs_path[32];
+
+	int control;
+	int to_ap;
+	int to_ap_arpc;
+	int from_ap;
+
+	pthread_t recv_pthread;
+	bool recv_started;
+
+	struct gbsim_svc *svc;
+
+	/* Used by the receive thread only */
+	char rbuf[ES1_MSG_SIZE];
+	char tbuf[ES1_MSG_SIZE];
+};
+
+extern int bridge_count;
+struct gbsim_bridge *bridge_get(int id);
+
+/*
+ * Per-CPort backend parameters, as given in a fleet configuration file.
+ * A negative value means "use the process-wide default" (command line).
+ */
+struct gbsim_cport_params {
+	uint16_t cport_id;
+	int i2c_adapter;
+	int uart_portno;
+};
+
+struct gbsim_route;
+struct gbsim_snapshot;
+
+/* Snapshot section tags, four characters */
+#define SNAPSHOT_TAG(a, b, c, d)	((uint32_t)(a) | (uint32_t)(b) << 8 | \
+					 (uint32_t)(c) << 16 | (uint32_t)(d) << 24)
 
 struct gbsim_connection {
 	TAILQ_ENTRY(gbsim_connection) cnode;
@@ -59,6 +118,11 @@ struct gbsim_connection {
 	int protocol;
 
 	struct gbsim_interface *intf;
+	const struct gbsim_cport_params *params;
+	struct gbsim_route *route;
+
+	/* Protocol model state for this connection */
+	void *priv;
 };
 
 /* CPorts */
@@ -79,6 +143,9 @@ struct op_msg {
 		struct gb_control_get_manifest_response control_manifest_rsp;
 		struct gb_control_bundle_pm_response	control_bundle_pm_rsp;
 		struct gb_control_intf_pm_response	control_intf_pm_rsp;
+		struct gb_control_timesync_enable_request	control_ts_enable_req;
+		struct gb_control_timesync_authoritative_request control_ts_auth_req;
+		struct gb_control_timesync_get_last_event_response control_ts_last_event_rsp;
 		struct gb_svc_version_request		svc_version_request;
 		struct gb_svc_version_response		svc_version_response;
 		struct gb_svc_hello_request		hello_request;
@@ -95,12 +162,26 @@ struct op_msg {
 		struct gb_svc_route_create_request	svc_route_create_request;
 		struct gb_svc_route_destroy_request	svc_route_destroy_request;
 		struct gb_svc_pwrmon_rail_count_get_response	svc_pwrmon_rail_count_get_response;
+		struct gb_svc_pwrmon_rail_names_get_response	svc_pwrmon_rail_names_get_response;
+		struct gb_svc_pwrmon_sample_get_request		svc_pwrmon_sample_get_request;
+		struct gb_svc_pwrmon_sample_get_response	svc_pwrmon_sample_get_response;
+		struct gb_svc_pwrmon_intf_sample_get_request	svc_pwrmon_intf_sample_get_request;
+		struct gb_svc_pwrmon_intf_sample_get_response	svc_pwrmon_intf_sample_get_response;
 		struct gb_svc_intf_vsys_request		svc_intf_vsys_request;
 		struct gb_svc_intf_vsys_response	svc_intf_vsys_response;
+		struct gb_svc_intf_refclk_request	svc_intf_refclk_request;
 		struct gb_svc_intf_refclk_response	svc_intf_refclk_response;
+		struct gb_svc_intf_unipro_request	svc_intf_unipro_request;
 		struct gb_svc_intf_unipro_response	svc_intf_unipro_response;
+		struct gb_svc_intf_activate_request	svc_intf_activate_request;
 		struct gb_svc_intf_activate_response	svc_intf_activate_response;
+		struct gb_svc_intf_resume_request	svc_intf_resume_request;
 		struct gb_svc_intf_resume_response	svc_intf_resume_response;
+		struct gb_svc_intf_set_pwrm_request	svc_intf_set_pwrm_request;
+		struct gb_svc_timesync_enable_request	svc_timesync_enable_request;
+		struct gb_svc_timesync_authoritative_response	svc_timesync_authoritative_response;
+		struct gb_svc_timesync_wake_pins_acquire_request	svc_timesync_wake_pins_acquire_request;
+		struct gb_svc_timesync_ping_response	svc_timesync_ping_response;
 		struct gb_svc_intf_set_pwrm_response	svc_intf_set_pwrm_response;
 		struct gb_gpio_line_count_response	gpio_lc_rsp;
 		struct gb_gpio_activate_request		gpio_act_req;
@@ -228,14 +309,102 @@ struct gbsim_connection *allocate_connection(struct gbsim_interface *intf,
 					     uint16_t hd_cport_id);
 void connection_set_protocol(struct gbsim_connection *connection,
 			     uint16_t cport_id);
-uint16_t find_hd_cport_for_protocol(int protocol_id);
+uint16_t find_hd_cport_for_protocol(struct gbsim_svc *svc, int protocol_id);
 void free_connection(struct gbsim_connection *connections);
 
+/* UniPro attribute store, see dme.c */
+struct gbsim_dme_entry {
+	uint32_t key;
+	uint32_t value;
+};
+
+struct gbsim_dme {
+	struct gbsim_dme_entry *slots;
+	unsigned int mask;
+	unsigned int count;
+};
+
+/* Link power mode, as held in the PA_* attributes */
+struct gbsim_pwr_mode {
+	uint8_t tx_mode;
+	uint8_t rx_mode;
+	uint8_t tx_gear;
+	uint8_t rx_gear;
+	uint8_t tx_nlanes;
+	uint8_t rx_nlanes;
+	uint8_t hs_series;
+};
+
+/* Timer run from the timer thread, see timer.c */
+struct gbsim_timer {
+	TAILQ_ENTRY(gbsim_timer) node;
+	struct timespec expires;
+	bool pending;
+	void (*fn)(void *data);
+	void *data;
+};
+
+/* A message held back by the link model until the link delivered it */
+struct gbsim_link_msg {
+	TAILQ_ENTRY(gbsim_link_msg) node;
+	struct timespec due;
+	int fd;
+	struct gbsim_route *route;
+	uint64_t start_ns;
+	size_t size;
+	char data[];
+};
+
+/* Token bucket shaping the traffic of one interface, see link.c */
+struct gbsim_link {
+	pthread_mutex_t lock;
+	uint64_t rate;			/* bytes per second */
+	uint64_t latency_ns;
+	int64_t tokens;			/* bytes, negative when in debt */
+	struct timespec last;
+	struct timespec due;		/* of the last message queued */
+	TAILQ_HEAD(, gbsim_link_msg) queue;
+	struct gbsim_timer timer;
+};
+
+/* Frame time counter of an interface, see timesync.c */
+struct gbsim_timesync {
+	bool enabled;
+	bool synced;
+	uint8_t count;
+	uint8_t strobes;
+	uint64_t frame_time;
+	uint32_t refclk;
+	int32_t skew_ppb;
+	unsigned int seed;
+	uint64_t t0_ns;
+	double latched[GB_TIMESYNC_MAX_STROBES];
+	double rate;
+	double offset;
+	uint64_t last_event;
+
+	/* Accuracy seen on pings */
+	uint64_t pings;
+	int64_t last_err_ns;
+	uint64_t max_err_ns;
+	uint64_t sum_err_ns;
+};
+
+/* Interface power-up sequence, see activate.c */
+enum gbsim_intf_state {
+	INTF_STATE_OFF,
+	INTF_STATE_VSYS,
+	INTF_STATE_REFCLK,
+	INTF_STATE_UNIPRO,
+	INTF_STATE_ACTIVE,
+};
+
 struct gbsim_interface {
 	TAILQ_ENTRY(gbsim_interface) intf_node;
 
 	uint8_t interface_id;
 	uint8_t features;
+	enum gbsim_intf_state activation;
 
 	char *vendor_id;
 	char *product_id;
@@ -245,6 +414,13 @@ struct gbsim_interface {
 	size_t manifest_size;
 	unsigned long manifest_fname_hash;
 
+	struct gbsim_cport_params *cport_params;
+	int cport_params_count;
+
+	struct gbsim_dme dme;
+	struct gbsim_link link;
+	struct gbsim_timesync timesync;
+
 	struct gbsim_connection *control_conn;
 	struct gbsim_svc *svc;
 
@@ -252,24 +428,126 @@ struct gbsim_interface {
 };
 
 struct gbsim_svc {
+	struct gbsim_bridge *bridge;
 	struct gbsim_interface *intf;
+	struct gbsim_interface *intf_by_id[256];
 
 	TAILQ_HEAD(intf_head, gbsim_interface) intfs;
 };
 
+int dme_init(struct gbsim_dme *dme, uint8_t intf_id);
+void dme_free(struct gbsim_dme *dme);
+void dme_boot(struct gbsim_dme *dme);
+uint32_t dme_get(struct gbsim_dme *dme, uint16_t attr, uint16_t selector);
+int dme_set(struct gbsim_dme *dme, uint16_t attr, uint16_t selector,
+	    uint32_t value);
+void dme_get_pwr_mode(struct gbsim_dme *dme, struct gbsim_pwr_mode *pm);
+void dme_set_pwr_mode(struct gbsim_dme *dme, const struct gbsim_pwr_mode *pm);
+int dme_snapshot_save(struct gbsim_dme *dme, struct gbsim_snapshot *snap,
+		      uint32_t id);
+void dme_snapshot_restore(struct gbsim_dme *dme, struct gbsim_snapshot *snap,
+			  uint32_t id);
+
+void link_init(struct gbsim_interface *intf);
+void link_cleanup(struct gbsim_interface *intf);
+void link_update(struct gbsim_interface *intf);
+int link_check_pwr_mode(uint8_t mode, uint8_t gear, uint8_t nlanes);
+int link_send(struct gbsim_interface *intf, int fd, void *message,
+	      size_t size, struct gbsim_route *route, uint64_t start_ns);
+
+int route_create(struct gbsim_svc *svc, uint8_t intf1_id, uint8_t dev1_id,
+		 uint8_t intf2_id, uint8_t dev2_id);
+int route_destroy(struct gbsim_svc *svc, uint8_t intf1_id, uint8_t intf2_id);
+int route_connection_bind(struct gbsim_connection *connection,
+			  uint8_t peer_intf_id);
+void route_connection_unbind(struct gbsim_connection *connection);
+struct gbsim_route *route_begin(struct gbsim_connection *connection,
+				uint64_t *start_ns);
+void route_end(struct gbsim_route *route, bool tx, size_t size,
+	       uint64_t start_ns);
+void route_cleanup(void);
+
+void pwrmon_init(void);
+void pwrmon_cleanup(void);
+void pwrmon_set_link(struct gbsim_interface *intf,
+		     const struct gbsim_pwr_mode *pm);
+void pwrmon_intf_off(struct gbsim_interface *intf);
+void pwrmon_account(struct gbsim_interface *intf, size_t size);
+int pwrmon_rail_count(void);
+void pwrmon_rail_names(struct gb_svc_pwrmon_rail_names_get_response *rsp);
+int pwrmon_sample_get(struct gbsim_svc *svc, uint8_t rail_id, uint8_t type,
+		      uint32_t *value);
+int pwrmon_intf_sample_get(struct gbsim_svc *svc, uint8_t intf_id,
+			   uint8_t type, uint32_t *value);
+
+int timer_init(void);
+void timer_cleanup(void);
+void timer_add(struct gbsim_timer *timer, uint64_t delay_ns);
+void timer_del(struct gbsim_timer *timer);
+
+int snapshot_write(struct gbsim_snapshot *snap, uint32_t tag, uint32_t id,
+		   const void *data, size_t size);
+int snapshot_read(struct gbsim_snapshot *snap, uint32_t tag, uint32_t id,
+		  void *buf, size_t size);
+void *snapshot_load(struct gbsim_snapshot *snap, uint32_t tag, uint32_t id,
+		    size_t *size);
+void *snapshot_map(struct gbsim_snapshot *snap, uint32_t tag, uint32_t id,
+		   size_t size);
+int snapshot_save(const char *path);
+int snapshot_restore(const char *path);
+void snapshot_start(struct gbsim_svc *svc);
+
+int intf_activate_setup(char *spec);
+uint8_t intf_activate(struct gbsim_interface *intf, uint8_t type);
+int intf_activate_respond(uint16_t hd_cport_id, struct op_msg *msg,
+			  uint16_t message_size, uint16_t operation_id,
+			  uint8_t type);
+
+void timesync_intf_init(struct gbsim_interface *intf);
+void timesync_intf_enable(struct gbsim_interface *intf, uint8_t count,
+			  uint64_t frame_time, uint32_t strobe_delay,
+			  uint32_t refclk);
+void timesync_intf_disable(struct gbsim_interface *intf);
+void timesync_intf_authoritative(struct gbsim_interface *intf,
+				 const uint64_t *frame_time);
+uint64_t timesync_intf_last_event(struct gbsim_interface *intf);
+void timesync_svc_wake_pins(struct gbsim_svc *svc, uint32_t strobe_mask);
+void timesync_svc_enable(struct gbsim_svc *svc, uint8_t count,
+			 uint64_t frame_time, uint32_t strobe_delay,
+			 uint32_t refclk);
+void timesync_svc_disable(struct gbsim_svc *svc);
+void timesync_svc_authoritative(struct gbsim_svc *svc, uint64_t *frame_time);
+uint64_t timesync_svc_ping(struct gbsim_svc *svc);
+
 int inotify_start(struct gbsim_svc *svc, char *base_dir);
+void inotify_cleanup(void);
+
+int hotplug_bench_setup(char *spec);
+int hotplug_bench_start(struct gbsim_svc *svc);
+void hotplug_bench_cleanup(void);
+void hotplug_bench_conn_create(struct gbsim_interface *intf, uint16_t cport_id);
+void hotplug_bench_intf_free(struct gbsim_interface *intf);
+
+int fleet_load(const char *path);
+int fleet_start(struct gbsim_svc *svc);
+void fleet_cleanup(void);
 
 int svc_handler(struct gbsim_connection *, void *, size_t, void *, size_t);
-int svc_request_send(uint8_t, uint8_t);
+int svc_request_send(struct gbsim_svc *, uint8_t, uint8_t);
 char *svc_get_operation(uint8_t type);
 int svc_get_next_intf_id(struct gbsim_svc *svc);
-int svc_init(void);
-void svc_exit(void);
+int svc_init(struct gbsim_bridge *);
+void svc_exit(struct gbsim_bridge *);
 
 struct gbsim_interface *interface_alloc(struct gbsim_svc *svc, uint8_t id);
 struct gbsim_interface *interface_get_by_id(struct gbsim_svc *svc, uint8_t id);
 struct gbsim_interface *interface_get_by_hash(struct gbsim_svc *svc,
 					      uint32_t hash);
+struct gbsim_interface *interface_hotplug(struct gbsim_svc *svc, int intf_id,
+					  uint32_t hash, void *manifest,
+					  struct gbsim_cport_params *params,
+					  int nparams);
+void interface_hotunplug(struct gbsim_svc *svc, struct gbsim_interface *intf);
 
 void interface_free(struct gbsim_svc *svc, struct gbsim_interface *intf);
 
@@ -282,6 +560,8 @@ char *control_get_operation(uint8_t type);
 int gpio_handler(struct gbsim_connection *, void *, size_t, void *, size_t);
 char *gpio_get_operation(uint8_t type);
 void gpio_init(void);
+int gpio_snapshot_save(struct gbsim_snapshot *snap);
+void gpio_snapshot_restore(struct gbsim_snapshot *snap);
 
 int i2c_handler(struct gbsim_connection *, void *, size_t, void *, size_t);
 char *i2c_get_operation(uint8_t type);
@@ -294,24 +574,36 @@ void pwm_init(void);
 int sdio_handler(struct gbsim_connection *, void *, size_t, void *, size_t);
 char *sdio_get_operation(uint8_t type);
 void sdio_init(void);
+int sdio_snapshot_save(struct gbsim_snapshot *snap);
+void sdio_snapshot_restore(struct gbsim_snapshot *snap);
 
 int spi_handler(struct gbsim_connection *, void *, size_t, void *, size_t);
 char *spi_get_operation(uint8_t type);
+int spi_snapshot_save(struct gbsim_snapshot *snap);
+void spi_snapshot_restore(struct gbsim_snapshot *snap);
 
 int lights_handler(struct gbsim_connection *,  void *, size_t, void *, size_t);
 char *lights_get_operation(uint8_t type);
+int lights_snapshot_save(struct gbsim_snapshot *snap);
+void lights_snapshot_restore(struct gbsim_snapshot *snap);
 
 int power_supply_handler(struct gbsim_connection *,  void *, size_t, void *, size_t);
 char *power_supply_get_operation(uint8_t type);
 
 int uart_handler(struct gbsim_connection *, void *, size_t, void *, size_t);
 char *uart_get_operation(uint8_t type);
+int uart_rx_setup(char *spec);
+int uart_pty_setup(char *dir);
+int uart_line_setup(char *spec);
+void uart_conn_destroy(struct gbsim_connection *connection);
 void uart_init(void);
 void uart_cleanup(void);
 
 int loopback_handler(struct gbsim_connection *, void *, size_t, void *, size_t);
 char *loopback_get_operation(uint8_t type);
-void loopback_init(void);
+int loopback_setup(char *spec);
+void loopback_conn_create(struct gbsim_connection *connection);
+void loopback_conn_destroy(struct gbsim_connection *connection);
 void loopback_cleanup(void);
 
 int bootrom_handler(struct gbsim_connection *, void *, size_t, void *, size_t);
@@ -326,6 +618,12 @@ int download_firmware(char *tag, uint16_t hd_cport_id, void (*func)(void));
 
 bool manifest_parse(struct gbsim_svc *svc, int intf_id, void *data,
 		    size_t size);
+struct greybus_manifest_header *manifest_load(const char *path);
+struct greybus_manifest_header *manifest_compile(const char *path);
+int manifest_cache_init(const char *dir);
+struct greybus_descriptor *manifest_get_descriptor(struct gbsim_interface *intf,
+				   enum greybus_descriptor_type desc_type,
+				   int skip);
 int cport_get_protocol(struct gbsim_interface *intf, uint16_t cport_id);
 int send_response(uint16_t hd_cport_id,
 			struct op_msg *message, uint16_t message_size,
@@ -8,39 +8,88 @@
 
 #include <usbg/usbg.h>
 
+#include "gbsim.h"
 #include "gbsim_usb.h"
 
 static usbg_state *s;
-static usbg_gadget *g;
+static usbg_gadget *g[GBSIM_MAX_BRIDGES];
 
-void gbsim_usb_cleanup(void)
+static void gbsim_usb_bridge_cleanup(int id)
 {
-	gadget_cleanup(s, g);
-	functionfs_cleanup();
+	gadget_cleanup(g[id]);
+	g[id] = NULL;
+	functionfs_cleanup(bridge_get(id));
 }
 
-int gbsim_usb_init(void)
+static int gbsim_usb_bridge_init(int id)
 {
+	struct gbsim_bridge *bridge = bridge_init(id);
 	int ret;
 
-	ret = gadget_create(&s, &g);
+	ret = gadget_create(s, id, bridge->ffs_name, &g[id]);
 	if (ret < 0)
 		goto out;
 
-	ret = functionfs_init();
+	ret = functionfs_init(bridge);
 	if (ret < 0)
 		goto gadget_cleanup;
 
-	ret = gadget_enable(g);
+	ret = gadget_enable(s, id, g[id]);
 	if (ret < 0)
 		goto functionfs_cleanup;
 
 	return ret;
 
 functionfs_cleanup:
-	functionfs_cleanup();
+	functionfs_cleanup(bridge);
 gadget_cleanup:
-	gadget_cleanup(s, g);
+	gadget_cleanup(g[id]);
+	g[id] = NULL;
 out:
 	return ret;
 }
+
+/* No more AP messages once this returns, for the models to go away */
+void gbsim_usb_stop(void)
+{
+	int i;
+
+	for (i = 0; i < bridge_count; i++)
+		functionfs_stop(bridge_get(i));
+}
+
+void gbsim_usb_cleanup(void)
+{
+	int i;
+
+	for (i = 0; i < bridge_count; i++)
+		gbsim_usb_bridge_cleanup(i);
+
+	usbg_cleanup(s);
+	s = NULL;
+}
+
+int gbsim_usb_init(void)
+{
+	int i, ret;
+
+	ret = gadget_init(&s);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < bridge_count; i++) {
+		ret = gbsim_usb_bridge_init(i);
+		if (ret < 0)
+			goto cleanup;
+	}
+
+	return 0;
+
+cleanup:
+	while (i--)
+		gbsim_usb_bridge_cleanup(i);
+	usbg_cleanup(s);
+	s = NULL;
+
+	return ret;
+}
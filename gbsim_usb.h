@@ -9,18 +9,25 @@
 #ifndef __GBSIM_USB_H
 #define __GBSIM_USB_H
 
+#include <signal.h>
 #include <usbg/usbg.h>
 
-int gadget_create(usbg_state **, usbg_gadget **);
-int gadget_enable(usbg_gadget *);
-void gadget_cleanup(usbg_state *, usbg_gadget *);
+struct gbsim_bridge;
 
-int functionfs_init(void);
-int functionfs_loop(void);
-int functionfs_cleanup(void);
+int gadget_init(usbg_state **);
+int gadget_create(usbg_state *, int, const char *, usbg_gadget **);
+int gadget_enable(usbg_state *, int, usbg_gadget *);
+void gadget_cleanup(usbg_gadget *);
+
+struct gbsim_bridge *bridge_init(int);
+int functionfs_init(struct gbsim_bridge *);
+int functionfs_loop(const sigset_t *);
+void functionfs_stop(struct gbsim_bridge *);
+void functionfs_cleanup(struct gbsim_bridge *);
 void cleanup_endpoint(int, char *);
 
 int gbsim_usb_init(void);
+void gbsim_usb_stop(void);
 void gbsim_usb_cleanup(void);
 
 #endif
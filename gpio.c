@@ -263,3 +263,15 @@ void gpio_init(void)
 			gpios[i] = libsoc_gpio_request(56+i, LS_GREEDY);
 	}
 }
+
+int gpio_snapshot_save(struct gbsim_snapshot *snap)
+{
+	return snapshot_write(snap, SNAPSHOT_TAG('G', 'P', 'I', 'O'), 0,
+			      gb_gpios, sizeof(gb_gpios));
+}
+
+void gpio_snapshot_restore(struct gbsim_snapshot *snap)
+{
+	snapshot_read(snap, SNAPSHOT_TAG('G', 'P', 'I', 'O'), 0, gb_gpios,
+		      sizeof(gb_gpios));
+}
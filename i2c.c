@@ -9,7 +9,6 @@
  */
 
 #include <fcntl.h>
-#include <linux/fs.h>
 #include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 #include <stdbool.h>
@@ -22,28 +21,73 @@
 
 #include "gbsim.h"
 
+#define I2C_ADAPTER_MAX		16
+
 static __u8 data_byte;
 static int ifd;
 
+/* Adapters other than the default one, opened on first use */
+static int adapter_fds[I2C_ADAPTER_MAX];
+
+static int i2c_adapter_open(int adapter)
+{
+	char filename[20];
+	int fd;
+
+	snprintf(filename, 19, "/dev/i2c-%d", adapter);
+	fd = open(filename, O_RDWR);
+	if (fd < 0)
+		gbsim_error("failed opening %s read/write\n", filename);
+
+	return fd;
+}
+
+/* Pick the adapter given by the fleet configuration, if any */
+static int i2c_get_fd(struct gbsim_connection *connection)
+{
+	const struct gbsim_cport_params *params = connection->params;
+	int adapter;
+
+	if (!params || params->i2c_adapter < 0 ||
+	    params->i2c_adapter == i2c_adapter)
+		return ifd;
+
+	adapter = params->i2c_adapter;
+	if (adapter >= I2C_ADAPTER_MAX) {
+		gbsim_error("i2c adapter %d out of range\n", adapter);
+		return ifd;
+	}
+
+	if (adapter_fds[adapter] <= 0)
+		adapter_fds[adapter] = i2c_adapter_open(adapter);
+
+	return adapter_fds[adapter];
+}
+
 int i2c_handler(struct gbsim_connection *connection, void *rbuf,
 		size_t rsize, void *tbuf, size_t tsize)
 {
 	struct gb_operation_msg_hdr *oph;
 	struct op_msg *op_req = rbuf;
 	struct op_msg *op_rsp;
-	int i, op_count;
+	struct i2c_msg msgs[I2C_RDWR_IOCTL_MAX_MSGS];
+	struct i2c_rdwr_ioctl_data rdwr;
+	int i, j, op_count;
 	__u8 *write_data;
 	bool read_op = false;
-	int read_count = 0;
-	bool write_fail = false;
+	size_t read_count = 0;
 	size_t payload_size;
 	uint16_t message_size;
 	uint16_t hd_cport_id = connection->hd_cport_id;
 	uint8_t result = PROTOCOL_STATUS_SUCCESS;
+	int fd = ifd;
 
 	op_rsp = (struct op_msg *)tbuf;
 	oph = (struct gb_operation_msg_hdr *)&op_req->header;
 
+	if (bbb_backend)
+		fd = i2c_get_fd(connection);
+
 	switch (oph->type) {
 	case GB_I2C_TYPE_FUNCTIONALITY:
 		payload_size = sizeof(struct gb_i2c_functionality_response);
@@ -53,6 +97,14 @@ int i2c_handler(struct gbsim_connection *connection, void *rbuf,
 		op_count = le16toh(op_req->i2c_xfer_req.op_count);
 		write_data = (__u8 *)&op_req->i2c_xfer_req.ops[op_count];
 		gbsim_debug("Number of transfer ops %d\n", op_count);
+		if (op_count > I2C_RDWR_IOCTL_MAX_MSGS ||
+		    write_data > (__u8 *)rbuf + rsize) {
+			gbsim_error("i2c transfer of %d ops invalid\n", op_count);
+			result = PROTOCOL_STATUS_INVALID;
+			op_count = 0;
+		}
+
+		/* The ops point right into the request and response buffers */
 		for (i = 0; i < op_count; i++) {
 			struct gb_i2c_transfer_op *op;
 			__u16 addr;
@@ -67,40 +119,46 @@ int i2c_handler(struct gbsim_connection *connection, void *rbuf,
 			gbsim_debug("op %d: %s address %04x size %04x\n",
 				    i, (read_op ? "read" : "write"),
 				    addr, size);
-			/* FIXME: need some error handling */
-			if (bbb_backend)
-				if (ioctl(ifd, I2C_SLAVE, addr) < 0)
-					gbsim_error("failed setting i2c slave address\n");
+
+			msgs[i].addr = addr;
+			msgs[i].flags = read_op ? I2C_M_RD : 0;
+			msgs[i].len = size;
 			if (read_op) {
-				if (bbb_backend) {
-					int count;
-					ioctl(ifd, BLKFLSBUF);
-					count = read(ifd, &op_rsp->i2c_xfer_rsp.data[read_count], size);
-					if (count != size)
-						gbsim_error("op %d: failed to read %04x bytes\n", i, size);
-				} else {
-					for (i = read_count; i < (read_count + size); i++)
-					op_rsp->i2c_xfer_rsp.data[i] = data_byte++;
+				if (sizeof(*oph) + read_count + size > tsize) {
+					gbsim_error("op %d: read %04x too long\n",
+						    i, size);
+					result = PROTOCOL_STATUS_INVALID;
+					break;
 				}
+				msgs[i].buf = &op_rsp->i2c_xfer_rsp.data[read_count];
+				if (!bbb_backend)
+					for (j = 0; j < size; j++)
+						msgs[i].buf[j] = data_byte++;
 				read_count += size;
 			} else {
-				if (bbb_backend) {
-					int count;
-					count = write(ifd, write_data, size);
-					if (count != size) {
-						gbsim_debug("op %d: failed to write %04x bytes\n", i, size);
-						write_fail = true;
-					}
+				if (write_data + size > (__u8 *)rbuf + rsize) {
+					gbsim_error("op %d: write %04x too long\n",
+						    i, size);
+					result = PROTOCOL_STATUS_INVALID;
+					break;
 				}
+				msgs[i].buf = write_data;
 				write_data += size;
 			}
 		}
 
-		/* FIXME: handle read failure */
-		if (write_fail)
-			result = PROTOCOL_STATUS_RETRY;
+		/* One transfer, with a repeated start between the ops */
+		if (bbb_backend && op_count && !result) {
+			rdwr.msgs = msgs;
+			rdwr.nmsgs = op_count;
+			if (ioctl(fd, I2C_RDWR, &rdwr) != op_count) {
+				gbsim_debug("%d ops transfer failed errno=%d\n",
+					    op_count, errno);
+				result = PROTOCOL_STATUS_RETRY;
+			}
+		}
 
-		payload_size = read_op ? read_count : 0;
+		payload_size = result ? 0 : read_count;
 		break;
 	case GB_REQUEST_TYPE_CPORT_SHUTDOWN:
 		payload_size = 0;
@@ -132,12 +190,6 @@ char *i2c_get_operation(uint8_t type)
 
 void i2c_init(void)
 {
-	char filename[20];
-
-	if (bbb_backend) {
-		snprintf(filename, 19, "/dev/i2c-%d", i2c_adapter);
-		ifd = open(filename, O_RDWR);
-		if (ifd < 0)
-			gbsim_error("failed opening i2c-dev node read/write\n");
-	}
+	if (bbb_backend)
+		ifd = i2c_adapter_open(i2c_adapter);
 }
@@ -26,61 +26,18 @@
 #define INOTIFY_EVENT_SIZE  ( sizeof(struct inotify_event) )
 #define INOTIFY_EVENT_BUF   ( INOTIFY_EVENT_SIZE + MAX_NAME + 1 )
 
-static pthread_t inotify_pthread;
-int notify_fd = -ENXIO;
-static char root[256];
-
-static struct greybus_manifest_header *get_manifest_blob(char *mnfs)
-{
-	struct greybus_manifest_header *mh;
-	int mnf_fd;
-	ssize_t n;
-	__le16 file_size;
-	uint16_t size;
-
-	if ((mnf_fd = open(mnfs, O_RDONLY)) < 0) {
-		gbsim_error("failed to open manifest blob %s\n", mnfs);
-		return NULL;
-	}
-
-	/* First just get the size */
-	if ((n = read(mnf_fd, &file_size, 2)) != 2) {
-		gbsim_error("failed to read manifest size, read %zd\n", n);
-		goto out;
-	}
-	size = le16toh(file_size);
-
-	/* Size has to cover at least itself */
-	if (size < 2) {
-		gbsim_error("bad manifest size %hu\n", size);
-		goto out;
-	}
-
-	/* Allocate a big enough buffer */
-	if (!(mh = malloc(size))) {
-		gbsim_error("failed to allocate manifest buffer\n");
-		goto out;
-	}
-
-	/* Now go back and read the whole thing */
-	if (lseek(mnf_fd, 0, SEEK_SET)) {
-		gbsim_error("failed to seek to front of manifest\n");
-		goto out_free;
-	}
-	if (read(mnf_fd, mh, size) != size) {
-		gbsim_error("failed to read manifest\n");
-		goto out_free;
-	}
-	close(mnf_fd);
+/*
+ * One watch per bridge: bridge 0 uses <base>/hotplug-module, the others
+ * <base>/hotplug-module<N>.
+ */
+struct inotify_watch {
+	pthread_t pthread;
+	int notify_fd;
+	char root[256];
+	struct gbsim_svc *svc;
+};
 
-	return mh;
-out_free:
-	free(mh);
-out:
-	close(mnf_fd);
-
-	return NULL;
-}
+static struct inotify_watch watches[GBSIM_MAX_BRIDGES];
 
 static int get_interface_id_from_fname(char *fname)
 {
@@ -114,17 +71,17 @@ static void *inotify_thread(void *param)
 {
 	char buffer[16 * INOTIFY_EVENT_BUF];
 	ssize_t length;
-	struct gbsim_svc *svc = param;
+	struct inotify_watch *watch = param;
+	struct gbsim_svc *svc = watch->svc;
 	struct gbsim_interface *intf;
 	uint32_t hash;
 	int intf_id;
 	int i;
 
-	(void) param;
 	do {
 		size_t size;
 
-		length = read(notify_fd, buffer, sizeof(buffer));
+		length = read(watch->notify_fd, buffer, sizeof(buffer));
 		if (length < 0) {
 			gbsim_error("inotify read: %s\n", strerror(errno));
 			return NULL;
@@ -151,7 +108,7 @@ static void *inotify_thread(void *param)
 			if (event->mask & IN_CLOSE_WRITE) {
 				char mnfs[256];
 				struct greybus_manifest_header *mh;
-				strcpy(mnfs, root);
+				strcpy(mnfs, watch->root);
 				strcat(mnfs, "/");
 				strcat(mnfs, event->name);
 
@@ -160,26 +117,18 @@ static void *inotify_thread(void *param)
 				if (intf_id < 0)
 					intf_id = svc_get_next_intf_id(svc);
 
-				/* allocate interface with given interface id */
-				intf = interface_alloc(svc, intf_id);
-				if (!intf)
-					return false;
+				mh = manifest_load(mnfs);
+				if (!mh) {
+					gbsim_error("missing manifest blob, no hotplug event sent\n");
+					continue;
+				}
 
 				hash = hash_filename(event->name);
-				intf->manifest_fname_hash = hash;
-
-				mh = get_manifest_blob(mnfs);
-				if (mh) {
-					manifest_parse(svc, intf_id, mh,
-						       le16toh(mh->size));
-
+				intf = interface_hotplug(svc, intf_id, hash, mh,
+							 NULL, 0);
+				if (intf)
 					gbsim_info("%s Interface %d inserted\n",
 						   event->name, intf_id);
-
-					svc_request_send(GB_SVC_TYPE_MODULE_INSERTED,
-							 intf_id);
-				} else
-					gbsim_error("missing manifest blob, no hotplug event sent\n");
 			} else if (event->mask & IN_DELETE) {
 				/* get interface by filename hash */
 				hash = hash_filename(event->name);
@@ -191,8 +140,7 @@ static void *inotify_thread(void *param)
 					return NULL;
 				}
 
-				svc_request_send(GB_SVC_TYPE_MODULE_REMOVED,
-						 intf->interface_id);
+				interface_hotunplug(svc, intf);
 				gbsim_info("%s interface removed\n", event->name);
 			}
 		}
@@ -203,28 +151,37 @@ static void *inotify_thread(void *param)
 
 int inotify_start(struct gbsim_svc *svc, char *base_dir)
 {
+	struct inotify_watch *watch = &watches[svc->bridge->id];
 	int ret;
 	struct stat root_stat;
 	int notify_wd;
 
-	/* Our inotify directory */
-	strcpy(root, base_dir);
-	strcat(root, "/");
-	strcat(root, "hotplug-module");
+	if (watch->svc)
+		return 0;
+	watch->svc = svc;
 
-	ret = stat(root, &root_stat);
-	if (ret < 0 || !S_ISDIR(root_stat.st_mode) || access(root, R_OK|W_OK) < 0) {
-		gbsim_error("invalid base directory %s\n", root);
+	/* Our inotify directory */
+	if (svc->bridge->id)
+		snprintf(watch->root, sizeof(watch->root), "%s/hotplug-module%d",
+			 base_dir, svc->bridge->id);
+	else
+		snprintf(watch->root, sizeof(watch->root), "%s/hotplug-module",
+			 base_dir);
+
+	ret = stat(watch->root, &root_stat);
+	if (ret < 0 || !S_ISDIR(root_stat.st_mode) ||
+	    access(watch->root, R_OK|W_OK) < 0) {
+		gbsim_error("invalid base directory %s\n", watch->root);
 		exit(EXIT_FAILURE);
 	}
 
-	if ((notify_fd = inotify_init()) < 0)
+	if ((watch->notify_fd = inotify_init()) < 0)
 		perror("inotify init failed");
 
-	if ((notify_wd = inotify_add_watch(notify_fd, root, IN_CLOSE_WRITE|IN_DELETE)) < 0)
+	if ((notify_wd = inotify_add_watch(watch->notify_fd, watch->root, IN_CLOSE_WRITE|IN_DELETE)) < 0)
 		perror("inotify add watch failed");
 
-	ret = pthread_create(&inotify_pthread, NULL, inotify_thread, svc);
+	ret = pthread_create(&watch->pthread, NULL, inotify_thread, watch);
 	if (ret < 0) {
 		perror("can't create inotify thread");
 		exit(EXIT_FAILURE);
@@ -232,3 +189,19 @@ int inotify_start(struct gbsim_svc *svc, char *base_dir)
 
 	return 0;
 }
+
+void inotify_cleanup(void)
+{
+	struct inotify_watch *watch;
+	int i;
+
+	for (i = 0; i < GBSIM_MAX_BRIDGES; i++) {
+		watch = &watches[i];
+		if (!watch->svc)
+			continue;
+		pthread_cancel(watch->pthread);
+		pthread_join(watch->pthread, NULL);
+		close(watch->notify_fd);
+		watch->svc = NULL;
+	}
+}
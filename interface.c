@@ -27,13 +27,7 @@ struct gbsim_interface *interface_get_by_hash(struct gbsim_svc *svc,
 
 struct gbsim_interface *interface_get_by_id(struct gbsim_svc *svc, uint8_t id)
 {
-	struct gbsim_interface *intf;
-
-	TAILQ_FOREACH(intf, &svc->intfs, intf_node)
-		if (intf->interface_id == id)
-			return intf;
-
-	return NULL;
+	return svc->intf_by_id[id];
 }
 
 void interface_free(struct gbsim_svc *svc, struct gbsim_interface *intf)
@@ -41,10 +35,18 @@ void interface_free(struct gbsim_svc *svc, struct gbsim_interface *intf)
 	struct gbsim_connection *connection;
 
 	gbsim_debug("free interface %u\n", intf->interface_id);
-	TAILQ_FOREACH(connection, &intf->connections, cnode)
+	hotplug_bench_intf_free(intf);
+
+	while ((connection = TAILQ_FIRST(&intf->connections)))
 		free_connection(connection);
 
 	TAILQ_REMOVE(&svc->intfs, intf, intf_node);
+	svc->intf_by_id[intf->interface_id] = NULL;
+	timesync_intf_disable(intf);
+	pwrmon_intf_off(intf);
+	link_cleanup(intf);
+	dme_free(&intf->dme);
+	free(intf->cport_params);
 	free(intf->manifest);
 	free(intf);
 }
@@ -68,7 +70,69 @@ struct gbsim_interface *interface_alloc(struct gbsim_svc *svc, uint8_t id)
 
 	intf->svc = svc;
 
+	if (dme_init(&intf->dme, id)) {
+		free(intf);
+		return NULL;
+	}
+	link_init(intf);
+	timesync_intf_init(intf);
+
 	TAILQ_INSERT_TAIL(&svc->intfs, intf, intf_node);
+	svc->intf_by_id[id] = intf;
 
 	return intf;
 }
+
+/*
+ * Bring up a module interface from an in-memory manifest and announce it
+ * to the AP.  This is the common path for every way a module can appear
+ * (inotify hotplug directory, fleet configuration, ...).
+ *
+ * The interface takes ownership of the manifest buffer and of the CPort
+ * parameter array, which must both be allocated with malloc().
+ */
+struct gbsim_interface *interface_hotplug(struct gbsim_svc *svc, int intf_id,
+					  uint32_t hash, void *manifest,
+					  struct gbsim_cport_params *params,
+					  int nparams)
+{
+	struct greybus_manifest_header *mh = manifest;
+	struct gbsim_interface *intf;
+
+	if (interface_get_by_id(svc, intf_id)) {
+		gbsim_error("interface %d already present\n", intf_id);
+		goto err_free;
+	}
+
+	/* allocate interface with given interface id */
+	intf = interface_alloc(svc, intf_id);
+	if (!intf)
+		goto err_free;
+
+	intf->manifest_fname_hash = hash;
+	intf->cport_params = params;
+	intf->cport_params_count = nparams;
+
+	if (!manifest_parse(svc, intf_id, mh, le16toh(mh->size))) {
+		gbsim_error("bad manifest for interface %d\n", intf_id);
+		if (intf->manifest != manifest)
+			free(manifest);
+		interface_free(svc, intf);
+		return NULL;
+	}
+
+	svc_request_send(svc, GB_SVC_TYPE_MODULE_INSERTED, intf_id);
+
+	return intf;
+
+err_free:
+	free(manifest);
+	free(params);
+	return NULL;
+}
+
+void interface_hotunplug(struct gbsim_svc *svc, struct gbsim_interface *intf)
+{
+	svc_request_send(svc, GB_SVC_TYPE_MODULE_REMOVED,
+			 intf->interface_id);
+}
@@ -283,8 +283,10 @@ int lights_handler(struct gbsim_connection *connection, void *rbuf,
 		payload_size = sizeof(struct gb_lights_get_lights_response);
 		op_rsp->lights_gl_rsp.lights_count = LIGHTS_COUNT;
 
+		/* Lights keep their state when the AP asks again */
 		for (i = 0; i < LIGHTS_COUNT; i++)
-			gbl[i] = light_init(i);
+			if (!gbl[i])
+				gbl[i] = light_init(i);
 		break;
 	case GB_LIGHTS_TYPE_GET_LIGHT_CONFIG:
 		payload_size = sizeof(struct gb_lights_get_light_config_response);
@@ -428,3 +430,50 @@ char *lights_get_operation(uint8_t type)
 		return "(Unknown operation)";
 	}
 }
+
+int lights_snapshot_save(struct gbsim_snapshot *snap)
+{
+	int ret;
+	int i;
+
+	for (i = 0; i < LIGHTS_COUNT; i++) {
+		if (!gbl[i])
+			continue;
+		ret = snapshot_write(snap, SNAPSHOT_TAG('L', 'G', 'H', 'T'), i,
+				     gbl[i], sizeof(*gbl[i]));
+		if (ret)
+			return ret;
+		ret = snapshot_write(snap, SNAPSHOT_TAG('L', 'G', 'C', 'H'), i,
+				     gbl[i]->channels, gbl[i]->channel_count *
+				     sizeof(*gbl[i]->channels));
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+void lights_snapshot_restore(struct gbsim_snapshot *snap)
+{
+	struct gb_channel *channels;
+	struct gb_light *light;
+	size_t size = 0, csize = 0;
+	int i;
+
+	for (i = 0; i < LIGHTS_COUNT; i++) {
+		light = snapshot_load(snap, SNAPSHOT_TAG('L', 'G', 'H', 'T'), i,
+				      &size);
+		if (!light)
+			continue;
+		channels = snapshot_load(snap, SNAPSHOT_TAG('L', 'G', 'C', 'H'),
+					 i, &csize);
+		if (size != sizeof(*light) || !channels ||
+		    csize != light->channel_count * sizeof(*channels)) {
+			free(channels);
+			free(light);
+			continue;
+		}
+		light->channels = channels;
+		gbl[i] = light;
+	}
+}
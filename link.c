@@ -0,0 +1,274 @@
+/*
+ * Greybus Simulator: UniPro link model
+ *
+ * Derive each interface's link bandwidth and latency from the power mode
+ * held in its DME attributes, and shape the traffic it sends to the AP with
+ * a token bucket so AP-side numbers reflect a real UniPro link rather than
+ * memory speed.  Messages are queued per interface and the timer thread
+ * sends them once the link would have delivered them, so the senders (the
+ * bridge receive thread, among others) never wait for the link.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gbsim.h"
+
+/* Raw per-lane symbol rates of gear 1, in bits per second */
+#define HS_G1_RATE_A		1248000000ULL
+#define HS_G1_RATE_B		1457600000ULL
+#define PWM_G1_RATE		9000000ULL
+
+#define HS_GEAR_MAX		3
+#define PWM_GEAR_MAX		7
+#define LANES_MAX		2
+
+/* Both HS and PWM burst payloads are 8b10b encoded */
+#define LINE_CODING_NUM		8
+#define LINE_CODING_DEN		10
+
+/*
+ * A CPort message crosses two hops: module to switch and switch to the AP
+ * bridge.  Each hop costs a fixed PHY/L2 processing time plus the time to
+ * serialize one L2 frame before it can be forwarded.
+ */
+#define LINK_HOPS		2
+#define LINK_HOP_DELAY_NS	500
+#define L2_FRAME_BYTES		288
+
+/* Allow one full message to go out back to back */
+#define LINK_BURST_BYTES	(2 * 1024)
+
+int link_model;
+
+static bool link_mode_is_hs(uint8_t mode)
+{
+	return mode == GB_SVC_UNIPRO_FAST_MODE ||
+	       mode == GB_SVC_UNIPRO_FAST_AUTO_MODE;
+}
+
+/* Usable bandwidth in bytes per second for one direction */
+static uint64_t link_rate(uint8_t mode, uint8_t gear, uint8_t nlanes,
+			  uint8_t hs_series)
+{
+	uint64_t rate;
+
+	if (!gear)
+		gear = 1;
+	if (!nlanes)
+		nlanes = 1;
+
+	if (link_mode_is_hs(mode))
+		rate = hs_series == GB_SVC_UNIPRO_HS_SERIES_B ?
+		       HS_G1_RATE_B : HS_G1_RATE_A;
+	else
+		rate = PWM_G1_RATE;
+
+	rate <<= gear - 1;
+	rate *= nlanes;
+
+	return rate * LINE_CODING_NUM / LINE_CODING_DEN / 8;
+}
+
+static void link_ts_add_ns(struct timespec *ts, uint64_t ns)
+{
+	ts->tv_sec += ns / 1000000000;
+	ts->tv_nsec += ns % 1000000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static int64_t link_ts_diff_ns(struct timespec *end, struct timespec *start)
+{
+	return (int64_t)(end->tv_sec - start->tv_sec) * 1000000000 +
+	       (end->tv_nsec - start->tv_nsec);
+}
+
+/* Send the messages of @data's link that are due, from the timer thread */
+static void link_release(void *data)
+{
+	struct gbsim_link *link = data;
+	struct gbsim_link_msg *msg;
+	struct timespec now;
+	int64_t wait_ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&link->lock);
+	while ((msg = TAILQ_FIRST(&link->queue))) {
+		wait_ns = link_ts_diff_ns(&msg->due, &now);
+		if (wait_ns > 0) {
+			timer_add(&link->timer, wait_ns);
+			break;
+		}
+
+		TAILQ_REMOVE(&link->queue, msg, node);
+		if (write(msg->fd, msg->data, msg->size) < 0)
+			gbsim_error("link: message to AP lost: %s\n",
+				    strerror(errno));
+		route_end(msg->route, true, msg->size, msg->start_ns);
+		free(msg);
+	}
+	pthread_mutex_unlock(&link->lock);
+}
+
+/* Check a requested power mode against what the link can do */
+int link_check_pwr_mode(uint8_t mode, uint8_t gear, uint8_t nlanes)
+{
+	if (mode == GB_SVC_UNIPRO_MODE_UNCHANGED ||
+	    mode == GB_SVC_UNIPRO_HIBERNATE_MODE ||
+	    mode == GB_SVC_UNIPRO_OFF_MODE)
+		return 0;
+
+	if (!nlanes || nlanes > LANES_MAX)
+		return -EINVAL;
+
+	if (link_mode_is_hs(mode))
+		return gear && gear <= HS_GEAR_MAX ? 0 : -EINVAL;
+
+	if (mode == GB_SVC_UNIPRO_SLOW_MODE ||
+	    mode == GB_SVC_UNIPRO_SLOW_AUTO_MODE)
+		return gear && gear <= PWM_GEAR_MAX ? 0 : -EINVAL;
+
+	return -EINVAL;
+}
+
+/* Recompute the link parameters after a power mode change */
+void link_update(struct gbsim_interface *intf)
+{
+	struct gbsim_link *link = &intf->link;
+	struct gbsim_pwr_mode pm;
+	uint64_t rate;
+
+	dme_get_pwr_mode(&intf->dme, &pm);
+
+	/* Traffic towards the AP uses the module's transmit lanes */
+	rate = link_rate(pm.tx_mode, pm.tx_gear, pm.tx_nlanes, pm.hs_series);
+
+	pthread_mutex_lock(&link->lock);
+	link->rate = rate;
+	link->latency_ns = LINK_HOPS * (LINK_HOP_DELAY_NS +
+			   L2_FRAME_BYTES * 1000000000ULL / rate);
+	pthread_mutex_unlock(&link->lock);
+
+	pwrmon_set_link(intf, &pm);
+
+	gbsim_debug("link %u: %s G%u x%u, %llu bytes/s, %llu ns latency\n",
+		    intf->interface_id, link_mode_is_hs(pm.tx_mode) ? "HS" : "PWM",
+		    pm.tx_gear, pm.tx_nlanes, (unsigned long long)rate,
+		    (unsigned long long)link->latency_ns);
+}
+
+void link_init(struct gbsim_interface *intf)
+{
+	struct gbsim_link *link = &intf->link;
+
+	pthread_mutex_init(&link->lock, NULL);
+	link->tokens = LINK_BURST_BYTES;
+	clock_gettime(CLOCK_MONOTONIC, &link->last);
+	link->due = link->last;
+	TAILQ_INIT(&link->queue);
+	link->timer.fn = link_release;
+	link->timer.data = link;
+
+	link_update(intf);
+}
+
+/* Messages the link still holds are dropped with the interface */
+void link_cleanup(struct gbsim_interface *intf)
+{
+	struct gbsim_link *link = &intf->link;
+	struct gbsim_link_msg *msg;
+
+	/* Waits for link_release(), and cancels the timer it re-armed */
+	timer_del(&link->timer);
+
+	pthread_mutex_lock(&link->lock);
+	while ((msg = TAILQ_FIRST(&link->queue))) {
+		TAILQ_REMOVE(&link->queue, msg, node);
+		route_end(msg->route, true, 0, msg->start_ns);
+		free(msg);
+	}
+	pthread_mutex_unlock(&link->lock);
+
+	pthread_mutex_destroy(&link->lock);
+}
+
+/*
+ * Send @message of @size bytes from @intf to the AP on @fd, once the link
+ * would have delivered it.  The message is copied, the route is ended when
+ * it goes out.
+ */
+int link_send(struct gbsim_interface *intf, int fd, void *message,
+	      size_t size, struct gbsim_route *route, uint64_t start_ns)
+{
+	struct gbsim_link *link = &intf->link;
+	struct gbsim_link_msg *msg;
+	struct timespec now;
+	int64_t elapsed, tokens;
+	uint64_t wait_ns;
+	ssize_t nbytes;
+	bool first;
+
+	if (!link_model || !intf->interface_id) {
+		nbytes = write(fd, message, size);
+		route_end(route, true, size, start_ns);
+		return nbytes < 0 ? nbytes : 0;
+	}
+
+	msg = malloc(sizeof(*msg) + size);
+	if (!msg) {
+		route_end(route, true, 0, start_ns);
+		return -ENOMEM;
+	}
+	msg->fd = fd;
+	msg->route = route;
+	msg->start_ns = start_ns;
+	msg->size = size;
+	memcpy(msg->data, message, size);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&link->lock);
+
+	/* Refill, at most one burst worth of tokens */
+	elapsed = link_ts_diff_ns(&now, &link->last);
+	if (elapsed > 1000000000)
+		elapsed = 1000000000;
+	link->last = now;
+	tokens = link->tokens + elapsed * (int64_t)link->rate / 1000000000;
+	if (tokens > LINK_BURST_BYTES)
+		tokens = LINK_BURST_BYTES;
+
+	/* Go into debt, the next messages pay for it */
+	tokens -= size;
+	link->tokens = tokens;
+
+	wait_ns = link->latency_ns;
+	if (tokens < 0)
+		wait_ns += -tokens * 1000000000ULL / link->rate;
+
+	/* In order, even across a power mode change */
+	msg->due = now;
+	link_ts_add_ns(&msg->due, wait_ns);
+	if (link_ts_diff_ns(&msg->due, &link->due) < 0)
+		msg->due = link->due;
+	link->due = msg->due;
+
+	first = TAILQ_EMPTY(&link->queue);
+	TAILQ_INSERT_TAIL(&link->queue, msg, node);
+	if (first)
+		timer_add(&link->timer, link_ts_diff_ns(&msg->due, &now));
+
+	pthread_mutex_unlock(&link->lock);
+
+	return 0;
+}
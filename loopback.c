@@ -1,4 +1,3 @@
-
 /*
  * Greybus Simulator
  *
@@ -20,14 +19,26 @@
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "gbsim.h"
 
 /* Misc */
-#define GB_LOOPBACK_MAX				4
+#define GB_LOOPBACK_MAX				32
 #define GB_OPERATION_DATA_SIZE_MAX		\
 	(0x800 - sizeof(struct gb_loopback_transfer_request))
+/* Largest request payload gb_loopback_send() fits in one message */
+#define LOOPBACK_SIZE_MAX					\
+	(ES1_MSG_SIZE - sizeof(struct gb_operation_msg_hdr) -	\
+	 sizeof(struct gb_loopback_transfer_request))
+
+/* Requests in flight toward the AP, at most */
+#define LOOPBACK_INFLIGHT_MAX			64
+/* A request the AP hasn't answered by then is lost */
+#define LOOPBACK_TIMEOUT_NS			1000000000ULL
+/* Leave the AP loopback driver time to bind before the first request */
+#define LOOPBACK_START_DELAY_S			1
 
 enum {
 	LOOPBACK_FSM_IDLE = 0,
@@ -36,137 +47,516 @@ enum {
 	LOOPBACK_FSM_SINK_HOST,
 };
 
+struct gb_loopback_op {
+	bool		busy;
+	uint16_t	operation_id;
+	uint64_t	sent_ns;
+};
+
+struct gb_loopback_stats {
+	uint64_t	count;
+	uint64_t	errors;
+	uint64_t	lost;
+	uint64_t	bytes;
+	uint64_t	rtt_sum_ns;
+	uint64_t	rtt_min_ns;
+	uint64_t	rtt_max_ns;
+};
+
+/* One per loopback connection the module drives traffic on */
 struct gb_loopback {
+	TAILQ_ENTRY(gb_loopback) node;
+	struct gbsim_connection *connection;
+	pthread_t	thread;
 	uint16_t	cport_id;
 	uint16_t	hd_cport_id;
-	uint8_t		id;
+	unsigned int	id;
 	bool		init;
 	pthread_mutex_t	loopback_data;
+	pthread_cond_t	loopback_cond;
 	uint8_t		module_id;
-	uint32_t	ms;
+	uint8_t		interface_id;
+	uint64_t	interval_ns;
 	size_t		size;
 	int		state;
+
+	/* Module -> AP traffic generator */
+	uint16_t	next_id;
+	int		inflight;
+	struct gb_loopback_op ops[LOOPBACK_INFLIGHT_MAX];
+	struct gb_loopback_stats stats;
+	uint64_t	start_ns;
+	uint64_t	next_ns;
 };
 
-static struct gb_loopback gblb;
+static TAILQ_HEAD(, gb_loopback) loopback_ports =
+	TAILQ_HEAD_INITIALIZER(loopback_ports);
+static pthread_mutex_t loopback_ports_lock = PTHREAD_MUTEX_INITIALIZER;
 static bool terminate_thread;
-static int thread_started;
 static int port_count;
-static pthread_t loopback_pthread;
-static pthread_barrier_t loopback_barrier;
+static unsigned int port_ids;
 
-static int gb_loopback_ping_host(struct gb_loopback *gblbp)
+/* What the module sends the AP, set with -l */
+static int loopback_mode = LOOPBACK_FSM_IDLE;
+static size_t loopback_size;
+static uint64_t loopback_interval_ns;
+static int loopback_concurrency = 1;
+
+static uint64_t loopback_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Parse "ping|transfer|sink[:size[:interval_ms[:concurrency]]]", the
+ * interval may be fractional, e.g. 0.05 for 50us
+ */
+int loopback_setup(char *spec)
 {
-	/* TBD */
+	char *mode, *tok, *saveptr = NULL;
+
+	mode = strtok_r(spec, ":", &saveptr);
+	if (!mode)
+		return -EINVAL;
+
+	if (!strcmp(mode, "ping"))
+		loopback_mode = LOOPBACK_FSM_PING_HOST;
+	else if (!strcmp(mode, "transfer"))
+		loopback_mode = LOOPBACK_FSM_TRANSFER_HOST;
+	else if (!strcmp(mode, "sink"))
+		loopback_mode = LOOPBACK_FSM_SINK_HOST;
+	else {
+		gbsim_error("loopback: unknown mode %s\n", mode);
+		return -EINVAL;
+	}
+
+	if ((tok = strtok_r(NULL, ":", &saveptr)))
+		loopback_size = strtoul(tok, NULL, 0);
+	if ((tok = strtok_r(NULL, ":", &saveptr)))
+		loopback_interval_ns = strtod(tok, NULL) * 1000000;
+	if ((tok = strtok_r(NULL, ":", &saveptr)))
+		loopback_concurrency = strtol(tok, NULL, 0);
+
+	if (loopback_size > LOOPBACK_SIZE_MAX) {
+		gbsim_error("loopback: size %zu over %zu\n", loopback_size,
+			    LOOPBACK_SIZE_MAX);
+		return -EINVAL;
+	}
+	if (loopback_concurrency < 1 ||
+	    loopback_concurrency > LOOPBACK_INFLIGHT_MAX) {
+		gbsim_error("loopback: concurrency must be 1 to %d\n",
+			    LOOPBACK_INFLIGHT_MAX);
+		return -EINVAL;
+	}
+
 	return 0;
 }
 
-static int gb_loopback_transfer_host(struct gb_loopback *gblbp, size_t size)
+/* Give up on requests the AP didn't answer, must hold loopback_data */
+static void gb_loopback_expire(struct gb_loopback *gblbp, uint64_t now)
+{
+	struct gb_loopback_op *op;
+	int i;
+
+	for (i = 0; i < LOOPBACK_INFLIGHT_MAX; i++) {
+		op = &gblbp->ops[i];
+		if (!op->busy || now - op->sent_ns < LOOPBACK_TIMEOUT_NS)
+			continue;
+		op->busy = false;
+		gblbp->inflight--;
+		gblbp->stats.lost++;
+	}
+}
+
+/* When to wake up next while waiting for a slot, must hold loopback_data */
+static uint64_t gb_loopback_deadline(struct gb_loopback *gblbp)
+{
+	uint64_t deadline = UINT64_MAX;
+	int i;
+
+	if (gblbp->inflight < loopback_concurrency)
+		return gblbp->next_ns;
+
+	/* All slots busy: a response or the oldest request expiring */
+	for (i = 0; i < LOOPBACK_INFLIGHT_MAX; i++)
+		if (gblbp->ops[i].busy &&
+		    gblbp->ops[i].sent_ns + LOOPBACK_TIMEOUT_NS < deadline)
+			deadline = gblbp->ops[i].sent_ns + LOOPBACK_TIMEOUT_NS;
+
+	return deadline;
+}
+
+/*
+ * Wait until the next request is due and a slot is free, and take it.
+ * Returns NULL if the port went away.  The wait ends on the deadline, or
+ * when a response or the port going away signals loopback_cond.
+ */
+static struct gb_loopback_op *gb_loopback_op_get(struct gb_loopback *gblbp)
+{
+	struct gb_loopback_op *op = NULL;
+	struct timespec ts;
+	uint64_t now, deadline;
+	int i;
+
+	pthread_mutex_lock(&gblbp->loopback_data);
+	for (;;) {
+		now = loopback_now_ns();
+		gb_loopback_expire(gblbp, now);
+		if (!gblbp->init || terminate_thread)
+			goto out;
+		if (gblbp->inflight < loopback_concurrency &&
+		    now >= gblbp->next_ns)
+			break;
+
+		deadline = gb_loopback_deadline(gblbp);
+		ts.tv_sec = deadline / 1000000000;
+		ts.tv_nsec = deadline % 1000000000;
+		pthread_cond_timedwait(&gblbp->loopback_cond,
+				       &gblbp->loopback_data, &ts);
+	}
+
+	for (i = 0; i < LOOPBACK_INFLIGHT_MAX; i++)
+		if (!gblbp->ops[i].busy)
+			break;
+	op = &gblbp->ops[i];
+
+	/* Operation id 0 is for requests without a response */
+	if (!++gblbp->next_id)
+		gblbp->next_id = 1;
+	op->operation_id = gblbp->next_id;
+	op->busy = true;
+	op->sent_ns = now;
+	gblbp->inflight++;
+
+	/* Keep to the schedule, but don't burst to catch up after a stall */
+	gblbp->next_ns += gblbp->interval_ns;
+	if (gblbp->next_ns < now)
+		gblbp->next_ns = now;
+out:
+	pthread_mutex_unlock(&gblbp->loopback_data);
+
+	return op;
+}
+
+static void gb_loopback_op_put(struct gb_loopback *gblbp,
+			       struct gb_loopback_op *op)
+{
+	pthread_mutex_lock(&gblbp->loopback_data);
+	if (op->busy) {
+		op->busy = false;
+		gblbp->inflight--;
+		gblbp->stats.errors++;
+	}
+	pthread_cond_signal(&gblbp->loopback_cond);
+	pthread_mutex_unlock(&gblbp->loopback_data);
+}
+
+/* Send one loopback request of @type to the AP */
+static int gb_loopback_send(struct gb_loopback *gblbp, uint8_t type,
+			    size_t size)
 {
-	/* TBD */
+	char data[ES1_MSG_SIZE];
+	struct op_msg *msg = (struct op_msg *)data;
+	struct gb_loopback_transfer_request *request = &msg->loopback_xfer_req;
+	struct gb_loopback_op *op;
+	uint16_t message_size = sizeof(struct gb_operation_msg_hdr);
+	int ret;
+
+	op = gb_loopback_op_get(gblbp);
+	if (!op)
+		return -ENOTCONN;
+
+	if (type != GB_LOOPBACK_TYPE_PING) {
+		memset(request, 0, sizeof(*request));
+		request->len = htole32(size);
+		memset(request->data, op->operation_id & 0xff, size);
+		message_size += sizeof(*request) + size;
+	}
+
+	ret = send_request(gblbp->hd_cport_id, msg, message_size,
+			   op->operation_id, type);
+	if (ret) {
+		gb_loopback_op_put(gblbp, op);
+		return ret;
+	}
+
 	return 0;
 }
 
+static int gb_loopback_ping_host(struct gb_loopback *gblbp)
+{
+	return gb_loopback_send(gblbp, GB_LOOPBACK_TYPE_PING, 0);
+}
+
+static int gb_loopback_transfer_host(struct gb_loopback *gblbp, size_t size)
+{
+	return gb_loopback_send(gblbp, GB_LOOPBACK_TYPE_TRANSFER, size);
+}
+
 static int gb_loopback_sink_host(struct gb_loopback *gblbp, size_t size)
 {
-	/* TBD */
-	return 0;
+	return gb_loopback_send(gblbp, GB_LOOPBACK_TYPE_SINK, size);
 }
 
-/* Analog based on the firmware loop */
-static void *loopback_thread(void *param)
+/* The AP answered one of our requests */
+static void gb_loopback_response(struct gb_loopback *gblbp,
+				 struct op_msg *op_rsp, size_t rsize)
+{
+	struct gb_operation_msg_hdr *oph = &op_rsp->header;
+	struct gb_loopback_stats *stats = &gblbp->stats;
+	struct gb_loopback_op *op = NULL;
+	uint64_t rtt;
+	bool valid;
+	int i;
+
+	pthread_mutex_lock(&gblbp->loopback_data);
+
+	for (i = 0; i < LOOPBACK_INFLIGHT_MAX; i++) {
+		if (gblbp->ops[i].busy &&
+		    gblbp->ops[i].operation_id == oph->operation_id) {
+			op = &gblbp->ops[i];
+			break;
+		}
+	}
+	if (!op) {
+		gbsim_debug("loopback: late response %hu\n",
+			    oph->operation_id);
+		goto out;
+	}
+
+	rtt = loopback_now_ns() - op->sent_ns;
+	op->busy = false;
+	gblbp->inflight--;
+
+	valid = !oph->result;
+	if (valid && (oph->type & ~OP_RESPONSE) == GB_LOOPBACK_TYPE_TRANSFER)
+		valid = rsize >= sizeof(*oph) + sizeof(op_rsp->loopback_xfer_resp) &&
+			le32toh(op_rsp->loopback_xfer_resp.len) == gblbp->size;
+	if (!valid) {
+		stats->errors++;
+		goto out;
+	}
+
+	stats->count++;
+	stats->bytes += rsize;
+	stats->rtt_sum_ns += rtt;
+	if (!stats->rtt_min_ns || rtt < stats->rtt_min_ns)
+		stats->rtt_min_ns = rtt;
+	if (rtt > stats->rtt_max_ns)
+		stats->rtt_max_ns = rtt;
+out:
+	pthread_cond_signal(&gblbp->loopback_cond);
+	pthread_mutex_unlock(&gblbp->loopback_data);
+}
+
+static void gb_loopback_report(struct gb_loopback *gblbp)
 {
-	int state;
+	struct gb_loopback_stats *stats = &gblbp->stats;
+	uint64_t elapsed = loopback_now_ns() - gblbp->start_ns;
+
+	if (!stats->count && !stats->errors && !stats->lost)
+		return;
 
-	pthread_barrier_wait(&loopback_barrier);
+	gbsim_info("loopback %u: intf %hhu cport %hu: %llu ops, %llu errors, %llu lost, rtt avg %lluus min %lluus max %lluus, %.1f ops/s, %.3f MB/s\n",
+		   gblbp->id, gblbp->interface_id, gblbp->cport_id,
+		   (unsigned long long)stats->count,
+		   (unsigned long long)stats->errors,
+		   (unsigned long long)stats->lost,
+		   (unsigned long long)(stats->count ?
+				stats->rtt_sum_ns / stats->count / 1000 : 0),
+		   (unsigned long long)(stats->rtt_min_ns / 1000),
+		   (unsigned long long)(stats->rtt_max_ns / 1000),
+		   elapsed ? stats->count * 1e9 / elapsed : 0.0,
+		   elapsed ? stats->bytes * 1e3 / elapsed : 0.0);
+}
 
-	while (!terminate_thread) {
-		if (!gblb.init)
-			state = LOOPBACK_FSM_IDLE;
-		else
-			state = gblb.state;
+/* Analog based on the firmware loop, one thread per port */
+static void *loopback_thread(void *param)
+{
+	struct gb_loopback *gblbp = param;
 
-		switch (state) {
+	while (gblbp->init && !terminate_thread) {
+		switch (gblbp->state) {
 		case LOOPBACK_FSM_PING_HOST:
-			gb_loopback_ping_host(&gblb);
+			gb_loopback_ping_host(gblbp);
 			break;
 		case LOOPBACK_FSM_TRANSFER_HOST:
-			gb_loopback_transfer_host(&gblb, gblb.size);
+			gb_loopback_transfer_host(gblbp, gblbp->size);
 			break;
 		case LOOPBACK_FSM_SINK_HOST:
-			gb_loopback_sink_host(&gblb, gblb.size);
+			gb_loopback_sink_host(gblbp, gblbp->size);
 			break;
 		case LOOPBACK_FSM_IDLE:
 		default:
-			sleep(1);
-			continue;
+			gblbp->init = false;
+			break;
 		}
 	}
 
-	gbsim_info("Loopback thread exit\n");
-	pthread_exit(NULL);
+	gbsim_debug("Loopback %u thread exit\n", gblbp->id);
 	return NULL;
 }
 
-static void loopback_init_port(uint8_t module_id, uint16_t cport_id,
-			  uint16_t hd_cport_id, uint8_t id)
+static void loopback_init_port(struct gb_loopback *gblbp,
+			       struct gbsim_connection *connection,
+			       unsigned int id)
 {
-	gblb.module_id = module_id;
-	gblb.cport_id = cport_id;
-	gblb.hd_cport_id = hd_cport_id;
-	gblb.id = id;
-	gblb.init = true;
-	gbsim_debug("Loopback Module %u Cport %hu HDCport %hu index %d\n",
-		    module_id, cport_id, hd_cport_id, port_count);
+	pthread_condattr_t attr;
+
+	/* Deadlines are on the monotonic clock, like the timestamps */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&gblbp->loopback_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_init(&gblbp->loopback_data, NULL);
+
+	gblbp->connection = connection;
+	gblbp->module_id = cport_to_module_id(connection->cport_id);
+	gblbp->interface_id = connection->intf->interface_id;
+	gblbp->cport_id = connection->cport_id;
+	gblbp->hd_cport_id = connection->hd_cport_id;
+	gblbp->id = id;
+	gblbp->interval_ns = loopback_interval_ns;
+	gblbp->size = loopback_size;
+	gblbp->state = loopback_mode;
+	gblbp->start_ns = loopback_now_ns() +
+			  LOOPBACK_START_DELAY_S * 1000000000ULL;
+	gblbp->next_ns = gblbp->start_ns;
+	gblbp->init = true;
+	gbsim_debug("Loopback Module %u Cport %hu HDCport %hu index %u\n",
+		    gblbp->module_id, gblbp->cport_id, gblbp->hd_cport_id, id);
+}
+
+/* Stop the port generator, must not hold loopback_ports_lock */
+static void loopback_stop_port(struct gb_loopback *gblbp)
+{
+	pthread_mutex_lock(&gblbp->loopback_data);
+	gblbp->init = false;
+	pthread_cond_signal(&gblbp->loopback_cond);
+	pthread_mutex_unlock(&gblbp->loopback_data);
+
+	pthread_join(gblbp->thread, NULL);
+	gb_loopback_report(gblbp);
+
+	pthread_cond_destroy(&gblbp->loopback_cond);
+	pthread_mutex_destroy(&gblbp->loopback_data);
+	free(gblbp);
+}
+
+/* The AP created a loopback connection: start sending it traffic */
+void loopback_conn_create(struct gbsim_connection *connection)
+{
+	struct gb_loopback *gblbp;
+	int ret;
+
+	if (loopback_mode == LOOPBACK_FSM_IDLE)
+		return;
+
+	pthread_mutex_lock(&loopback_ports_lock);
+	if (port_count >= GB_LOOPBACK_MAX) {
+		gbsim_error("loopback: over %d ports, cport %hu left idle\n",
+			    GB_LOOPBACK_MAX, connection->cport_id);
+		goto out;
+	}
+
+	gblbp = calloc(1, sizeof(*gblbp));
+	if (!gblbp)
+		goto out;
+
+	loopback_init_port(gblbp, connection, port_ids++);
+	ret = pthread_create(&gblbp->thread, NULL, loopback_thread, gblbp);
+	if (ret) {
+		gbsim_error("can't create loopback thread: %s\n",
+			    strerror(ret));
+		pthread_cond_destroy(&gblbp->loopback_cond);
+		pthread_mutex_destroy(&gblbp->loopback_data);
+		free(gblbp);
+		goto out;
+	}
+
+	TAILQ_INSERT_TAIL(&loopback_ports, gblbp, node);
+	connection->priv = gblbp;
+	port_count++;
+out:
+	pthread_mutex_unlock(&loopback_ports_lock);
 }
 
+void loopback_conn_destroy(struct gbsim_connection *connection)
+{
+	struct gb_loopback *gblbp;
+
+	pthread_mutex_lock(&loopback_ports_lock);
+	gblbp = connection->priv;
+	if (gblbp) {
+		TAILQ_REMOVE(&loopback_ports, gblbp, node);
+		connection->priv = NULL;
+		port_count--;
+	}
+	pthread_mutex_unlock(&loopback_ports_lock);
+
+	if (gblbp)
+		loopback_stop_port(gblbp);
+}
 
 int loopback_handler(struct gbsim_connection *connection, void *rbuf,
 		 size_t rsize, void *tbuf, size_t tsize)
 {
-	char data[GB_OPERATION_DATA_SIZE_MAX];
 	struct gb_operation_msg_hdr *oph;
 	struct op_msg *op_req = rbuf;
-	struct op_msg *op_rsp = (struct op_msg *)data;
 	size_t payload_size = 0;
-	__le32 len;
+	uint32_t len;
 	uint16_t message_size;
 	uint16_t cport_id = connection->cport_id;
 	uint16_t hd_cport_id = connection->hd_cport_id;
 	uint8_t module_id;
 	uint8_t result = PROTOCOL_STATUS_SUCCESS;
 	struct gb_loopback_transfer_request *request;
-	struct gb_loopback_transfer_response *response = &op_rsp->loopback_xfer_resp;
+	struct gb_loopback *gblbp;
 
 	module_id = cport_to_module_id(cport_id);
 
 	oph = (struct gb_operation_msg_hdr *)&op_req->header;
 
-	/* Associate the module_id and cport_id with the device fd */
-	loopback_init_port(module_id, cport_id, hd_cport_id, oph->operation_id);
+	/*
+	 * Answer to traffic we generated.  The port only goes away on this
+	 * thread, or once it stopped
+	 */
+	if (oph->type & OP_RESPONSE) {
+		gblbp = connection->priv;
+		if (gblbp)
+			gb_loopback_response(gblbp, op_req, rsize);
+		return 0;
+	}
 
+	/*
+	 * The responses are built in place in the receive buffer: a transfer
+	 * response has the layout of its request, and its payload is the
+	 * request's, so only the header gets rewritten on the way out.
+	 */
 	switch (oph->type) {
 	case GB_LOOPBACK_TYPE_PING:
 		break;
 	case GB_LOOPBACK_TYPE_TRANSFER:
 		request = &op_req->loopback_xfer_req;
-		gbsim_debug("%s: LOOPBACK xfer rx %u\n", __func__,
-			    request->len);
-		if (request->len > GB_OPERATION_DATA_SIZE_MAX) {
+		len = le32toh(request->len);
+		gbsim_debug("%s: LOOPBACK xfer rx %u\n", __func__, len);
+		if (len > GB_OPERATION_DATA_SIZE_MAX ||
+		    sizeof(*oph) + sizeof(*request) + len > rsize) {
 			gbsim_error("Module %hhu -> AP Cport %hu rx %u bytes\n",
-				    module_id, cport_id, request->len);
+				    module_id, cport_id, len);
 			result = PROTOCOL_STATUS_INVALID;
 		} else {
-			len = le32toh(request->len);
-			response->len = htole32(len);
-			memcpy(&response->data, request->data, len);
-			payload_size = sizeof(*response) + len;
+			payload_size = sizeof(op_req->loopback_xfer_resp) + len;
 		}
 		break;
 	case GB_LOOPBACK_TYPE_SINK:
 		request = &op_req->loopback_xfer_req;
 		gbsim_debug("%s: LOOPBACK sink rx %u\n", __func__,
-			    request->len);
+			    le32toh(request->len));
 		break;
 	case GB_REQUEST_TYPE_CPORT_SHUTDOWN:
 		payload_size = 0;
@@ -176,7 +566,7 @@ int loopback_handler(struct gbsim_connection *connection, void *rbuf,
 	}
 
 	message_size = sizeof(struct gb_operation_msg_hdr) + payload_size;
-	return send_response(hd_cport_id, op_rsp, message_size,
+	return send_response(hd_cport_id, op_req, message_size,
 				oph->operation_id, oph->type, result);
 }
 
@@ -200,30 +590,20 @@ char *loopback_get_operation(uint8_t type)
 
 void loopback_cleanup(void)
 {
-	if (thread_started) {
-		/* signal termination */
-		terminate_thread = true;
+	struct gb_loopback *gblbp;
 
-		/* sync */
-		pthread_join(loopback_pthread, NULL);
-		pthread_barrier_destroy(&loopback_barrier);
-	}
-}
+	terminate_thread = true;
 
-void loopback_init(void)
-{
-	int ret;
+	pthread_mutex_lock(&loopback_ports_lock);
+	while ((gblbp = TAILQ_FIRST(&loopback_ports))) {
+		TAILQ_REMOVE(&loopback_ports, gblbp, node);
+		gblbp->connection->priv = NULL;
+		port_count--;
+		pthread_mutex_unlock(&loopback_ports_lock);
 
-	/* Init thread */
-	pthread_barrier_init(&loopback_barrier, 0, 2);
-	ret = pthread_create(&loopback_pthread, NULL, loopback_thread, NULL);
-	if (ret < 0) {
-		perror("can't create loopback thread");
-		loopback_cleanup();
-		return;
-	}
+		loopback_stop_port(gblbp);
 
-	/* Sync thread startup */
-	thread_started = 1;
-	pthread_barrier_wait(&loopback_barrier);
+		pthread_mutex_lock(&loopback_ports_lock);
+	}
+	pthread_mutex_unlock(&loopback_ports_lock);
 }
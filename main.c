@@ -22,49 +22,105 @@ int i2c_adapter = 0;
 int uart_portno = 0;
 int uart_count = 0;
 char *hotplug_basedir;
+char *fleet_config;
 int verbose = 0;
 
+static char *snapshot_file;
+
+volatile sig_atomic_t exit_requested;
+
 static struct sigaction sigact;
+static sigset_t sigmask;
 
 struct gbsim_interface interface;
 
 static void cleanup(void)
 {
+	int i;
+
 	printf("cleaning up\n");
 	sigemptyset(&sigact.sa_mask);
 
+	/* The receive threads call into everything below */
+	gbsim_usb_stop();
+	hotplug_bench_cleanup();
+	fleet_cleanup();
+	inotify_cleanup();
+	pwrmon_cleanup();
+	loopback_cleanup();
 	uart_cleanup();
 	gbsim_usb_cleanup();
-	svc_exit();
+	timer_cleanup();
+
+	/* Saved once no other thread is left to change the interfaces */
+	if (snapshot_file)
+		snapshot_save(snapshot_file);
+
+	route_cleanup();
+	for (i = 0; i < bridge_count; i++)
+		svc_exit(bridge_get(i));
 }
 
 static void signal_handler(int sig)
 {
 	if (sig == SIGINT || sig == SIGHUP || sig == SIGTERM)
-		cleanup();
+		exit_requested = 1;
 }
 
 static void signals_init(void)
 {
+	sigset_t block;
+
 	sigact.sa_handler = signal_handler;
 	sigemptyset(&sigact.sa_mask);
 	sigact.sa_flags = 0;
 	sigaction(SIGINT, &sigact, (struct sigaction *)NULL);
 	sigaction(SIGHUP, &sigact, (struct sigaction *)NULL);
 	sigaction(SIGTERM, &sigact, (struct sigaction *)NULL);
+
+	/* Every thread started from here on inherits the blocked mask */
+	sigemptyset(&block);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGHUP);
+	sigaddset(&block, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &block, &sigmask);
 }
 
 int main(int argc, char *argv[])
 {
 	int ret = -EINVAL;
-	int o;
+	char *cache_dir = NULL;
+	char *bench_spec = NULL;
+	int i, o;
 
-	while ((o = getopt(argc, argv, ":bh:i:u:U:v")) != -1) {
+	while ((o = getopt(argc, argv, ":A:bB:c:E:f:h:i:l:Ln:P:R:S:u:U:v")) != -1) {
 		switch (o) {
+		case 'A':
+			if (intf_activate_setup(optarg) < 0)
+				return 1;
+			printf("activation_delays %s\n", optarg);
+			break;
 		case 'b':
 			bbb_backend = 1;
 			printf("bbb_backend %d\n", bbb_backend);
 			break;
+		case 'B':
+			bench_spec = optarg;
+			printf("hotplug_bench %s\n", bench_spec);
+			break;
+		case 'c':
+			cache_dir = optarg;
+			printf("manifest_cache_dir %s\n", cache_dir);
+			break;
+		case 'E':
+			if (uart_line_setup(optarg) < 0)
+				return 1;
+			printf("uart_line_errors %s\n", optarg);
+			break;
+		case 'f':
+			fleet_config = optarg;
+			printf("fleet_config %s\n", fleet_config);
+			break;
 		case 'h':
 			hotplug_basedir = optarg;
 			printf("hotplug_basedir %s\n", hotplug_basedir);
@@ -73,6 +129,38 @@ int main(int argc, char *argv[])
 			i2c_adapter = atoi(optarg);
 			printf("i2c_adapter %d\n", i2c_adapter);
 			break;
+		case 'l':
+			if (loopback_setup(optarg) < 0)
+				return 1;
+			printf("loopback %s\n", optarg);
+			break;
+		case 'L':
+			link_model = 1;
+			printf("link_model %d\n", link_model);
+			break;
+		case 'n':
+			bridge_count = atoi(optarg);
+			if (bridge_count < 1 || bridge_count > GBSIM_MAX_BRIDGES) {
+				gbsim_error("bridge count must be 1 to %d\n",
+					    GBSIM_MAX_BRIDGES);
+				return 1;
+			}
+			printf("bridge_count %d\n", bridge_count);
+			break;
+		case 'P':
+			if (uart_pty_setup(optarg) < 0)
+				return 1;
+			printf("uart_pty_dir %s\n", optarg);
+			break;
+		case 'R':
+			if (uart_rx_setup(optarg) < 0)
+				return 1;
+			printf("uart_rx %s\n", optarg);
+			break;
+		case 'S':
+			snapshot_file = optarg;
+			printf("snapshot %s\n", snapshot_file);
+			break;
 		case 'u':
 			uart_portno = atoi(optarg);
 			printf("uart_portno %d\n", uart_portno);
@@ -88,8 +176,28 @@ int main(int argc, char *argv[])
 		case ':':
 			if (optopt == 'i')
 				gbsim_error("i2c_adapter required\n");
+			else if (optopt == 'A')
+				gbsim_error("activation delays required\n");
+			else if (optopt == 'B')
+				gbsim_error("count:rate:manifest required\n");
+			else if (optopt == 'c')
+				gbsim_error("manifest_cache_dir required\n");
+			else if (optopt == 'E')
+				gbsim_error("framing_ppm[:parity_ppm[:break_ppm]] required\n");
+			else if (optopt == 'f')
+				gbsim_error("fleet_config required\n");
 			else if (optopt == 'h')
 				gbsim_error("hotplug_basedir required\n");
+			else if (optopt == 'l')
+				gbsim_error("mode[:size[:interval_ms[:concurrency]]] required\n");
+			else if (optopt == 'n')
+				gbsim_error("bridge count required\n");
+			else if (optopt == 'P')
+				gbsim_error("uart pty directory required\n");
+			else if (optopt == 'R')
+				gbsim_error("latency_ms[:threshold] required\n");
+			else if (optopt == 'S')
+				gbsim_error("snapshot file required\n");
 			else if (optopt == 'u')
 				gbsim_error("uart_portno required\n");
 			else if (optopt == 'U')
@@ -110,29 +218,48 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (!hotplug_basedir) {
-		gbsim_error("hotplug directory not specified, aborting\n");
+	if (!hotplug_basedir && !fleet_config && !bench_spec && !snapshot_file) {
+		gbsim_error("neither hotplug directory, fleet configuration, benchmark nor snapshot specified, aborting\n");
 		return 1;
 	}
 
+	if (manifest_cache_init(cache_dir) < 0)
+		return 1;
+
+	if (fleet_config && fleet_load(fleet_config) < 0)
+		return 1;
+
+	if (bench_spec && hotplug_bench_setup(bench_spec) < 0)
+		return 1;
+
 	signals_init();
 
-	ret = gbsim_usb_init();
+	ret = timer_init();
 	if (ret < 0)
 		goto out;
 
-	/* Protocol handlers */
-	ret = svc_init();
+	ret = gbsim_usb_init();
 	if (ret < 0)
-		goto out_cleanup;
+		goto out;
+
+	/* Protocol handlers, one SVC per bridge */
+	for (i = 0; i < bridge_count; i++) {
+		ret = svc_init(bridge_get(i));
+		if (ret < 0)
+			goto out_cleanup;
+	}
 
 	gpio_init();
 	i2c_init();
 	uart_init();
 	sdio_init();
-	loopback_init();
+	pwrmon_init();
+
+	/* Warm start: bring back what the last run left */
+	if (snapshot_file && snapshot_restore(snapshot_file) < 0)
+		gbsim_error("snapshot restore failed, starting cold\n");
 
-	ret = functionfs_loop();
+	ret = functionfs_loop(&sigmask);
 
 out_cleanup:
 	cleanup();
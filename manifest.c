@@ -8,9 +8,11 @@
  */
 
 #include <errno.h>
-
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <linux/types.h>
 
 #include "gbsim.h"
@@ -164,6 +166,76 @@ bool manifest_parse(struct gbsim_svc *svc, int intf_id, void *data, size_t size)
 	return true;
 }
 
+/*
+ * Read a binary manifest blob from a file.  The returned buffer is
+ * allocated with malloc() and sized from the manifest header.
+ */
+static struct greybus_manifest_header *manifest_load_blob(const char *mnfs)
+{
+	struct greybus_manifest_header *mh;
+	int mnf_fd;
+	ssize_t n;
+	__le16 file_size;
+	uint16_t size;
+
+	if ((mnf_fd = open(mnfs, O_RDONLY)) < 0) {
+		gbsim_error("failed to open manifest blob %s\n", mnfs);
+		return NULL;
+	}
+
+	/* First just get the size */
+	if ((n = read(mnf_fd, &file_size, 2)) != 2) {
+		gbsim_error("failed to read manifest size, read %zd\n", n);
+		goto out;
+	}
+	size = le16toh(file_size);
+
+	/* Size has to cover at least itself */
+	if (size < 2) {
+		gbsim_error("bad manifest size %hu\n", size);
+		goto out;
+	}
+
+	/* Allocate a big enough buffer */
+	if (!(mh = malloc(size))) {
+		gbsim_error("failed to allocate manifest buffer\n");
+		goto out;
+	}
+
+	/* Now go back and read the whole thing */
+	if (lseek(mnf_fd, 0, SEEK_SET)) {
+		gbsim_error("failed to seek to front of manifest\n");
+		goto out_free;
+	}
+	if (read(mnf_fd, mh, size) != size) {
+		gbsim_error("failed to read manifest\n");
+		goto out_free;
+	}
+	close(mnf_fd);
+
+	return mh;
+out_free:
+	free(mh);
+out:
+	close(mnf_fd);
+
+	return NULL;
+}
+
+/*
+ * Load a manifest, either a binary blob or a manifest source (.mnfs) that
+ * gets compiled in-process.
+ */
+struct greybus_manifest_header *manifest_load(const char *fname)
+{
+	size_t len = strlen(fname);
+
+	if (len > 5 && !strcmp(fname + len - 5, ".mnfs"))
+		return manifest_compile(fname);
+
+	return manifest_load_blob(fname);
+}
+
 struct greybus_descriptor *manifest_get_descriptor(struct gbsim_interface *intf,
 				   enum greybus_descriptor_type desc_type,
 				   int skip)
@@ -0,0 +1,481 @@
+/*
+ * Greybus Simulator: manifest source compiler
+ *
+ * Turn the human-readable (INI-style) manifest format used by the Manifesto
+ * tool into the binary greybus_manifest layout consumed by manifest_parse().
+ * Compiled blobs are cached on disk, keyed by a hash of the source.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "gbsim.h"
+
+#define MNFS_SIZE_MAX		0xffff
+#define MNFS_LINE_MAX		256
+
+char *manifest_cache_dir;
+
+enum mnfs_section {
+	MNFS_SECTION_NONE,
+	MNFS_SECTION_HEADER,
+	MNFS_SECTION_INTERFACE,
+	MNFS_SECTION_STRING,
+	MNFS_SECTION_BUNDLE,
+	MNFS_SECTION_CPORT,
+};
+
+struct mnfs_state {
+	const char *fname;
+	int line;
+
+	enum mnfs_section section;
+	unsigned long id;
+	unsigned long values[3];
+	char string[MNFS_LINE_MAX];
+	int string_len;
+
+	uint8_t *buf;
+	size_t size;
+};
+
+/* FNV-1a, 64 bit */
+static uint64_t mnfs_hash(const char *data, size_t size)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	while (size--) {
+		hash ^= (uint8_t)*data++;
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+static char *mnfs_strip(char *s)
+{
+	char *end;
+
+	while (isspace((unsigned char)*s))
+		s++;
+
+	end = s + strlen(s);
+	while (end > s && isspace((unsigned char)end[-1]))
+		*--end = '\0';
+
+	return s;
+}
+
+static void *mnfs_reserve(struct mnfs_state *st, size_t size)
+{
+	void *p;
+
+	if (st->size + size > MNFS_SIZE_MAX) {
+		gbsim_error("%s: manifest too big\n", st->fname);
+		return NULL;
+	}
+
+	p = st->buf + st->size;
+	st->size += size;
+
+	return p;
+}
+
+static struct greybus_descriptor *mnfs_add_descriptor(struct mnfs_state *st,
+						      uint8_t type,
+						      size_t size)
+{
+	struct greybus_descriptor *desc;
+
+	desc = mnfs_reserve(st, size);
+	if (!desc)
+		return NULL;
+
+	desc->header.size = htole16(size);
+	desc->header.type = type;
+	desc->header.pad = 0;
+
+	return desc;
+}
+
+/* Emit the binary form of the section that was just completed */
+static int mnfs_flush_section(struct mnfs_state *st)
+{
+	struct greybus_manifest_header *mh;
+	struct greybus_descriptor *desc;
+	size_t size = sizeof(struct greybus_descriptor_header);
+
+	switch (st->section) {
+	case MNFS_SECTION_NONE:
+		return 0;
+	case MNFS_SECTION_HEADER:
+		mh = (struct greybus_manifest_header *)st->buf;
+		mh->version_major = st->values[0];
+		mh->version_minor = st->values[1];
+		break;
+	case MNFS_SECTION_INTERFACE:
+		size += sizeof(struct greybus_descriptor_interface);
+		desc = mnfs_add_descriptor(st, GREYBUS_TYPE_INTERFACE, size);
+		if (!desc)
+			return -ENOSPC;
+		desc->interface.vendor_stringid = st->values[0];
+		desc->interface.product_stringid = st->values[1];
+		desc->interface.features = st->values[2];
+		break;
+	case MNFS_SECTION_STRING:
+		/* String descriptors are padded to 4 byte boundaries */
+		size += sizeof(struct greybus_descriptor_string);
+		size = ALIGN(size + st->string_len);
+		desc = mnfs_add_descriptor(st, GREYBUS_TYPE_STRING, size);
+		if (!desc)
+			return -ENOSPC;
+		desc->string.length = st->string_len;
+		desc->string.id = st->id;
+		memcpy(desc->string.string, st->string, st->string_len);
+		break;
+	case MNFS_SECTION_BUNDLE:
+		size += sizeof(struct greybus_descriptor_bundle);
+		desc = mnfs_add_descriptor(st, GREYBUS_TYPE_BUNDLE, size);
+		if (!desc)
+			return -ENOSPC;
+		desc->bundle.id = st->id;
+		desc->bundle.class = st->values[0];
+		break;
+	case MNFS_SECTION_CPORT:
+		size += sizeof(struct greybus_descriptor_cport);
+		desc = mnfs_add_descriptor(st, GREYBUS_TYPE_CPORT, size);
+		if (!desc)
+			return -ENOSPC;
+		desc->cport.id = htole16(st->id);
+		desc->cport.bundle = st->values[0];
+		desc->cport.protocol_id = st->values[1];
+		break;
+	}
+
+	return 0;
+}
+
+static int mnfs_parse_section(struct mnfs_state *st, char *name)
+{
+	static const struct {
+		const char *name;
+		enum mnfs_section section;
+		unsigned long id_max;	/* 0 if the section takes no id */
+	} sections[] = {
+		{ "manifest-header",		MNFS_SECTION_HEADER,	0 },
+		{ "interface-descriptor",	MNFS_SECTION_INTERFACE,	0 },
+		{ "string-descriptor",		MNFS_SECTION_STRING,	0xff },
+		{ "bundle-descriptor",		MNFS_SECTION_BUNDLE,	0xff },
+		{ "cport-descriptor",		MNFS_SECTION_CPORT,	0xffff },
+	};
+	char *id, *end;
+	int i, ret;
+
+	ret = mnfs_flush_section(st);
+	if (ret < 0)
+		return ret;
+
+	memset(st->values, 0, sizeof(st->values));
+	st->string_len = 0;
+	st->id = 0;
+
+	id = strchr(name, ' ');
+	if (id)
+		*id++ = '\0';
+
+	for (i = 0; i < sizeof(sections) / sizeof(sections[0]); i++) {
+		if (strcmp(name, sections[i].name))
+			continue;
+
+		if (!sections[i].id_max != !id) {
+			gbsim_error("%s:%d: bad id for [%s]\n", st->fname,
+				    st->line, name);
+			return -EINVAL;
+		}
+
+		if (id) {
+			st->id = strtoul(id, &end, 0);
+			if (*mnfs_strip(end) || end == id ||
+			    st->id > sections[i].id_max) {
+				gbsim_error("%s:%d: bad id '%s'\n", st->fname,
+					    st->line, id);
+				return -EINVAL;
+			}
+		}
+
+		st->section = sections[i].section;
+		return 0;
+	}
+
+	gbsim_error("%s:%d: unknown section [%s]\n", st->fname, st->line, name);
+	return -EINVAL;
+}
+
+static int mnfs_parse_value(struct mnfs_state *st, char *key, char *value)
+{
+	static const struct {
+		enum mnfs_section section;
+		const char *key;
+		int index;
+	} keys[] = {
+		{ MNFS_SECTION_HEADER,		"version-major",	0 },
+		{ MNFS_SECTION_HEADER,		"version-minor",	1 },
+		{ MNFS_SECTION_INTERFACE,	"vendor-string-id",	0 },
+		{ MNFS_SECTION_INTERFACE,	"product-string-id",	1 },
+		{ MNFS_SECTION_INTERFACE,	"features",		2 },
+		{ MNFS_SECTION_BUNDLE,		"class",		0 },
+		{ MNFS_SECTION_CPORT,		"bundle",		0 },
+		{ MNFS_SECTION_CPORT,		"protocol",		1 },
+	};
+	char *end;
+	int i;
+
+	if (st->section == MNFS_SECTION_STRING && !strcmp(key, "string")) {
+		st->string_len = strlen(value);
+		if (st->string_len > 255) {
+			gbsim_error("%s:%d: string too long\n", st->fname,
+				    st->line);
+			return -EINVAL;
+		}
+		memcpy(st->string, value, st->string_len);
+		return 0;
+	}
+
+	for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+		if (keys[i].section != st->section || strcmp(keys[i].key, key))
+			continue;
+
+		st->values[keys[i].index] = strtoul(value, &end, 0);
+		if (*end || end == value || st->values[keys[i].index] > 0xff) {
+			gbsim_error("%s:%d: bad value '%s'\n", st->fname,
+				    st->line, value);
+			return -EINVAL;
+		}
+		return 0;
+	}
+
+	gbsim_error("%s:%d: unexpected key '%s'\n", st->fname, st->line, key);
+	return -EINVAL;
+}
+
+/*
+ * Compile a manifest source held in memory.  Returns a malloc()ed blob,
+ * suitable for manifest_parse(), or NULL on error.
+ */
+static struct greybus_manifest_header *mnfs_compile(const char *fname,
+						     char *src)
+{
+	struct greybus_manifest_header *mh;
+	struct mnfs_state st = { .fname = fname };
+	char *line, *next, *p, *eq;
+	int ret = 0;
+
+	st.buf = calloc(1, MNFS_SIZE_MAX);
+	if (!st.buf)
+		return NULL;
+
+	/* The manifest header always comes first */
+	st.size = sizeof(*mh);
+
+	for (line = src; line && !ret; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		st.line++;
+
+		p = mnfs_strip(line);
+		if (!*p || *p == ';' || *p == '#')
+			continue;
+
+		if (*p == '[') {
+			eq = strchr(p, ']');
+			if (!eq) {
+				gbsim_error("%s:%d: unterminated section\n",
+					    fname, st.line);
+				ret = -EINVAL;
+				break;
+			}
+			*eq = '\0';
+			ret = mnfs_parse_section(&st, mnfs_strip(p + 1));
+			continue;
+		}
+
+		eq = strchr(p, '=');
+		if (!eq || st.section == MNFS_SECTION_NONE) {
+			gbsim_error("%s:%d: syntax error\n", fname, st.line);
+			ret = -EINVAL;
+			break;
+		}
+		*eq = '\0';
+		ret = mnfs_parse_value(&st, mnfs_strip(p), mnfs_strip(eq + 1));
+	}
+
+	if (!ret)
+		ret = mnfs_flush_section(&st);
+	if (ret) {
+		free(st.buf);
+		return NULL;
+	}
+
+	mh = (struct greybus_manifest_header *)st.buf;
+	mh->size = htole16(st.size);
+
+	/* Give back what we did not use, keeping the buffer if that fails */
+	mh = realloc(st.buf, st.size);
+	if (!mh)
+		mh = (struct greybus_manifest_header *)st.buf;
+
+	return mh;
+}
+
+static char *mnfs_read_source(const char *fname, size_t *size)
+{
+	struct stat st;
+	char *src;
+	int fd;
+
+	fd = open(fname, O_RDONLY);
+	if (fd < 0) {
+		gbsim_error("failed to open manifest source %s\n", fname);
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size > 16 * MNFS_SIZE_MAX) {
+		gbsim_error("bad manifest source %s\n", fname);
+		close(fd);
+		return NULL;
+	}
+
+	src = malloc(st.st_size + 1);
+	if (!src) {
+		close(fd);
+		return NULL;
+	}
+
+	if (read(fd, src, st.st_size) != st.st_size) {
+		gbsim_error("failed to read manifest source %s\n", fname);
+		free(src);
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+
+	src[st.st_size] = '\0';
+	*size = st.st_size;
+
+	return src;
+}
+
+static void mnfs_cache_store(const char *cached,
+			     struct greybus_manifest_header *mh)
+{
+	char tmp[PATH_MAX + 16];
+	size_t size = le16toh(mh->size);
+	int fd;
+
+	/* Write a private file and rename it, readers never see a partial blob */
+	snprintf(tmp, sizeof(tmp), "%s.%d", cached, getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return;
+
+	if (write(fd, mh, size) != size || rename(tmp, cached) < 0) {
+		gbsim_error("failed to cache manifest blob %s\n", cached);
+		unlink(tmp);
+	}
+	close(fd);
+}
+
+/*
+ * Load a manifest source, using the cached blob if this exact source has
+ * been compiled before.
+ */
+struct greybus_manifest_header *manifest_compile(const char *fname)
+{
+	struct greybus_manifest_header *mh;
+	char cached[PATH_MAX];
+	size_t size;
+	uint64_t hash;
+	char *src;
+
+	src = mnfs_read_source(fname, &size);
+	if (!src)
+		return NULL;
+
+	hash = mnfs_hash(src, size);
+	if (manifest_cache_dir) {
+		snprintf(cached, sizeof(cached), "%s/%016llx.mnfb",
+			 manifest_cache_dir, (unsigned long long)hash);
+		if (!access(cached, R_OK)) {
+			mh = manifest_load(cached);
+			if (mh) {
+				gbsim_debug("%s: using cached %s\n", fname,
+					    cached);
+				free(src);
+				return mh;
+			}
+		}
+	}
+
+	mh = mnfs_compile(fname, src);
+	free(src);
+	if (!mh)
+		return NULL;
+
+	gbsim_debug("%s: compiled to %u bytes\n", fname, le16toh(mh->size));
+
+	if (manifest_cache_dir)
+		mnfs_cache_store(cached, mh);
+
+	return mh;
+}
+
+/*
+ * The cache only saves compile time: without an explicit directory, one
+ * that can't be created leaves gbsim running without a cache.
+ */
+int manifest_cache_init(const char *dir)
+{
+	const char *base;
+	char path[PATH_MAX];
+	bool explicit = dir;
+
+	if (!dir) {
+		base = getenv("XDG_CACHE_HOME");
+		if (base) {
+			snprintf(path, sizeof(path), "%s/gbsim", base);
+		} else {
+			base = getenv("HOME");
+			if (!base)
+				return 0;
+			snprintf(path, sizeof(path), "%s/.cache", base);
+			mkdir(path, 0755);
+			snprintf(path, sizeof(path), "%s/.cache/gbsim", base);
+		}
+		dir = path;
+	}
+
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+		gbsim_error("can't create manifest cache %s: %s\n", dir,
+			    strerror(errno));
+		return explicit ? -errno : 0;
+	}
+
+	manifest_cache_dir = strdup(dir);
+	if (!manifest_cache_dir)
+		return -ENOMEM;
+
+	gbsim_debug("manifest cache in %s\n", manifest_cache_dir);
+
+	return 0;
+}
@@ -0,0 +1,253 @@
+/*
+ * Greybus Simulator: SVC power monitor
+ *
+ * Every interface slot of every bridge's SVC has a VSYS rail.  A sampler
+ * thread derives the current of each powered rail from the traffic the
+ * interface carried since the last sample and from the power mode of its
+ * link.  Current and voltage are published together in one atomic word,
+ * which the SVC handlers read, so no lock is needed on either side.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "gbsim.h"
+
+/* Rails exposed to the AP: VSYS of interfaces 1 to PWRMON_RAIL_COUNT */
+#define PWRMON_RAIL_COUNT	32
+#define PWRMON_SAMPLE_US	1000
+
+/* VSYS supply and its distribution resistance */
+#define VSYS_UV			3800000
+#define VSYS_MOHM		50
+
+/* Bridge idle current, and what an active link adds per gear and lane */
+#define IDLE_UA			5000
+#define PWM_LANE_GEAR_UA	2000
+#define HS_LANE_BASE_UA		30000
+#define HS_LANE_GEAR_UA		20000
+
+/* Dynamic current for moving data: 1 uA per 10 KB/s */
+#define TRAFFIC_BPS_PER_UA	10000
+
+struct pwrmon_rail {
+	/* Updated by the interface */
+	atomic_bool present;
+	atomic_uint link_ua;
+	atomic_ullong bytes;
+
+	/* Sampler private */
+	uint64_t last_bytes;
+	uint64_t last_ns;
+	bool sampled;
+
+	/* Latest sample, uV in the upper and uA in the lower 32 bits */
+	atomic_ullong sample;
+};
+
+static struct pwrmon_rail rails[GBSIM_MAX_BRIDGES][256];
+static bool terminate_thread;
+static int thread_started;
+static pthread_t pwrmon_pthread;
+
+static uint64_t pwrmon_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct pwrmon_rail *pwrmon_rail(struct gbsim_interface *intf)
+{
+	return &rails[intf->svc->bridge->id][intf->interface_id];
+}
+
+/* Called when an interface appears or changes its power mode */
+void pwrmon_set_link(struct gbsim_interface *intf,
+		     const struct gbsim_pwr_mode *pm)
+{
+	struct pwrmon_rail *rail = pwrmon_rail(intf);
+	unsigned int ua = IDLE_UA;
+	unsigned int lanes = pm->tx_nlanes + pm->rx_nlanes;
+
+	switch (pm->tx_mode) {
+	case GB_SVC_UNIPRO_FAST_MODE:
+	case GB_SVC_UNIPRO_FAST_AUTO_MODE:
+		ua += lanes * (HS_LANE_BASE_UA + pm->tx_gear * HS_LANE_GEAR_UA);
+		break;
+	case GB_SVC_UNIPRO_SLOW_MODE:
+	case GB_SVC_UNIPRO_SLOW_AUTO_MODE:
+		ua += lanes * pm->tx_gear * PWM_LANE_GEAR_UA;
+		break;
+	default:
+		break;
+	}
+
+	atomic_store(&rail->link_ua, ua);
+	atomic_store(&rail->present, true);
+}
+
+void pwrmon_intf_off(struct gbsim_interface *intf)
+{
+	atomic_store(&pwrmon_rail(intf)->present, false);
+}
+
+/* Account for @size bytes carried by interface @intf */
+void pwrmon_account(struct gbsim_interface *intf, size_t size)
+{
+	atomic_fetch_add_explicit(&pwrmon_rail(intf)->bytes, size,
+				  memory_order_relaxed);
+}
+
+static void pwrmon_sample(struct pwrmon_rail *rail, uint64_t now)
+{
+	uint64_t bytes, rate = 0;
+	uint32_t ua;
+	int64_t uv;
+
+	/* An unpowered rail reads zero, written once when it goes down */
+	if (!atomic_load(&rail->present)) {
+		if (rail->sampled) {
+			atomic_store(&rail->sample, 0);
+			rail->last_ns = 0;
+			rail->sampled = false;
+		}
+		return;
+	}
+
+	bytes = atomic_load_explicit(&rail->bytes, memory_order_relaxed);
+	if (now > rail->last_ns && rail->last_ns)
+		rate = (bytes - rail->last_bytes) * 1000000000ULL /
+		       (now - rail->last_ns);
+	rail->last_bytes = bytes;
+	rail->last_ns = now;
+	rail->sampled = true;
+
+	ua = atomic_load(&rail->link_ua) + rate / TRAFFIC_BPS_PER_UA;
+	uv = VSYS_UV - (int64_t)ua * VSYS_MOHM / 1000;
+	if (uv < 0)
+		uv = 0;
+
+	atomic_store(&rail->sample, (uint64_t)uv << 32 | ua);
+}
+
+static void *pwrmon_thread(void *param)
+{
+	struct timespec next;
+	uint64_t now;
+	int b, i;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (!terminate_thread) {
+		now = pwrmon_now_ns();
+		for (b = 0; b < bridge_count; b++)
+			for (i = 1; i < 256; i++)
+				pwrmon_sample(&rails[b][i], now);
+
+		next.tv_nsec += PWRMON_SAMPLE_US * 1000;
+		if (next.tv_nsec >= 1000000000) {
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+
+	return NULL;
+}
+
+static int pwrmon_read(struct pwrmon_rail *rail, uint8_t type,
+		       uint32_t *value)
+{
+	uint64_t sample;
+	uint32_t ua, uv;
+
+	if (!thread_started)
+		return GB_SVC_PWRMON_GET_SAMPLE_HWERR;
+
+	sample = atomic_load(&rail->sample);
+	ua = sample;
+	uv = sample >> 32;
+
+	switch (type) {
+	case GB_SVC_PWRMON_TYPE_CURR:
+		*value = ua;
+		break;
+	case GB_SVC_PWRMON_TYPE_VOL:
+		*value = uv;
+		break;
+	case GB_SVC_PWRMON_TYPE_PWR:
+		*value = (uint64_t)ua * uv / 1000000;
+		break;
+	default:
+		return GB_SVC_PWRMON_GET_SAMPLE_INVAL;
+	}
+
+	return GB_SVC_PWRMON_GET_SAMPLE_OK;
+}
+
+int pwrmon_rail_count(void)
+{
+	return PWRMON_RAIL_COUNT;
+}
+
+void pwrmon_rail_names(struct gb_svc_pwrmon_rail_names_get_response *rsp)
+{
+	int i;
+
+	rsp->status = GB_SVC_OP_SUCCESS;
+	for (i = 0; i < PWRMON_RAIL_COUNT; i++) {
+		memset(rsp->name[i], 0, GB_SVC_PWRMON_RAIL_NAME_BUFSIZE);
+		snprintf((char *)rsp->name[i], GB_SVC_PWRMON_RAIL_NAME_BUFSIZE,
+			 "VSYS_INTF%d", i + 1);
+	}
+}
+
+int pwrmon_sample_get(struct gbsim_svc *svc, uint8_t rail_id, uint8_t type,
+		      uint32_t *value)
+{
+	if (rail_id >= PWRMON_RAIL_COUNT)
+		return GB_SVC_PWRMON_GET_SAMPLE_INVAL;
+
+	return pwrmon_read(&rails[svc->bridge->id][rail_id + 1], type, value);
+}
+
+int pwrmon_intf_sample_get(struct gbsim_svc *svc, uint8_t intf_id,
+			   uint8_t type, uint32_t *value)
+{
+	struct pwrmon_rail *rail = &rails[svc->bridge->id][intf_id];
+
+	if (!intf_id || !atomic_load(&rail->present))
+		return GB_SVC_PWRMON_GET_SAMPLE_INVAL;
+
+	return pwrmon_read(rail, type, value);
+}
+
+void pwrmon_cleanup(void)
+{
+	if (thread_started) {
+		terminate_thread = true;
+		pthread_join(pwrmon_pthread, NULL);
+		thread_started = 0;
+	}
+}
+
+void pwrmon_init(void)
+{
+	int ret;
+
+	ret = pthread_create(&pwrmon_pthread, NULL, pwrmon_thread, NULL);
+	if (ret) {
+		gbsim_error("can't create pwrmon thread: %s\n", strerror(ret));
+		return;
+	}
+	thread_started = 1;
+}
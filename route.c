@@ -0,0 +1,338 @@
+/*
+ * Greybus Simulator: SVC switch route table
+ *
+ * Routes set up by the AP through ROUTE_CREATE are kept in a small hash
+ * table keyed by their two (interface, device) end points.  A connection
+ * binds to the route between its two interfaces when it is created and
+ * only carries traffic while that route exists.  Every route counts the
+ * traffic it carries and how long it takes, so contention between modules
+ * sharing the switch shows up per route.  Every bridge has its own SVC and
+ * so its own switch: routes are keyed by bridge too.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/queue.h>
+#include <time.h>
+
+#include "gbsim.h"
+
+#define ROUTE_HASH_SIZE		256
+
+struct gbsim_route_stats {
+	atomic_ullong msgs;
+	atomic_ullong bytes;
+	atomic_ullong latency_ns;	/* sum, divide by msgs */
+	atomic_ullong latency_max_ns;
+};
+
+struct gbsim_route {
+	LIST_ENTRY(gbsim_route) node;
+
+	uint8_t bridge;
+
+	/* End points, lowest interface id first */
+	uint8_t intf1_id;
+	uint8_t dev1_id;
+	uint8_t intf2_id;
+	uint8_t dev2_id;
+
+	atomic_int refcount;
+	atomic_int inflight;
+	atomic_int inflight_max;
+
+	struct gbsim_route_stats tx;	/* module to AP */
+	struct gbsim_route_stats rx;	/* AP to module, until handled */
+};
+
+static LIST_HEAD(route_head, gbsim_route) route_table[ROUTE_HASH_SIZE];
+static pthread_mutex_t route_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Cost of ROUTE_CREATE/ROUTE_DESTROY handling, in the SVC */
+static uint64_t route_setup_ns, route_setup_count;
+static uint64_t route_teardown_ns, route_teardown_count;
+
+static uint64_t route_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline unsigned int route_hash(uint8_t bridge, uint8_t intf1_id,
+				      uint8_t intf2_id)
+{
+	if (intf1_id > intf2_id)
+		return route_hash(bridge, intf2_id, intf1_id);
+
+	return ((bridge * 31 + intf1_id) * 31 + intf2_id) &
+	       (ROUTE_HASH_SIZE - 1);
+}
+
+/* Must be called with route_lock held */
+static struct gbsim_route *__route_find(uint8_t bridge, uint8_t intf1_id,
+					uint8_t intf2_id)
+{
+	struct gbsim_route *route;
+	uint8_t tmp;
+
+	if (intf1_id > intf2_id) {
+		tmp = intf1_id;
+		intf1_id = intf2_id;
+		intf2_id = tmp;
+	}
+
+	LIST_FOREACH(route, &route_table[route_hash(bridge, intf1_id, intf2_id)],
+		     node)
+		if (route->bridge == bridge && route->intf1_id == intf1_id &&
+		    route->intf2_id == intf2_id)
+			return route;
+
+	return NULL;
+}
+
+static void route_put(struct gbsim_route *route)
+{
+	if (atomic_fetch_sub(&route->refcount, 1) == 1)
+		free(route);
+}
+
+static void route_stats_add(struct gbsim_route_stats *stats, size_t size,
+			    uint64_t latency_ns)
+{
+	unsigned long long max = atomic_load(&stats->latency_max_ns);
+
+	atomic_fetch_add(&stats->msgs, 1);
+	atomic_fetch_add(&stats->bytes, size);
+	atomic_fetch_add(&stats->latency_ns, latency_ns);
+	while (latency_ns > max &&
+	       !atomic_compare_exchange_weak(&stats->latency_max_ns, &max,
+					     latency_ns))
+		;
+}
+
+static void route_stats_dump(struct gbsim_route *route, const char *dir,
+			     struct gbsim_route_stats *stats)
+{
+	unsigned long long msgs = atomic_load(&stats->msgs);
+
+	gbsim_info("route (%hhu %hhu):(%hhu %hhu) %s %llu msgs %llu bytes, latency avg %lluns max %lluns\n",
+		   route->intf1_id, route->dev1_id, route->intf2_id,
+		   route->dev2_id, dir, msgs, atomic_load(&stats->bytes),
+		   msgs ? atomic_load(&stats->latency_ns) / msgs : 0,
+		   atomic_load(&stats->latency_max_ns));
+}
+
+static void route_dump(struct gbsim_route *route)
+{
+	route_stats_dump(route, "tx", &route->tx);
+	route_stats_dump(route, "rx", &route->rx);
+	gbsim_info("route (%hhu %hhu):(%hhu %hhu) up to %d messages in flight\n",
+		   route->intf1_id, route->dev1_id, route->intf2_id,
+		   route->dev2_id, atomic_load(&route->inflight_max));
+}
+
+/* Move the connections of @intf_id from route @from to route @to */
+static void route_rebind(struct gbsim_svc *svc, uint8_t intf_id,
+			 struct gbsim_route *from, struct gbsim_route *to)
+{
+	struct gbsim_connection *connection;
+	struct gbsim_interface *intf;
+
+	intf = interface_get_by_id(svc, intf_id);
+	if (!intf)
+		return;
+
+	TAILQ_FOREACH(connection, &intf->connections, cnode) {
+		if (connection->route != from)
+			continue;
+		if (from)
+			route_put(from);
+		if (to)
+			atomic_fetch_add(&to->refcount, 1);
+		connection->route = to;
+	}
+}
+
+int route_create(struct gbsim_svc *svc, uint8_t intf1_id, uint8_t dev1_id,
+		 uint8_t intf2_id, uint8_t dev2_id)
+{
+	uint64_t start = route_now_ns();
+	struct gbsim_route *route;
+
+	if (intf1_id > intf2_id)
+		return route_create(svc, intf2_id, dev2_id, intf1_id, dev1_id);
+
+	pthread_mutex_lock(&route_lock);
+
+	route = __route_find(svc->bridge->id, intf1_id, intf2_id);
+	if (route) {
+		if (route->dev1_id == dev1_id && route->dev2_id == dev2_id) {
+			pthread_mutex_unlock(&route_lock);
+			return 0;
+		}
+		gbsim_error("route (%hhu %hhu):(%hhu %hhu) already exists\n",
+			    route->intf1_id, route->dev1_id, route->intf2_id,
+			    route->dev2_id);
+		pthread_mutex_unlock(&route_lock);
+		return -EEXIST;
+	}
+
+	route = calloc(1, sizeof(*route));
+	if (!route) {
+		pthread_mutex_unlock(&route_lock);
+		return -ENOMEM;
+	}
+
+	route->bridge = svc->bridge->id;
+	route->intf1_id = intf1_id;
+	route->dev1_id = dev1_id;
+	route->intf2_id = intf2_id;
+	route->dev2_id = dev2_id;
+	atomic_init(&route->refcount, 1);
+
+	LIST_INSERT_HEAD(&route_table[route_hash(route->bridge, intf1_id,
+						 intf2_id)], route, node);
+
+	/* Connections left over from a previous route get the new one */
+	route_rebind(svc, intf1_id, NULL, route);
+	route_rebind(svc, intf2_id, NULL, route);
+
+	route_setup_ns += route_now_ns() - start;
+	route_setup_count++;
+
+	pthread_mutex_unlock(&route_lock);
+
+	return 0;
+}
+
+int route_destroy(struct gbsim_svc *svc, uint8_t intf1_id, uint8_t intf2_id)
+{
+	uint64_t start = route_now_ns();
+	struct gbsim_route *route;
+
+	pthread_mutex_lock(&route_lock);
+
+	route = __route_find(svc->bridge->id, intf1_id, intf2_id);
+	if (!route) {
+		pthread_mutex_unlock(&route_lock);
+		return -ENOENT;
+	}
+
+	LIST_REMOVE(route, node);
+
+	/* From now on these connections can't carry any traffic */
+	route_rebind(svc, route->intf1_id, route, NULL);
+	route_rebind(svc, route->intf2_id, route, NULL);
+
+	route_teardown_ns += route_now_ns() - start;
+	route_teardown_count++;
+
+	pthread_mutex_unlock(&route_lock);
+
+	if (verbose)
+		route_dump(route);
+	route_put(route);
+
+	return 0;
+}
+
+/* Bind a new connection to the route between its two interfaces */
+int route_connection_bind(struct gbsim_connection *connection,
+			  uint8_t peer_intf_id)
+{
+	struct gbsim_route *route;
+
+	pthread_mutex_lock(&route_lock);
+	route = __route_find(connection->intf->svc->bridge->id,
+			     connection->intf->interface_id, peer_intf_id);
+	if (route) {
+		atomic_fetch_add(&route->refcount, 1);
+		connection->route = route;
+	}
+	pthread_mutex_unlock(&route_lock);
+
+	return route ? 0 : -EHOSTUNREACH;
+}
+
+void route_connection_unbind(struct gbsim_connection *connection)
+{
+	pthread_mutex_lock(&route_lock);
+	if (connection->route)
+		route_put(connection->route);
+	connection->route = NULL;
+	pthread_mutex_unlock(&route_lock);
+}
+
+/*
+ * Start carrying a message over the route of @connection.  Returns the
+ * route, to be handed back to route_end() with @start_ns once the message
+ * is through, or NULL if the connection has no route.
+ */
+struct gbsim_route *route_begin(struct gbsim_connection *connection,
+				uint64_t *start_ns)
+{
+	struct gbsim_route *route;
+	int inflight, max;
+
+	pthread_mutex_lock(&route_lock);
+	route = connection->route;
+	if (route)
+		atomic_fetch_add(&route->refcount, 1);
+	pthread_mutex_unlock(&route_lock);
+
+	if (!route)
+		return NULL;
+
+	*start_ns = route_now_ns();
+	inflight = atomic_fetch_add(&route->inflight, 1) + 1;
+	max = atomic_load(&route->inflight_max);
+	while (inflight > max &&
+	       !atomic_compare_exchange_weak(&route->inflight_max, &max,
+					     inflight))
+		;
+
+	return route;
+}
+
+void route_end(struct gbsim_route *route, bool tx, size_t size,
+	       uint64_t start_ns)
+{
+	route_stats_add(tx ? &route->tx : &route->rx, size,
+			route_now_ns() - start_ns);
+	atomic_fetch_sub(&route->inflight, 1);
+	route_put(route);
+}
+
+void route_cleanup(void)
+{
+	struct gbsim_route *route;
+	int i;
+
+	pthread_mutex_lock(&route_lock);
+	for (i = 0; i < ROUTE_HASH_SIZE; i++) {
+		while ((route = LIST_FIRST(&route_table[i]))) {
+			LIST_REMOVE(route, node);
+			route_dump(route);
+			route_put(route);
+		}
+	}
+
+	if (route_setup_count)
+		gbsim_info("route setup: %llu, avg %lluns\n",
+			   (unsigned long long)route_setup_count,
+			   (unsigned long long)(route_setup_ns /
+						route_setup_count));
+	if (route_teardown_count)
+		gbsim_info("route teardown: %llu, avg %lluns\n",
+			   (unsigned long long)route_teardown_count,
+			   (unsigned long long)(route_teardown_ns /
+						route_teardown_count));
+	pthread_mutex_unlock(&route_lock);
+}
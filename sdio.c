@@ -311,8 +311,10 @@ static void sd_reset(void)
 	sd->card_status = CARD_STATUS_RESET;
 	sd_reset_cid();
 	sd_reset_csd();
-	free(sd->buf);
-	sd->buf = calloc(1, CARD_SIZE);
+
+	/* Like a real card, the contents survive a reset */
+	if (!sd->buf)
+		sd->buf = calloc(1, CARD_SIZE);
 }
 
 static void sd_prepare_r1(void)
@@ -739,3 +741,40 @@ void sdio_init(void)
 {
 	sd_init();
 }
+
+int sdio_snapshot_save(struct gbsim_snapshot *snap)
+{
+	int ret;
+
+	if (!sd || !sd->buf)
+		return 0;
+
+	ret = snapshot_write(snap, SNAPSHOT_TAG('S', 'D', 'I', 'O'), 0, sd,
+			     sizeof(*sd));
+	if (ret)
+		return ret;
+
+	return snapshot_write(snap, SNAPSHOT_TAG('S', 'D', 'B', 'F'), 0,
+			      sd->buf, CARD_SIZE);
+}
+
+void sdio_snapshot_restore(struct gbsim_snapshot *snap)
+{
+	struct sd_card card;
+	uint8_t *buf;
+
+	if (!sd || snapshot_read(snap, SNAPSHOT_TAG('S', 'D', 'I', 'O'), 0,
+				 &card, sizeof(card)))
+		return;
+
+	/* The card image is only paged in as the host reads it */
+	buf = snapshot_map(snap, SNAPSHOT_TAG('S', 'D', 'B', 'F'), 0,
+			   CARD_SIZE);
+	if (!buf)
+		return;
+
+	free(sd->buf);
+	*sd = card;
+	sd->buf = buf;
+	sd->xfer = NULL;
+}
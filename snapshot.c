@@ -0,0 +1,520 @@
+/*
+ * Greybus Simulator: snapshots
+ *
+ * On exit the interfaces, their UniPro attributes and the protocol models
+ * are written to a snapshot file, and read back on the next start so a long
+ * running setup comes back without loading manifests or rebuilding model
+ * state.  Routes and connections are not kept: a restarted gbsim is a new
+ * device to the AP, which sets them up again once the modules are
+ * announced.
+ *
+ * The file is a header page followed by sections, each starting on a page
+ * boundary, and a section table at the end.  Large model buffers (SPI NOR
+ * flash, SD card) are mapped copy-on-write straight from the file instead
+ * of being read, and all-zero pages are left as holes when writing.
+ * Interface sections are numbered by bridge and interface id, so every
+ * bridge gets its interfaces back.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "gbsim.h"
+
+#define SNAPSHOT_MAGIC		"GBSIMSNP"
+#define SNAPSHOT_VERSION	1
+
+#define SNAPSHOT_INTF		SNAPSHOT_TAG('I', 'N', 'T', 'F')
+#define SNAPSHOT_MANIFEST	SNAPSHOT_TAG('M', 'N', 'F', 'S')
+#define SNAPSHOT_CPORT_PARAMS	SNAPSHOT_TAG('C', 'P', 'R', 'M')
+
+#define SNAPSHOT_INTF_ID(bridge, intf_id)	((bridge) << 8 | (intf_id))
+
+struct snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t page_size;
+	uint32_t count;
+	uint32_t pad;
+	uint64_t table;
+};
+
+struct snapshot_section {
+	uint32_t tag;
+	uint32_t id;
+	uint64_t offset;
+	uint64_t size;
+};
+
+struct gbsim_snapshot {
+	int fd;
+	size_t page_size;
+	off_t end;
+	struct snapshot_section *sections;
+	unsigned int count;
+	unsigned int alloc;
+};
+
+struct snapshot_intf {
+	uint8_t interface_id;
+	uint8_t features;
+	uint8_t activation;
+	uint8_t pad;
+	uint32_t manifest_fname_hash;
+};
+
+/* Interfaces brought back by the last restore, announced on SVC hello */
+static bool restored[GBSIM_MAX_BRIDGES][256];
+
+static bool snapshot_zero(const uint8_t *data, size_t size)
+{
+	return !data[0] && !memcmp(data, data + 1, size - 1);
+}
+
+static int snapshot_pwrite(int fd, const void *data, size_t size, off_t offset)
+{
+	ssize_t ret;
+
+	while (size) {
+		ret = pwrite(fd, data, size, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		data = (const uint8_t *)data + ret;
+		size -= ret;
+		offset += ret;
+	}
+
+	return 0;
+}
+
+static int snapshot_pread(int fd, void *buf, size_t size, off_t offset)
+{
+	ssize_t ret;
+
+	while (size) {
+		ret = pread(fd, buf, size, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (!ret)
+			return -EIO;
+		buf = (uint8_t *)buf + ret;
+		size -= ret;
+		offset += ret;
+	}
+
+	return 0;
+}
+
+/* Append section (@tag, @id) holding @size bytes of @data */
+int snapshot_write(struct gbsim_snapshot *snap, uint32_t tag, uint32_t id,
+		   const void *data, size_t size)
+{
+	struct snapshot_section *sec;
+	size_t chunk, done;
+	int ret;
+
+	if (snap->count == snap->alloc) {
+		unsigned int alloc = snap->alloc ? snap->alloc * 2 : 32;
+
+		sec = realloc(snap->sections, alloc * sizeof(*sec));
+		if (!sec)
+			return -ENOMEM;
+		snap->sections = sec;
+		snap->alloc = alloc;
+	}
+
+	sec = &snap->sections[snap->count];
+	sec->tag = tag;
+	sec->id = id;
+	sec->offset = snap->end;
+	sec->size = size;
+
+	/* Page by page, skipping the zero ones */
+	for (done = 0; done < size; done += chunk) {
+		chunk = size - done;
+		if (chunk > snap->page_size)
+			chunk = snap->page_size;
+		if (snapshot_zero((const uint8_t *)data + done, chunk))
+			continue;
+		ret = snapshot_pwrite(snap->fd, (const uint8_t *)data + done,
+				      chunk, snap->end + done);
+		if (ret)
+			return ret;
+	}
+
+	snap->end += (size + snap->page_size - 1) & ~(snap->page_size - 1);
+	snap->count++;
+
+	return 0;
+}
+
+static struct snapshot_section *snapshot_find(struct gbsim_snapshot *snap,
+					      uint32_t tag, uint32_t id)
+{
+	unsigned int i;
+
+	for (i = 0; i < snap->count; i++)
+		if (snap->sections[i].tag == tag && snap->sections[i].id == id)
+			return &snap->sections[i];
+
+	return NULL;
+}
+
+/* Read section (@tag, @id) into @buf, which must be exactly @size bytes */
+int snapshot_read(struct gbsim_snapshot *snap, uint32_t tag, uint32_t id,
+		  void *buf, size_t size)
+{
+	struct snapshot_section *sec = snapshot_find(snap, tag, id);
+
+	if (!sec)
+		return -ENOENT;
+	if (sec->size != size) {
+		gbsim_error("snapshot: section %08x/%u is %llu bytes, expected %zu\n",
+			    tag, id, (unsigned long long)sec->size, size);
+		return -EINVAL;
+	}
+
+	return snapshot_pread(snap->fd, buf, size, sec->offset);
+}
+
+/* Read section (@tag, @id) into a malloc()ed buffer, its size in @size */
+void *snapshot_load(struct gbsim_snapshot *snap, uint32_t tag, uint32_t id,
+		    size_t *size)
+{
+	struct snapshot_section *sec = snapshot_find(snap, tag, id);
+	void *buf;
+
+	if (!sec || !sec->size)
+		return NULL;
+
+	buf = malloc(sec->size);
+	if (!buf)
+		return NULL;
+
+	if (snapshot_pread(snap->fd, buf, sec->size, sec->offset)) {
+		free(buf);
+		return NULL;
+	}
+
+	*size = sec->size;
+
+	return buf;
+}
+
+/*
+ * Map section (@tag, @id) copy-on-write.  Pages are only read when first
+ * touched, so even a large buffer is restored right away.  The mapping
+ * stays valid once the snapshot is closed, or replaced by the next save.
+ */
+void *snapshot_map(struct gbsim_snapshot *snap, uint32_t tag, uint32_t id,
+		   size_t size)
+{
+	struct snapshot_section *sec = snapshot_find(snap, tag, id);
+	void *buf;
+
+	if (!sec || sec->size != size)
+		return NULL;
+
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, snap->fd,
+		   sec->offset);
+	if (buf == MAP_FAILED) {
+		gbsim_error("snapshot: can't map section %08x/%u: %s\n", tag,
+			    id, strerror(errno));
+		return NULL;
+	}
+
+	return buf;
+}
+
+static int snapshot_intf_save(struct gbsim_snapshot *snap,
+			      struct gbsim_interface *intf)
+{
+	struct snapshot_intf si = { };
+	uint32_t id = SNAPSHOT_INTF_ID(intf->svc->bridge->id,
+				       intf->interface_id);
+	int ret;
+
+	if (!intf->manifest)
+		return 0;
+
+	si.interface_id = intf->interface_id;
+	si.features = intf->features;
+	si.activation = intf->activation;
+	si.manifest_fname_hash = intf->manifest_fname_hash;
+
+	ret = snapshot_write(snap, SNAPSHOT_INTF, id, &si, sizeof(si));
+	if (ret)
+		return ret;
+
+	ret = snapshot_write(snap, SNAPSHOT_MANIFEST, id, intf->manifest,
+			     intf->manifest_size);
+	if (ret)
+		return ret;
+
+	if (intf->cport_params_count) {
+		ret = snapshot_write(snap, SNAPSHOT_CPORT_PARAMS, id,
+				     intf->cport_params,
+				     intf->cport_params_count *
+				     sizeof(*intf->cport_params));
+		if (ret)
+			return ret;
+	}
+
+	return dme_snapshot_save(&intf->dme, snap, id);
+}
+
+static int snapshot_intf_restore(struct gbsim_snapshot *snap, uint32_t id)
+{
+	struct gbsim_bridge *bridge = bridge_get(id >> 8);
+	uint8_t intf_id = id & 0xff;
+	struct gbsim_cport_params *params;
+	struct gbsim_interface *intf;
+	struct snapshot_intf si;
+	struct gbsim_svc *svc;
+	size_t size, psize = 0;
+	void *manifest;
+
+	if (!bridge || !bridge->svc) {
+		gbsim_error("snapshot: no bridge %u for interface %u\n",
+			    id >> 8, intf_id);
+		return -ENODEV;
+	}
+	svc = bridge->svc;
+
+	if (snapshot_read(snap, SNAPSHOT_INTF, id, &si, sizeof(si)))
+		return -EINVAL;
+
+	if (interface_get_by_id(svc, intf_id)) {
+		gbsim_error("snapshot: interface %u already present\n",
+			    intf_id);
+		return -EEXIST;
+	}
+
+	manifest = snapshot_load(snap, SNAPSHOT_MANIFEST, id, &size);
+	if (!manifest)
+		return -EINVAL;
+
+	params = snapshot_load(snap, SNAPSHOT_CPORT_PARAMS, id, &psize);
+
+	intf = interface_alloc(svc, intf_id);
+	if (!intf) {
+		free(manifest);
+		free(params);
+		return -ENOMEM;
+	}
+
+	intf->manifest_fname_hash = si.manifest_fname_hash;
+	intf->cport_params = params;
+	intf->cport_params_count = psize / sizeof(*params);
+
+	if (!manifest_parse(svc, intf_id, manifest, size)) {
+		gbsim_error("snapshot: bad manifest for interface %u\n",
+			    intf_id);
+		if (intf->manifest != manifest)
+			free(manifest);
+		interface_free(svc, intf);
+		return -EINVAL;
+	}
+
+	intf->features = si.features;
+	intf->activation = si.activation;
+	dme_snapshot_restore(&intf->dme, snap, id);
+	link_update(intf);
+
+	restored[bridge->id][intf_id] = true;
+
+	return 0;
+}
+
+int snapshot_save(const char *path)
+{
+	struct gbsim_snapshot snap = { };
+	struct snapshot_header header = { };
+	struct gbsim_bridge *bridge;
+	struct gbsim_interface *intf;
+	char tmp[PATH_MAX];
+	int i, ret;
+
+	for (i = 0; i < bridge_count; i++)
+		if (!bridge_get(i)->svc)
+			return -ENODEV;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	snap.fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (snap.fd < 0) {
+		gbsim_error("snapshot: can't create %s: %s\n", tmp,
+			    strerror(errno));
+		return -errno;
+	}
+
+	snap.page_size = sysconf(_SC_PAGESIZE);
+	snap.end = snap.page_size;
+
+	for (i = 0; i < bridge_count; i++) {
+		bridge = bridge_get(i);
+		TAILQ_FOREACH(intf, &bridge->svc->intfs, intf_node) {
+			if (!intf->interface_id)
+				continue;
+			ret = snapshot_intf_save(&snap, intf);
+			if (ret)
+				goto err;
+		}
+	}
+
+	ret = gpio_snapshot_save(&snap);
+	if (ret)
+		goto err;
+	ret = lights_snapshot_save(&snap);
+	if (ret)
+		goto err;
+	ret = sdio_snapshot_save(&snap);
+	if (ret)
+		goto err;
+	ret = spi_snapshot_save(&snap);
+	if (ret)
+		goto err;
+
+	ret = snapshot_pwrite(snap.fd, snap.sections,
+			      snap.count * sizeof(*snap.sections), snap.end);
+	if (ret)
+		goto err;
+
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = SNAPSHOT_VERSION;
+	header.page_size = snap.page_size;
+	header.count = snap.count;
+	header.table = snap.end;
+
+	ret = snapshot_pwrite(snap.fd, &header, sizeof(header), 0);
+	if (ret)
+		goto err;
+
+	if (fsync(snap.fd) < 0) {
+		ret = -errno;
+		goto err;
+	}
+	close(snap.fd);
+	free(snap.sections);
+
+	/* Mappings of the previous snapshot keep the old file alive */
+	if (rename(tmp, path) < 0) {
+		ret = -errno;
+		gbsim_error("snapshot: can't rename %s: %s\n", tmp,
+			    strerror(errno));
+		unlink(tmp);
+		return ret;
+	}
+
+	gbsim_info("snapshot: saved %u sections to %s\n", header.count, path);
+
+	return 0;
+
+err:
+	gbsim_error("snapshot: failed to save %s: %s\n", path, strerror(-ret));
+	close(snap.fd);
+	free(snap.sections);
+	unlink(tmp);
+
+	return ret;
+}
+
+int snapshot_restore(const char *path)
+{
+	struct gbsim_snapshot snap = { };
+	struct snapshot_header header;
+	unsigned int i, count = 0;
+	int ret;
+
+	snap.fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (snap.fd < 0) {
+		if (errno == ENOENT) {
+			gbsim_info("snapshot: no %s yet, starting cold\n",
+				   path);
+			return 0;
+		}
+		gbsim_error("snapshot: can't open %s: %s\n", path,
+			    strerror(errno));
+		return -errno;
+	}
+
+	snap.page_size = sysconf(_SC_PAGESIZE);
+
+	ret = snapshot_pread(snap.fd, &header, sizeof(header), 0);
+	if (ret)
+		goto out;
+
+	if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) ||
+	    header.version != SNAPSHOT_VERSION ||
+	    header.page_size != snap.page_size) {
+		gbsim_error("snapshot: %s is not a usable snapshot\n", path);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	snap.count = header.count;
+	snap.sections = calloc(snap.count, sizeof(*snap.sections));
+	if (!snap.sections) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = snapshot_pread(snap.fd, snap.sections,
+			     snap.count * sizeof(*snap.sections), header.table);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < snap.count; i++) {
+		if (snap.sections[i].tag != SNAPSHOT_INTF ||
+		    snap.sections[i].id >= SNAPSHOT_INTF_ID(GBSIM_MAX_BRIDGES, 0))
+			continue;
+		if (!snapshot_intf_restore(&snap, snap.sections[i].id))
+			count++;
+	}
+
+	gpio_snapshot_restore(&snap);
+	lights_snapshot_restore(&snap);
+	sdio_snapshot_restore(&snap);
+	spi_snapshot_restore(&snap);
+
+	gbsim_info("snapshot: restored %u interfaces from %s\n", count, path);
+
+out:
+	if (ret)
+		gbsim_error("snapshot: failed to restore %s: %s\n", path,
+			    strerror(-ret));
+	free(snap.sections);
+	close(snap.fd);
+
+	return ret;
+}
+
+/* The AP is up: announce the interfaces brought back from the snapshot */
+void snapshot_start(struct gbsim_svc *s)
+{
+	bool *intfs = restored[s->bridge->id];
+	int i;
+
+	for (i = 1; i < 256; i++) {
+		if (!intfs[i])
+			continue;
+		intfs[i] = false;
+		if (interface_get_by_id(s, i))
+			svc_request_send(s, GB_SVC_TYPE_MODULE_INSERTED, i);
+	}
+}
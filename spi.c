@@ -8,6 +8,7 @@
  */
 
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
@@ -317,7 +318,9 @@ int spi_handler(struct gbsim_connection *connection, void *rbuf,
 
 	switch (oph->type) {
 	case GB_SPI_TYPE_MASTER_CONFIG:
-		spi_master_setup();
+		/* The flash keeps its contents across configurations */
+		if (!master)
+			spi_master_setup();
 		payload_size = sizeof(struct gb_spi_master_config_response);
 
 		op_rsp->spi_mc_rsp.mode = htole16(master->mode);
@@ -388,3 +391,52 @@ char *spi_get_operation(uint8_t type)
 		return "(Unknown operation)";
 	}
 }
+
+int spi_snapshot_save(struct gbsim_snapshot *snap)
+{
+	struct gb_spi_dev *spi_dev;
+	int ret;
+	int i;
+
+	if (!master || !master->devices)
+		return 0;
+
+	for (i = 0; i < master->num_chipselect; i++) {
+		spi_dev = &master->devices[i];
+		if (!spi_dev->buf)
+			continue;
+		ret = snapshot_write(snap, SNAPSHOT_TAG('S', 'P', 'N', 'R'), i,
+				     spi_dev->buf, spi_dev->buf_size);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+void spi_snapshot_restore(struct gbsim_snapshot *snap)
+{
+	struct gb_spi_dev *spi_dev;
+	uint8_t *buf;
+	int i;
+
+	for (i = 0; i < SPI_NUM_CS; i++) {
+		if (!(i % 2))
+			continue;
+
+		/* 32 MiB of flash, mapped rather than read */
+		buf = snapshot_map(snap, SNAPSHOT_TAG('S', 'P', 'N', 'R'), i,
+				   SPI_NOR_SIZE);
+		if (!buf)
+			continue;
+
+		if (!master && spi_master_setup()) {
+			munmap(buf, SPI_NOR_SIZE);
+			return;
+		}
+
+		spi_dev = &master->devices[i];
+		free(spi_dev->buf);
+		spi_dev->buf = buf;
+	}
+}
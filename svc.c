@@ -20,27 +20,63 @@
 
 #include "gbsim.h"
 
-struct gbsim_svc *svc;
-
 int svc_get_next_intf_id(struct gbsim_svc *s)
 {
-	struct gbsim_interface *intf;
 	int intf_id = 1;
 
-start_again:
-	TAILQ_FOREACH(intf, &s->intfs, intf_node) {
-		if (intf_id == intf->interface_id) {
-			intf_id++;
-			goto start_again;
-		}
-	}
+	while (intf_id < 255 && s->intf_by_id[intf_id])
+		intf_id++;
 
 	return intf_id;
 }
 
-static int svc_handler_request(uint16_t cport_id, uint16_t hd_cport_id,
-			       void *rbuf, size_t rsize, void *tbuf,
-			       size_t tsize)
+static uint8_t svc_intf_set_pwrm(struct gbsim_svc *svc,
+				 struct gb_svc_intf_set_pwrm_request *req)
+{
+	struct gbsim_interface *intf;
+	struct gbsim_pwr_mode pm;
+
+	gbsim_debug("SVC set pwrm intf %hhu tx (%hhu G%hhu x%hhu) rx (%hhu G%hhu x%hhu) series %hhu\n",
+		    req->intf_id, req->tx_mode, req->tx_gear, req->tx_nlanes,
+		    req->rx_mode, req->rx_gear, req->rx_nlanes, req->hs_series);
+
+	intf = interface_get_by_id(svc, req->intf_id);
+	if (!intf)
+		return GB_SVC_SETPWRM_PWR_ERROR_CAP;
+
+	if (link_check_pwr_mode(req->tx_mode, req->tx_gear, req->tx_nlanes) ||
+	    link_check_pwr_mode(req->rx_mode, req->rx_gear, req->rx_nlanes))
+		return GB_SVC_SETPWRM_PWR_ERROR_CAP;
+
+	/* Hibernation keeps the negotiated gears for the way back up */
+	if (req->tx_mode == GB_SVC_UNIPRO_HIBERNATE_MODE &&
+	    req->rx_mode == GB_SVC_UNIPRO_HIBERNATE_MODE)
+		return GB_SVC_SETPWRM_PWR_OK;
+
+	dme_get_pwr_mode(&intf->dme, &pm);
+	if (req->tx_mode != GB_SVC_UNIPRO_MODE_UNCHANGED) {
+		pm.tx_mode = req->tx_mode;
+		pm.tx_gear = req->tx_gear;
+		pm.tx_nlanes = req->tx_nlanes;
+	}
+	if (req->rx_mode != GB_SVC_UNIPRO_MODE_UNCHANGED) {
+		pm.rx_mode = req->rx_mode;
+		pm.rx_gear = req->rx_gear;
+		pm.rx_nlanes = req->rx_nlanes;
+	}
+	if (req->hs_series)
+		pm.hs_series = req->hs_series;
+
+	dme_set_pwr_mode(&intf->dme, &pm);
+	link_update(intf);
+
+	/* The power mode change was carried out by the local (SVC) end */
+	return GB_SVC_SETPWRM_PWR_LOCAL;
+}
+
+static int svc_handler_request(struct gbsim_svc *svc, uint16_t cport_id,
+			       uint16_t hd_cport_id, void *rbuf, size_t rsize,
+			       void *tbuf, size_t tsize)
 {
 	struct op_msg *op_req = rbuf;
 	struct op_msg *op_rsp = tbuf;
@@ -55,17 +91,29 @@ static int svc_handler_request(uint16_t cport_id, uint16_t hd_cport_id,
 	struct gb_svc_route_create_request *svc_route_create;
 	struct gb_svc_route_destroy_request *svc_route_destroy;
 	struct gb_svc_pwrmon_rail_count_get_response *svc_pwrmon_rail_count_get_response;
+	struct gb_svc_pwrmon_rail_names_get_response *svc_pwrmon_rail_names_get_response;
+	struct gb_svc_pwrmon_sample_get_request *svc_pwrmon_sample_get_request;
+	struct gb_svc_pwrmon_sample_get_response *svc_pwrmon_sample_get_response;
+	struct gb_svc_pwrmon_intf_sample_get_request *svc_pwrmon_intf_sample_get_request;
+	struct gb_svc_pwrmon_intf_sample_get_response *svc_pwrmon_intf_sample_get_response;
 	struct gb_svc_intf_vsys_response *svc_intf_vsys_response;
 	struct gb_svc_intf_refclk_response *svc_intf_refclk_response;
 	struct gb_svc_intf_unipro_response *svc_intf_unipro_response;
 	struct gb_svc_intf_activate_response *svc_intf_activate_response;
 	struct gb_svc_intf_resume_response *svc_intf_resume_response;
 	struct gb_svc_intf_set_pwrm_response *svc_intf_set_pwrm_response;
+	struct gb_svc_timesync_enable_request *svc_timesync_enable;
+	struct gb_svc_timesync_authoritative_response *svc_timesync_auth;
+	uint64_t frame_time[GB_TIMESYNC_MAX_STROBES];
 	struct gbsim_interface *intf;
 	struct gbsim_connection *connection;
 	uint16_t ap_intf_id, ap_cport_id, mod_intf_id, mod_cport_id;
 	uint16_t message_size = sizeof(*oph);
-	uint8_t intf_id = 0;
+	uint16_t attr, selector;
+	uint32_t attr_value;
+	uint8_t result = PROTOCOL_STATUS_SUCCESS;
+	bool delayed = false;
+	int ret, i;
 	size_t payload_size = 0;
 
 	switch (oph->type) {
@@ -96,16 +144,35 @@ static int svc_handler_request(uint16_t cport_id, uint16_t hd_cport_id,
 			break;
 		}
 
+		/* The AP gave up on whatever still used its CPort */
+		connection = connection_find(HD_CPORT(svc->bridge->id,
+						      ap_cport_id));
+		if (connection)
+			free_connection(connection);
+
 		connection = allocate_connection(intf, mod_cport_id,
-						 ap_cport_id);
+				HD_CPORT(svc->bridge->id, ap_cport_id));
 		if (!connection) {
 			gbsim_error("Failed to allocate connection: (%hu %hu):(%hu %hu)\n",
+				    ap_intf_id, ap_cport_id,
+				    mod_intf_id, mod_cport_id);
+			return -ENOMEM;
+		}
+
+		/* Traffic can only flow once the AP has set up a route */
+		if (route_connection_bind(connection, ap_intf_id)) {
+			gbsim_error("SVC no route for connection (%hu %hu):(%hu %hu)\n",
 				    ap_intf_id, ap_cport_id, mod_intf_id,
 				    mod_cport_id);
-			return -ENOMEM;
+			free_connection(connection);
+			result = PROTOCOL_STATUS_INVALID;
+			break;
 		}
 
 		connection_set_protocol(connection, mod_cport_id);
+		hotplug_bench_conn_create(intf, mod_cport_id);
+		if (connection->protocol == GREYBUS_PROTOCOL_LOOPBACK)
+			loopback_conn_create(connection);
 
 		break;
 	case GB_SVC_TYPE_CONN_DESTROY:
@@ -119,35 +186,65 @@ static int svc_handler_request(uint16_t cport_id, uint16_t hd_cport_id,
 		gbsim_debug("SVC connection destroy request (%hu %hu):(%hu %hu) response\n",
 			    ap_intf_id, ap_cport_id, mod_intf_id, mod_cport_id);
 
-		connection = connection_find(ap_cport_id);
-
-		free_connection(connection);
+		connection = connection_find(HD_CPORT(svc->bridge->id,
+						      ap_cport_id));
+		if (connection)
+			free_connection(connection);
 		break;
 	case GB_SVC_TYPE_DME_PEER_GET:
 		payload_size = sizeof(*dme_get_response);
 		dme_get_request = &op_req->svc_dme_peer_get_request;
 		dme_get_response = &op_rsp->svc_dme_peer_get_response;
+		attr = le16toh(dme_get_request->attr);
+		selector = le16toh(dme_get_request->selector);
+
+		gbsim_debug("SVC dme peer get (%hhu %hx %hu) request\n",
+			    dme_get_request->intf_id, attr, selector);
+
+		/* The AP still gets its answer for an unknown interface */
+		intf = interface_get_by_id(svc, dme_get_request->intf_id);
+		if (!intf) {
+			gbsim_error("SVC No interface: %hhu\n",
+				    dme_get_request->intf_id);
+			dme_get_response->result_code =
+				htole16(GB_SVC_OP_UNKNOWN_ERROR);
+			dme_get_response->attr_value = 0;
+			break;
+		}
+
+		attr_value = dme_get(&intf->dme, attr, selector);
 		dme_get_response->result_code = 0;
-		dme_get_response->attr_value = 0x0126;
+		dme_get_response->attr_value = htole32(attr_value);
 
-		gbsim_debug("SVC dme peer get (%hhu %hu %hu) request\n",
-			    dme_get_request->intf_id, dme_get_request->attr,
-			    dme_get_request->selector);
-		gbsim_debug("SVC dme peer get (%hu %u) response\n",
-			    dme_get_response->result_code,
-			    dme_get_response->attr_value);
+		gbsim_debug("SVC dme peer get (0 %u) response\n", attr_value);
 		break;
 	case GB_SVC_TYPE_DME_PEER_SET:
 		payload_size = sizeof(*dme_set_response);
 		dme_set_request = &op_req->svc_dme_peer_set_request;
 		dme_set_response = &op_rsp->svc_dme_peer_set_response;
-		dme_set_response->result_code = 0;
+		attr = le16toh(dme_set_request->attr);
+		selector = le16toh(dme_set_request->selector);
+		attr_value = le32toh(dme_set_request->value);
+
+		gbsim_debug("SVC dme peer set (%hhu %hx %hu %u) request\n",
+			    dme_set_request->intf_id, attr, selector,
+			    attr_value);
+
+		intf = interface_get_by_id(svc, dme_set_request->intf_id);
+		if (!intf) {
+			gbsim_error("SVC No interface: %hhu\n",
+				    dme_set_request->intf_id);
+			dme_set_response->result_code =
+				htole16(GB_SVC_OP_UNKNOWN_ERROR);
+			break;
+		}
+
+		dme_set_response->result_code =
+			htole16(dme_set(&intf->dme, attr, selector, attr_value) ?
+				GB_SVC_OP_UNKNOWN_ERROR : 0);
 
-		gbsim_debug("SVC dme peer set (%hhu %hu %hu %u) request\n",
-			    dme_set_request->intf_id, dme_set_request->attr,
-			    dme_set_request->selector, dme_set_request->value);
 		gbsim_debug("SVC dme peer set (%hu) response\n",
-			    dme_set_response->result_code);
+			    le16toh(dme_set_response->result_code));
 		break;
 	case GB_SVC_TYPE_ROUTE_CREATE:
 		svc_route_create = &op_req->svc_route_create_request;
@@ -155,6 +252,14 @@ static int svc_handler_request(uint16_t cport_id, uint16_t hd_cport_id,
 		gbsim_debug("SVC route create request (%hhu %u):(%hhu %u) response\n",
 			    svc_route_create->intf1_id, svc_route_create->dev1_id,
 			    svc_route_create->intf2_id, svc_route_create->dev2_id);
+
+		ret = route_create(svc, svc_route_create->intf1_id,
+				   svc_route_create->dev1_id,
+				   svc_route_create->intf2_id,
+				   svc_route_create->dev2_id);
+		if (ret)
+			result = ret == -ENOMEM ? PROTOCOL_STATUS_NOMEM :
+						  PROTOCOL_STATUS_INVALID;
 		break;
 	case GB_SVC_TYPE_ROUTE_DESTROY:
 		svc_route_destroy = &op_req->svc_route_destroy_request;
@@ -162,69 +267,166 @@ static int svc_handler_request(uint16_t cport_id, uint16_t hd_cport_id,
 		gbsim_debug("SVC route destroy request (%hhu:%hhu) response\n",
 			    svc_route_destroy->intf1_id,
 			    svc_route_destroy->intf2_id);
+
+		if (route_destroy(svc, svc_route_destroy->intf1_id,
+				  svc_route_destroy->intf2_id))
+			gbsim_error("SVC no route (%hhu:%hhu) to destroy\n",
+				    svc_route_destroy->intf1_id,
+				    svc_route_destroy->intf2_id);
 		break;
 	case GB_SVC_TYPE_PING:
 		gbsim_debug("SVC ping request response\n");
 		break;
+	case GB_SVC_TYPE_TIMESYNC_ENABLE:
+		svc_timesync_enable = &op_req->svc_timesync_enable_request;
+		timesync_svc_enable(svc, svc_timesync_enable->count,
+				    le64toh(svc_timesync_enable->frame_time),
+				    le32toh(svc_timesync_enable->strobe_delay),
+				    le32toh(svc_timesync_enable->refclk));
+		break;
+	case GB_SVC_TYPE_TIMESYNC_DISABLE:
+		timesync_svc_disable(svc);
+		break;
+	case GB_SVC_TYPE_TIMESYNC_AUTHORITATIVE:
+		payload_size = sizeof(*svc_timesync_auth);
+		svc_timesync_auth = &op_rsp->svc_timesync_authoritative_response;
+		timesync_svc_authoritative(svc, frame_time);
+		for (i = 0; i < GB_TIMESYNC_MAX_STROBES; i++)
+			svc_timesync_auth->frame_time[i] =
+				htole64(frame_time[i]);
+		break;
+	case GB_SVC_TYPE_TIMESYNC_WAKE_PINS_ACQUIRE:
+		timesync_svc_wake_pins(svc, le32toh(op_req->svc_timesync_wake_pins_acquire_request.strobe_mask));
+		break;
+	case GB_SVC_TYPE_TIMESYNC_WAKE_PINS_RELEASE:
+		timesync_svc_wake_pins(svc, 0);
+		break;
+	case GB_SVC_TYPE_TIMESYNC_PING:
+		payload_size = sizeof(op_rsp->svc_timesync_ping_response);
+		op_rsp->svc_timesync_ping_response.frame_time =
+			htole64(timesync_svc_ping(svc));
+		break;
 	case GB_SVC_TYPE_PWRMON_RAIL_COUNT_GET:
 		payload_size = sizeof(*svc_pwrmon_rail_count_get_response);
 		svc_pwrmon_rail_count_get_response = &op_rsp->svc_pwrmon_rail_count_get_response;
-		svc_pwrmon_rail_count_get_response->rail_count = 0;
+		svc_pwrmon_rail_count_get_response->rail_count = pwrmon_rail_count();
 		break;
-	case GB_SVC_TYPE_INTF_VSYS_ENABLE:
-		payload_size = sizeof(*svc_intf_vsys_response);
-		svc_intf_vsys_response = &op_rsp->svc_intf_vsys_response;
-		svc_intf_vsys_response->result_code = 0;
+	case GB_SVC_TYPE_PWRMON_RAIL_NAMES_GET:
+		payload_size = sizeof(*svc_pwrmon_rail_names_get_response) +
+			       pwrmon_rail_count() *
+			       GB_SVC_PWRMON_RAIL_NAME_BUFSIZE;
+		svc_pwrmon_rail_names_get_response = &op_rsp->svc_pwrmon_rail_names_get_response;
+		pwrmon_rail_names(svc_pwrmon_rail_names_get_response);
+		break;
+	case GB_SVC_TYPE_PWRMON_SAMPLE_GET:
+		payload_size = sizeof(*svc_pwrmon_sample_get_response);
+		svc_pwrmon_sample_get_request = &op_req->svc_pwrmon_sample_get_request;
+		svc_pwrmon_sample_get_response = &op_rsp->svc_pwrmon_sample_get_response;
+		attr_value = 0;
+
+		svc_pwrmon_sample_get_response->result =
+			pwrmon_sample_get(svc,
+					  svc_pwrmon_sample_get_request->rail_id,
+					  svc_pwrmon_sample_get_request->measurement_type,
+					  &attr_value);
+		svc_pwrmon_sample_get_response->measurement = htole32(attr_value);
+		break;
+	case GB_SVC_TYPE_PWRMON_INTF_SAMPLE_GET:
+		payload_size = sizeof(*svc_pwrmon_intf_sample_get_response);
+		svc_pwrmon_intf_sample_get_request = &op_req->svc_pwrmon_intf_sample_get_request;
+		svc_pwrmon_intf_sample_get_response = &op_rsp->svc_pwrmon_intf_sample_get_response;
+		attr_value = 0;
+
+		svc_pwrmon_intf_sample_get_response->result =
+			pwrmon_intf_sample_get(svc,
+					       svc_pwrmon_intf_sample_get_request->intf_id,
+					       svc_pwrmon_intf_sample_get_request->measurement_type,
+					       &attr_value);
+		svc_pwrmon_intf_sample_get_response->measurement = htole32(attr_value);
 		break;
+	case GB_SVC_TYPE_INTF_VSYS_ENABLE:
 	case GB_SVC_TYPE_INTF_VSYS_DISABLE:
 		payload_size = sizeof(*svc_intf_vsys_response);
 		svc_intf_vsys_response = &op_rsp->svc_intf_vsys_response;
-		svc_intf_vsys_response->result_code = 0;
-
-		intf_id = op_req->svc_intf_vsys_request.intf_id;
+		delayed = true;
 
-		intf = interface_get_by_id(svc, intf_id);
-		if (!intf)
-			return -ENODEV;
-		interface_free(svc, intf);
+		intf = interface_get_by_id(svc,
+				op_req->svc_intf_vsys_request.intf_id);
+		if (!intf) {
+			svc_intf_vsys_response->result_code =
+				GB_SVC_INTF_VSYS_FAIL;
+			break;
+		}
+		svc_intf_vsys_response->result_code =
+			intf_activate(intf, oph->type);
 
+		/* Powering the interface off releases it */
+		if (oph->type == GB_SVC_TYPE_INTF_VSYS_DISABLE)
+			interface_free(svc, intf);
 		break;
 	case GB_SVC_TYPE_INTF_REFCLK_ENABLE:
-		payload_size = sizeof(*svc_intf_refclk_response);
-		svc_intf_refclk_response = &op_rsp->svc_intf_refclk_response;
-		svc_intf_refclk_response->result_code = 0;
-		break;
 	case GB_SVC_TYPE_INTF_REFCLK_DISABLE:
 		payload_size = sizeof(*svc_intf_refclk_response);
 		svc_intf_refclk_response = &op_rsp->svc_intf_refclk_response;
-		svc_intf_refclk_response->result_code = 0;
+		delayed = true;
+
+		intf = interface_get_by_id(svc,
+				op_req->svc_intf_refclk_request.intf_id);
+		svc_intf_refclk_response->result_code = intf ?
+			intf_activate(intf, oph->type) :
+			GB_SVC_INTF_REFCLK_FAIL;
 		break;
 	case GB_SVC_TYPE_INTF_UNIPRO_ENABLE:
-		payload_size = sizeof(*svc_intf_unipro_response);
-		svc_intf_unipro_response = &op_rsp->svc_intf_unipro_response;
-		svc_intf_unipro_response->result_code = 0;
-		break;
 	case GB_SVC_TYPE_INTF_UNIPRO_DISABLE:
 		payload_size = sizeof(*svc_intf_unipro_response);
 		svc_intf_unipro_response = &op_rsp->svc_intf_unipro_response;
-		svc_intf_unipro_response->result_code = 0;
+		delayed = true;
+
+		intf = interface_get_by_id(svc,
+				op_req->svc_intf_unipro_request.intf_id);
+		svc_intf_unipro_response->result_code = intf ?
+			intf_activate(intf, oph->type) :
+			GB_SVC_INTF_UNIPRO_FAIL;
 		break;
 	case GB_SVC_TYPE_INTF_ACTIVATE:
 		payload_size = sizeof(*svc_intf_activate_response);
 		svc_intf_activate_response = &op_rsp->svc_intf_activate_response;
+		delayed = true;
+
+		intf = interface_get_by_id(svc,
+				op_req->svc_intf_activate_request.intf_id);
+		svc_intf_activate_response->status = intf ?
+			intf_activate(intf, oph->type) :
+			GB_SVC_INTF_NOT_DETECTED;
+		if (svc_intf_activate_response->status != GB_SVC_OP_SUCCESS) {
+			svc_intf_activate_response->intf_type =
+				GB_SVC_INTF_TYPE_UNKNOWN;
+			break;
+		}
+
+		/* The bridge boots again and reports a fresh init status */
+		dme_boot(&intf->dme);
+
 		svc_intf_activate_response->intf_type = GB_SVC_INTF_TYPE_GREYBUS;
 		break;
 	case GB_SVC_TYPE_INTF_RESUME:
 		payload_size = sizeof(*svc_intf_resume_response);
 		svc_intf_resume_response = &op_rsp->svc_intf_resume_response;
-		svc_intf_resume_response->status = GB_SVC_OP_SUCCESS;
+		delayed = true;
+
+		intf = interface_get_by_id(svc,
+				op_req->svc_intf_resume_request.intf_id);
+		svc_intf_resume_response->status = intf ?
+			intf_activate(intf, oph->type) :
+			GB_SVC_INTF_NOT_DETECTED;
 		break;
 	case GB_SVC_TYPE_INTF_MAILBOX_EVENT:
 		break;
 	case GB_SVC_TYPE_INTF_SET_PWRM:
 		payload_size = sizeof(*svc_intf_set_pwrm_response);
 		svc_intf_set_pwrm_response = &op_rsp->svc_intf_set_pwrm_response;
-		svc_intf_set_pwrm_response->result_code = 0;
+		svc_intf_set_pwrm_response->result_code =
+			svc_intf_set_pwrm(svc, &op_req->svc_intf_set_pwrm_request);
 		break;
 	case GB_SVC_TYPE_MODULE_INSERTED:
 	case GB_SVC_TYPE_MODULE_REMOVED:
@@ -235,21 +437,31 @@ static int svc_handler_request(uint16_t cport_id, uint16_t hd_cport_id,
 		return -EINVAL;
 	}
 
+	/* Errors come without payload */
+	if (result != PROTOCOL_STATUS_SUCCESS)
+		payload_size = 0;
+
 	message_size += payload_size;
+
+	/* Interface activation steps answer once they are done */
+	if (delayed)
+		return intf_activate_respond(hd_cport_id, op_rsp, message_size,
+					     oph->operation_id, oph->type);
+
 	return send_response(hd_cport_id, op_rsp, message_size,
-				oph->operation_id, oph->type,
-				PROTOCOL_STATUS_SUCCESS);
+				oph->operation_id, oph->type, result);
 }
 
-static int svc_handler_response(uint16_t cport_id, uint16_t hd_cport_id,
-				void *rbuf, size_t rsize)
+static int svc_handler_response(struct gbsim_svc *svc, uint16_t cport_id,
+				uint16_t hd_cport_id, void *rbuf, size_t rsize)
 {
 	struct op_msg *op_rsp = rbuf;
 	struct gb_operation_msg_hdr *oph = &op_rsp->header;
 	int ret;
 
 	/* Must be AP's svc protocol's cport */
-	if (cport_id != GB_SVC_CPORT_ID || cport_id != hd_cport_id) {
+	if (cport_id != GB_SVC_CPORT_ID ||
+	    cport_id != HD_CPORT_AP(hd_cport_id)) {
 		gbsim_error("%s: Error: cport-id-mismatch (%d %d %d)", __func__,
 			    cport_id, hd_cport_id, GB_SVC_CPORT_ID);
 		return -EINVAL;
@@ -262,7 +474,7 @@ static int svc_handler_response(uint16_t cport_id, uint16_t hd_cport_id,
 			    op_rsp->svc_version_response.minor);
 
 		/* Version request successful, send hello msg */
-		ret = svc_request_send(GB_SVC_TYPE_SVC_HELLO, AP_INTF_ID);
+		ret = svc_request_send(svc, GB_SVC_TYPE_SVC_HELLO, AP_INTF_ID);
 		if (ret) {
 			gbsim_error("%s: Failed to send svc hello request (%d)\n",
 				    __func__, ret);
@@ -272,11 +484,23 @@ static int svc_handler_response(uint16_t cport_id, uint16_t hd_cport_id,
 	case GB_SVC_TYPE_SVC_HELLO:
 		/*
 		 * AP's SVC cport is ready now, start scanning for module
-		 * hotplug.
+		 * hotplug and instantiate the configured fleet.
 		 */
-		ret = inotify_start(svc, hotplug_basedir);
+		snapshot_start(svc);
+
+		if (hotplug_basedir) {
+			ret = inotify_start(svc, hotplug_basedir);
+			if (ret < 0)
+				gbsim_error("Failed to start inotify thread\n");
+		}
+
+		ret = fleet_start(svc);
 		if (ret < 0)
-			gbsim_error("Failed to start inotify thread\n");
+			gbsim_error("Failed to start fleet thread\n");
+
+		ret = hotplug_bench_start(svc);
+		if (ret < 0)
+			gbsim_error("Failed to start hotplug benchmark\n");
 		break;
 	case GB_SVC_TYPE_MODULE_REMOVED:
 		break;
@@ -299,12 +523,14 @@ int svc_handler(struct gbsim_connection *connection, void *rbuf,
 	struct gb_operation_msg_hdr *oph = &op->header;
 	uint16_t cport_id = connection->cport_id;
 	uint16_t hd_cport_id = connection->hd_cport_id;
+	struct gbsim_svc *svc = connection->intf->svc;
 
 	if (oph->type & OP_RESPONSE)
-		return svc_handler_response(cport_id, hd_cport_id, rbuf, rsize);
+		return svc_handler_response(svc, cport_id, hd_cport_id, rbuf,
+					    rsize);
 	else
-		return svc_handler_request(cport_id, hd_cport_id, rbuf, rsize,
-					   tbuf, tsize);
+		return svc_handler_request(svc, cport_id, hd_cport_id, rbuf,
+					   rsize, tbuf, tsize);
 }
 
 char *svc_get_operation(uint8_t type)
@@ -385,7 +611,7 @@ char *svc_get_operation(uint8_t type)
 	}
 }
 
-int svc_request_send(uint8_t type, uint8_t intf_id)
+int svc_request_send(struct gbsim_svc *svc, uint8_t type, uint8_t intf_id)
 {
 	struct op_msg msg = { };
 	struct gb_operation_msg_hdr *oph = &msg.header;
@@ -437,18 +663,23 @@ int svc_request_send(uint8_t type, uint8_t intf_id)
 	}
 
 	message_size += payload_size;
-	return send_request(GB_SVC_CPORT_ID, &msg, message_size, 1, type);
+	return send_request(HD_CPORT(svc->bridge->id, GB_SVC_CPORT_ID), &msg,
+			    message_size, 1, type);
 }
 
-int svc_init(void)
+/* Each bridge has its own SVC, with the AP as interface 0 */
+int svc_init(struct gbsim_bridge *bridge)
 {
 	struct gbsim_connection *connection;
+	struct gbsim_svc *svc;
 
 	svc = calloc(1, sizeof(*svc));
 	if (!svc)
 		return -ENOMEM;
 
 	TAILQ_INIT(&svc->intfs);
+	svc->bridge = bridge;
+	bridge->svc = svc;
 
 	/* init svc->ap interface */
 	svc->intf = interface_alloc(svc, 0);
@@ -456,7 +687,7 @@ int svc_init(void)
 		return -ENOMEM;
 
 	connection = allocate_connection(svc->intf, GB_SVC_CPORT_ID,
-					 GB_SVC_CPORT_ID);
+					 HD_CPORT(bridge->id, GB_SVC_CPORT_ID));
 	if (!connection)
 		return -ENOMEM;
 
@@ -465,9 +696,12 @@ int svc_init(void)
 	return 0;
 }
 
-void svc_exit(void)
+void svc_exit(struct gbsim_bridge *bridge)
 {
+	struct gbsim_svc *svc = bridge->svc;
+
 	if (svc && svc->intf)
 		interface_free(svc, svc->intf);
 	free(svc);
+	bridge->svc = NULL;
 }
@@ -0,0 +1,191 @@
+/*
+ * Greybus Simulator: timers
+ *
+ * One thread sleeping on a timerfd armed for the earliest pending timer.
+ * Models that need something to happen later (TimeSync strobes, delayed
+ * SVC responses, ...) queue a struct gbsim_timer here instead of running
+ * a thread of their own.  Callbacks run in the timer thread.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gbsim.h"
+
+static TAILQ_HEAD(timer_head, gbsim_timer) timers =
+	TAILQ_HEAD_INITIALIZER(timers);
+static pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+/* The timer whose callback runs, signalled once it returned */
+static struct gbsim_timer *timer_running;
+static pthread_cond_t timer_done = PTHREAD_COND_INITIALIZER;
+static int timer_fd = -1;
+static pthread_t timer_pthread;
+static int thread_started;
+
+static bool timer_before(struct timespec *a, struct timespec *b)
+{
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec;
+	return a->tv_nsec < b->tv_nsec;
+}
+
+/* Must be called with timer_lock held */
+static void timer_rearm(void)
+{
+	struct itimerspec its = { };
+	struct gbsim_timer *timer = TAILQ_FIRST(&timers);
+
+	/* An all zero value disarms the timerfd */
+	if (timer) {
+		its.it_value = timer->expires;
+		if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+			its.it_value.tv_nsec = 1;
+	}
+
+	timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* Queue @timer to run @delay_ns from now, re-queueing it if pending */
+void timer_add(struct gbsim_timer *timer, uint64_t delay_ns)
+{
+	struct gbsim_timer *pos;
+
+	clock_gettime(CLOCK_MONOTONIC, &timer->expires);
+	timer->expires.tv_sec += delay_ns / 1000000000;
+	timer->expires.tv_nsec += delay_ns % 1000000000;
+	if (timer->expires.tv_nsec >= 1000000000) {
+		timer->expires.tv_sec++;
+		timer->expires.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&timer_lock);
+
+	if (timer->pending)
+		TAILQ_REMOVE(&timers, timer, node);
+
+	TAILQ_FOREACH(pos, &timers, node)
+		if (timer_before(&timer->expires, &pos->expires))
+			break;
+	if (pos)
+		TAILQ_INSERT_BEFORE(pos, timer, node);
+	else
+		TAILQ_INSERT_TAIL(&timers, timer, node);
+	timer->pending = true;
+
+	if (TAILQ_FIRST(&timers) == timer)
+		timer_rearm();
+
+	pthread_mutex_unlock(&timer_lock);
+}
+
+/*
+ * Cancel @timer, waiting for its callback if it is running, so the timer
+ * can be freed once this returns.  A callback queueing itself again is
+ * cancelled too.  Must not be called with a lock the callback takes
+ */
+void timer_del(struct gbsim_timer *timer)
+{
+	bool self = thread_started &&
+		    pthread_equal(pthread_self(), timer_pthread);
+
+	pthread_mutex_lock(&timer_lock);
+	for (;;) {
+		if (timer->pending) {
+			TAILQ_REMOVE(&timers, timer, node);
+			timer->pending = false;
+			timer_rearm();
+		}
+		if (self || timer_running != timer)
+			break;
+		pthread_cond_wait(&timer_done, &timer_lock);
+	}
+	pthread_mutex_unlock(&timer_lock);
+}
+
+static void *timer_thread(void *param)
+{
+	struct gbsim_timer *timer;
+	struct timespec now;
+	uint64_t expirations;
+	ssize_t ret;
+
+	while (1) {
+		ret = read(timer_fd, &expirations, sizeof(expirations));
+		if (ret < 0 && errno != EINTR && errno != EAGAIN) {
+			gbsim_error("timerfd read failed: %s\n",
+				    strerror(errno));
+			return NULL;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		pthread_mutex_lock(&timer_lock);
+		while ((timer = TAILQ_FIRST(&timers)) &&
+		       !timer_before(&now, &timer->expires)) {
+			TAILQ_REMOVE(&timers, timer, node);
+			timer->pending = false;
+			timer_running = timer;
+
+			/*
+			 * The callback may queue timers again.  It isn't
+			 * cancelled halfway, timer_del() waits for it
+			 */
+			pthread_mutex_unlock(&timer_lock);
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+			timer->fn(timer->data);
+			pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+			pthread_mutex_lock(&timer_lock);
+
+			timer_running = NULL;
+			pthread_cond_broadcast(&timer_done);
+		}
+		timer_rearm();
+		pthread_mutex_unlock(&timer_lock);
+	}
+
+	return NULL;
+}
+
+int timer_init(void)
+{
+	int ret;
+
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (timer_fd < 0) {
+		gbsim_error("can't create timerfd: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	ret = pthread_create(&timer_pthread, NULL, timer_thread, NULL);
+	if (ret) {
+		gbsim_error("can't create timer thread: %s\n", strerror(ret));
+		close(timer_fd);
+		timer_fd = -1;
+		return -ret;
+	}
+	thread_started = 1;
+
+	return 0;
+}
+
+void timer_cleanup(void)
+{
+	if (thread_started) {
+		pthread_cancel(timer_pthread);
+		pthread_join(timer_pthread, NULL);
+		thread_started = 0;
+	}
+
+	if (timer_fd >= 0) {
+		close(timer_fd);
+		timer_fd = -1;
+	}
+}
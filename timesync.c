@@ -0,0 +1,354 @@
+/*
+ * Greybus Simulator: TimeSync
+ *
+ * The SVC frame time counts refclk ticks on CLOCK_MONOTONIC_RAW.  Every
+ * interface (and the AP bridge, interface 0) runs its own frame time
+ * counter with a fixed skew, latches it with a small jitter when the SVC
+ * strobes the wake pins, and corrects offset and rate once the AP hands
+ * it the authoritative SVC frame times of those strobes.  Each ping then
+ * measures how far every interface is from the SVC.  Each bridge has its
+ * own SVC and so its own TimeSync domain.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gbsim.h"
+
+/* Interface oscillators are within +/- 50 ppm */
+#define TIMESYNC_SKEW_PPB_MAX	50000
+/* Wake detect latency when latching a strobe */
+#define TIMESYNC_JITTER_NS	1000
+
+struct svc_timesync {
+	bool enabled;
+	uint8_t count;
+	uint8_t strobes;
+	uint32_t strobe_delay_us;
+	uint32_t refclk;
+	uint64_t frame_time;
+	uint64_t t0_ns;
+	uint64_t strobe_ft[GB_TIMESYNC_MAX_STROBES];
+	uint32_t wake_pins;
+	struct gbsim_timer strobe_timer;
+
+	/* Interfaces taking part, by interface id */
+	struct gbsim_interface *intfs[256];
+};
+
+static struct svc_timesync svc_timesyncs[GBSIM_MAX_BRIDGES];
+static pthread_mutex_t ts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t timesync_raw_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct svc_timesync *svc_timesync(struct gbsim_svc *svc)
+{
+	return &svc_timesyncs[svc->bridge->id];
+}
+
+static uint64_t svc_frame_time(struct svc_timesync *svc_ts, uint64_t t_ns)
+{
+	return svc_ts->frame_time +
+	       (t_ns - svc_ts->t0_ns) * (double)svc_ts->refclk / 1e9;
+}
+
+/* Uncorrected frame time counter of an interface */
+static double intf_local_ticks(struct gbsim_timesync *ts, uint64_t t_ns)
+{
+	double elapsed = (double)(t_ns - ts->t0_ns) *
+			 (1.0 + ts->skew_ppb * 1e-9);
+
+	return ts->frame_time + elapsed * ts->refclk / 1e9;
+}
+
+static uint64_t intf_frame_time(struct gbsim_timesync *ts, uint64_t t_ns)
+{
+	double local = intf_local_ticks(ts, t_ns);
+
+	if (ts->synced)
+		return ts->rate * local + ts->offset;
+
+	return local;
+}
+
+/* Latch the frame time of an interface on a strobe at @t_ns */
+static uint64_t intf_latch(struct gbsim_timesync *ts, uint64_t t_ns)
+{
+	t_ns += rand_r(&ts->seed) % TIMESYNC_JITTER_NS;
+
+	/* The counter starts at the enable frame time on the first strobe */
+	if (!ts->strobes && !ts->synced)
+		ts->t0_ns = t_ns;
+
+	return t_ns;
+}
+
+/*
+ * Only the interfaces whose wake pin the AP acquired see a strobe.  The AP
+ * bridge has its own strobe line and always does.
+ */
+static bool intf_strobed(struct svc_timesync *svc_ts, int intf_id)
+{
+	return !intf_id ||
+	       (intf_id < 32 && (svc_ts->wake_pins & (1U << intf_id)));
+}
+
+static void timesync_strobe(void *data)
+{
+	struct svc_timesync *svc_ts = data;
+	struct gbsim_timesync *ts;
+	uint64_t now = timesync_raw_ns();
+	uint64_t t_ns;
+	int i;
+
+	pthread_mutex_lock(&ts_lock);
+
+	if (!svc_ts->enabled || svc_ts->strobes >= svc_ts->count)
+		goto out;
+
+	if (!svc_ts->strobes)
+		svc_ts->t0_ns = now;
+	svc_ts->strobe_ft[svc_ts->strobes] = svc_frame_time(svc_ts, now);
+
+	for (i = 0; i < 256; i++) {
+		if (!svc_ts->intfs[i] || !intf_strobed(svc_ts, i))
+			continue;
+		ts = &svc_ts->intfs[i]->timesync;
+		if (ts->strobes >= ts->count)
+			continue;
+		t_ns = intf_latch(ts, now);
+		ts->latched[ts->strobes++] = intf_local_ticks(ts, t_ns);
+	}
+
+	gbsim_debug("timesync strobe %u/%u at frame time %llu\n",
+		    svc_ts->strobes + 1, svc_ts->count,
+		    (unsigned long long)svc_ts->strobe_ft[svc_ts->strobes]);
+
+	if (++svc_ts->strobes < svc_ts->count)
+		timer_add(&svc_ts->strobe_timer,
+			  svc_ts->strobe_delay_us * 1000ULL);
+out:
+	pthread_mutex_unlock(&ts_lock);
+}
+
+void timesync_intf_init(struct gbsim_interface *intf)
+{
+	struct gbsim_timesync *ts = &intf->timesync;
+
+	memset(ts, 0, sizeof(*ts));
+	ts->seed = intf->interface_id * 2654435761u + 1;
+	ts->skew_ppb = (int32_t)(rand_r(&ts->seed) %
+				 (2 * TIMESYNC_SKEW_PPB_MAX + 1)) -
+		       TIMESYNC_SKEW_PPB_MAX;
+}
+
+void timesync_intf_enable(struct gbsim_interface *intf, uint8_t count,
+			  uint64_t frame_time, uint32_t strobe_delay,
+			  uint32_t refclk)
+{
+	struct gbsim_timesync *ts = &intf->timesync;
+
+	gbsim_debug("timesync enable intf %u: %u strobes, frame time %llu, delay %uus, refclk %u\n",
+		    intf->interface_id, count, (unsigned long long)frame_time,
+		    strobe_delay, refclk);
+
+	if (count > GB_TIMESYNC_MAX_STROBES)
+		count = GB_TIMESYNC_MAX_STROBES;
+
+	pthread_mutex_lock(&ts_lock);
+	ts->enabled = true;
+	ts->synced = false;
+	ts->count = count;
+	ts->strobes = 0;
+	ts->frame_time = frame_time;
+	ts->refclk = refclk ? refclk : 1;
+	svc_timesync(intf->svc)->intfs[intf->interface_id] = intf;
+	pthread_mutex_unlock(&ts_lock);
+}
+
+void timesync_intf_disable(struct gbsim_interface *intf)
+{
+	struct gbsim_timesync *ts = &intf->timesync;
+	struct svc_timesync *svc_ts = svc_timesync(intf->svc);
+
+	pthread_mutex_lock(&ts_lock);
+	if (ts->enabled && ts->pings)
+		gbsim_info("timesync intf %u: skew %dppb, %llu pings, error last %lldns max %lluns avg %lluns\n",
+			   intf->interface_id, ts->skew_ppb,
+			   (unsigned long long)ts->pings,
+			   (long long)ts->last_err_ns,
+			   (unsigned long long)ts->max_err_ns,
+			   (unsigned long long)(ts->sum_err_ns / ts->pings));
+	ts->enabled = false;
+	ts->synced = false;
+	if (svc_ts->intfs[intf->interface_id] == intf)
+		svc_ts->intfs[intf->interface_id] = NULL;
+	pthread_mutex_unlock(&ts_lock);
+}
+
+/*
+ * The AP tells the interface what the SVC frame time was at each strobe:
+ * fit offset and rate on the first and last strobe latched.
+ */
+void timesync_intf_authoritative(struct gbsim_interface *intf,
+				 const uint64_t *frame_time)
+{
+	struct gbsim_timesync *ts = &intf->timesync;
+	double dl;
+	int last;
+
+	pthread_mutex_lock(&ts_lock);
+
+	if (!ts->enabled || !ts->strobes) {
+		gbsim_error("timesync authoritative on intf %u without strobes\n",
+			    intf->interface_id);
+		goto out;
+	}
+
+	last = ts->strobes - 1;
+	dl = ts->latched[last] - ts->latched[0];
+	ts->rate = last && dl > 0 ?
+		   (double)(frame_time[last] - frame_time[0]) / dl : 1.0;
+	ts->offset = frame_time[last] - ts->rate * ts->latched[last];
+	ts->synced = true;
+
+	gbsim_debug("timesync intf %u synced, rate %.9f\n",
+		    intf->interface_id, ts->rate);
+out:
+	pthread_mutex_unlock(&ts_lock);
+}
+
+uint64_t timesync_intf_last_event(struct gbsim_interface *intf)
+{
+	uint64_t last_event;
+
+	pthread_mutex_lock(&ts_lock);
+	last_event = intf->timesync.last_event;
+	pthread_mutex_unlock(&ts_lock);
+
+	return last_event;
+}
+
+void timesync_svc_wake_pins(struct gbsim_svc *svc, uint32_t strobe_mask)
+{
+	struct svc_timesync *svc_ts = svc_timesync(svc);
+
+	pthread_mutex_lock(&ts_lock);
+	svc_ts->wake_pins = strobe_mask;
+	pthread_mutex_unlock(&ts_lock);
+}
+
+void timesync_svc_enable(struct gbsim_svc *svc, uint8_t count,
+			 uint64_t frame_time, uint32_t strobe_delay,
+			 uint32_t refclk)
+{
+	struct svc_timesync *svc_ts = svc_timesync(svc);
+
+	gbsim_debug("timesync svc enable: %u strobes, frame time %llu, delay %uus, refclk %u\n",
+		    count, (unsigned long long)frame_time, strobe_delay,
+		    refclk);
+
+	if (count > GB_TIMESYNC_MAX_STROBES)
+		count = GB_TIMESYNC_MAX_STROBES;
+
+	pthread_mutex_lock(&ts_lock);
+	svc_ts->enabled = true;
+	svc_ts->count = count;
+	svc_ts->strobes = 0;
+	svc_ts->strobe_delay_us = strobe_delay;
+	svc_ts->refclk = refclk ? refclk : 1;
+	svc_ts->frame_time = frame_time;
+	memset(svc_ts->strobe_ft, 0, sizeof(svc_ts->strobe_ft));
+	svc_ts->strobe_timer.fn = timesync_strobe;
+	svc_ts->strobe_timer.data = svc_ts;
+	pthread_mutex_unlock(&ts_lock);
+
+	/* First strobe one strobe delay from now, the rest follow */
+	timer_add(&svc_ts->strobe_timer, strobe_delay * 1000ULL);
+}
+
+void timesync_svc_disable(struct gbsim_svc *svc)
+{
+	struct svc_timesync *svc_ts = svc_timesync(svc);
+
+	timer_del(&svc_ts->strobe_timer);
+
+	pthread_mutex_lock(&ts_lock);
+	svc_ts->enabled = false;
+	pthread_mutex_unlock(&ts_lock);
+}
+
+void timesync_svc_authoritative(struct gbsim_svc *svc, uint64_t *frame_time)
+{
+	struct svc_timesync *svc_ts = svc_timesync(svc);
+
+	pthread_mutex_lock(&ts_lock);
+	if (svc_ts->strobes < svc_ts->count)
+		gbsim_error("timesync authoritative after %u/%u strobes\n",
+			    svc_ts->strobes, svc_ts->count);
+	memcpy(frame_time, svc_ts->strobe_ft, sizeof(svc_ts->strobe_ft));
+	pthread_mutex_unlock(&ts_lock);
+}
+
+/*
+ * Strobe the wake pins once more: every interface latches its frame time
+ * as its last event, and we compare it to the SVC's.
+ */
+uint64_t timesync_svc_ping(struct gbsim_svc *svc)
+{
+	struct svc_timesync *svc_ts = svc_timesync(svc);
+	struct gbsim_timesync *ts;
+	uint64_t now = timesync_raw_ns();
+	uint64_t svc_ft = 0, max_err = 0, err;
+	bool svc_valid;
+	int64_t err_ns;
+	int i, n = 0;
+
+	pthread_mutex_lock(&ts_lock);
+
+	svc_valid = svc_ts->enabled && svc_ts->strobes;
+	if (svc_valid)
+		svc_ft = svc_frame_time(svc_ts, now);
+
+	for (i = 0; i < 256; i++) {
+		if (!svc_ts->intfs[i] || !intf_strobed(svc_ts, i))
+			continue;
+		ts = &svc_ts->intfs[i]->timesync;
+		ts->last_event = intf_frame_time(ts, intf_latch(ts, now));
+		if (!ts->synced || !svc_valid)
+			continue;
+
+		err_ns = ((int64_t)(ts->last_event - svc_ft)) * 1e9 /
+			 ts->refclk;
+		err = llabs(err_ns);
+		ts->last_err_ns = err_ns;
+		ts->sum_err_ns += err;
+		if (err > ts->max_err_ns)
+			ts->max_err_ns = err;
+		ts->pings++;
+
+		if (err > max_err)
+			max_err = err;
+		n++;
+	}
+
+	pthread_mutex_unlock(&ts_lock);
+
+	if (n)
+		gbsim_debug("timesync ping at frame time %llu: %d interfaces, max error %lluns\n",
+			    (unsigned long long)svc_ft, n,
+			    (unsigned long long)max_err);
+
+	return svc_ft;
+}
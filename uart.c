@@ -13,13 +13,19 @@
 #include <libsoc_gpio.h>
 #include <linux/fs.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "gbsim.h"
@@ -28,7 +34,6 @@
 #define GB_UART_MESSAGE_SIZE_MAX		GB_OPERATION_DATA_SIZE_MAX
 #define GB_UART_DATA_SIZE_MAX \
 	(GB_UART_MESSAGE_SIZE_MAX - sizeof(struct gb_uart_send_data_request))
-#define BREAK_DURATION_MS 300			/* break duration tcsendbreak() */
 
 /* greybus-spec/build/html/bridged_phy.html#uart-protocol */
 #define GB_UART_MAX				255
@@ -38,36 +43,160 @@
 #define UART_IDX_TX				1
 #define UART_IDX_RX				0
 #define UART_IDX_COUNT				2
+/* Longest PARMRK escape sequence, less its last byte */
+#define UART_ESC_MAX				2
+
+/* epoll data of the signal pipe and the pty inotify, ports use their index */
+#define UART_EPOLL_SIG				GB_UART_MAX
+#define UART_EPOLL_PTY				(GB_UART_MAX + 1)
+/* Or'ed into the index for the port's kick eventfd */
+#define UART_EPOLL_KICK				0x10000
+#define UART_EPOLL_EVENTS			32
+/* Modem line changes settle this long before going to the AP */
+#define UART_MODEM_DEBOUNCE_MS			10
+/* How often the modem lines are read when the driver has no TIOCMIWAIT */
+#define UART_MODEM_POLL_MS			100
+/* How often the unanswered RECEIVE_DATA requests are checked */
+#define UART_RX_EXPIRE_POLL_MS			100
+
+/* RECEIVE_DATA requests the AP may owe a response for, per port */
+#define UART_RX_CREDITS				8
+#define UART_RX_CREDITS_MAX			32
+/* A request the AP hasn't answered by then gives its credit back */
+#define UART_RX_TIMEOUT_MS			2000
+
+/* AP -> Module data waiting for the relay thread, per port, power of 2 */
+#define UART_TX_RING_SIZE			4096
+/* How often the relay thread checks the tty drained, for a break */
+#define UART_BREAK_POLL_NS			1000000
+
+/* Line emulation takes the line in slices of this much time, at most */
+#define UART_LINE_SLICE_NS			4000000
 
 /*
  * This code works in the following way.
  * Each tty has a handle to the /dev/ttyOx port represented by a handle 'fd'.
- * Each tty has a pipe for signalling that the AP ACKed Module -> AP UART data.
- * A single thread is responsible for running select on all open tty ports
+ * Without the hardware, the pty backend gives each UART CPort the master
+ * side of a pseudo-terminal instead, and links the slave side into a
+ * directory for local tools to open.
+ * A single thread is responsible for waiting on all connected tty ports
  * and relaying data from each tty to the AP as data arrives on the tty handle.
- * This thread will wait for up to 2 seconds for the AP to send back the
- * corresponding ACK. If the ACK never comes, the data is not resent.
- * When the AP wants to send data to the UART then this is written directly
- * to the fd for the relevant tty.
+ * A port is added to the thread's epoll set once the AP connects to it, so
+ * a wakeup only costs the ports that have data.
+ * Module -> AP data is flow controlled with credits: each RECEIVE_DATA
+ * request carries an operation id and takes a credit until the AP answers
+ * it.  Once a port is out of credits its tty leaves the epoll set, so the
+ * data backs up in the tty and, with flow control on, on the serial line.
+ * A request not answered within UART_RX_TIMEOUT_MS gives its credit back,
+ * the data is not resent.
+ * When the AP wants to send data to the UART it goes on the port's TX ring,
+ * and the port's kick eventfd wakes the relay thread up to write it to the
+ * tty.  The relay thread is the only one reading and writing the ttys, the
+ * rings and the credits are lock-free, so the dispatcher never waits on a
+ * tty syscall, or on the relay: a full ring has the AP retry.  Breaks go
+ * through the relay thread too, after the data queued before them.  Only
+ * the rare line setting requests are made on the tty from the dispatcher
+ * directly.  A port the AP let go of is cleared by the relay thread too,
+ * before the dispatcher may hand it to another connection.
+ * With line emulation a pty takes as long as the serial line would: the
+ * relay thread reads and writes only the characters the line has had time
+ * for, and waits for the line in between.
+ * The modem lines of a hardware port are followed by a thread of its own,
+ * blocked in TIOCMIWAIT until one changes.  A pty has none, a tool having
+ * its slave side open shows as DSR and DCD instead, like over a null-modem
+ * cable: inotify tells the relay thread when a tool opens it, the master
+ * hanging up when the last one closes it.  The relay
+ * thread reports the lines UART_MODEM_DEBOUNCE_MS after the first change,
+ * so bounces settle and a burst of changes goes out as one SERIAL_STATE,
+ * and only if they differ from what the AP was told last.
  * The RX thread has a pipe file-descriptor used to signal thread termination.
- * This pipe along with the file descriptors for the open tty ports is run
- * though a timeless select() in uart_thread().
+ * This pipe is in the epoll set along with the tty ports.
  */
 struct gb_uart_port {
+	TAILQ_ENTRY(gb_uart_port) rx_node;
 	uint16_t	cport_id;
 	uint16_t	hd_cport_id;
 	int		fd;
 	uint8_t		id;
 	bool		init;
-	bool		esc;
+	/* Left by a connection, until the relay thread forgot about it */
+	atomic_bool	releasing;
+	atomic_bool	esc;
+	unsigned char	esc_buf[UART_ESC_MAX];
+	size_t		esc_len;
 	char		name[UART_MAXNAME];
-	uint8_t		module_id;
-	int		tiocm_bits;
-	pthread_mutex_t	uart_port;
+	int		portno;
+	char		*pty_link;
+	struct gbsim_connection *connection;
+
+	/* TIOCM_* modem lines, and the GB_UART_CTRL_* ones the AP was told */
+	atomic_int	tiocm_bits;
+	atomic_bool	modem_changed;
+	pthread_t	modem_pthread;
+	bool		modem_thread;
+	int		pty_wd;
+	bool		pty_hup;	/* relay thread only */
+	uint16_t	modem_sent;
+	uint64_t	modem_deadline;	/* debouncing until, or 0 */
+	TAILQ_ENTRY(gb_uart_port) modem_node;
+
+	/* The line coding the AP set, and how long a character takes on it */
+	struct gb_uart_set_line_coding_request line_coding;
+	atomic_uint	char_ns;
+	atomic_bool	parity;
+
+	/* Line emulation, relay thread only */
+	TAILQ_ENTRY(gb_uart_port) line_node;
+	uint64_t	line_deadline;	/* waiting for the line until, or 0 */
+	uint64_t	rx_line_ns;	/* line time used up to */
+	uint64_t	tx_line_ns;
+	bool		rx_line_wait;
+	uint32_t	line_error_in;	/* characters to the next error */
+	unsigned int	line_seed;
+
+	/* Wakes the relay thread up for TX data and credits given back */
+	int		kick_fd;
+	/* What the relay thread waits for on the tty, relay thread only */
+	uint32_t	events;
+	bool		tx_blocked;
+
+	/* Single producer (the dispatcher), single consumer (the relay) */
+	struct {
+		unsigned char	buf[UART_TX_RING_SIZE];
+		atomic_size_t	head;
+		atomic_size_t	tail;
+	} tx;
+
+	/*
+	 * The last SEND_BREAK, until the relay thread put it on the line.
+	 * The dispatcher only sets break_on and break_head with it clear
+	 */
+	atomic_bool	break_req;
+	bool		break_on;
+	size_t		break_head;
+	bool		tx_break;	/* relay thread only */
+
+	/* Received data held back until the latency timer, relay thread only */
+	unsigned char	rx_buf[GB_UART_DATA_SIZE_MAX];
+	size_t		rx_len;
+	uint64_t	rx_deadline;
+
+	/*
+	 * RECEIVE_DATA credits: the relay thread takes them, and the
+	 * dispatcher gives them back by clearing the operation id
+	 */
+	uint16_t	rx_next_id;
+	atomic_int	rx_inflight;
+	struct {
+		atomic_ushort	operation_id;
+		uint64_t	sent_ms;
+	} rx_ops[UART_RX_CREDITS_MAX];
 };
 
 static struct gb_uart_port up[GB_UART_MAX];
 static int uart_sig_pipe[UART_IDX_COUNT] = {-1, -1};
+static int uart_epoll_fd = -1;
+static int uart_inotify_fd = -1;
 static bool terminate_thread;
 static int thread_started;
 static int port_count;
@@ -75,14 +204,243 @@ static int up_count;
 static pthread_t uart_pthread;
 static pthread_barrier_t uart_barrier;
 
-/* Only used when bbb_backend is true */
+/* The ports have a tty behind them: hardware, or ptys in uart_pty_dir */
+static bool uart_tty;
+static char *uart_pty_dir;
+
+int uart_pty_setup(char *dir)
+{
+	struct stat st;
+
+	if (stat(dir, &st) < 0 || !S_ISDIR(st.st_mode)) {
+		gbsim_error("UART pty directory %s not found\n", dir);
+		return -ENOENT;
+	}
+	uart_pty_dir = dir;
+
+	return 0;
+}
+
+/*
+ * RX aggregation, set with -R: like an FTDI latency timer, received data
+ * is held until rx_threshold bytes are pending or rx_latency_ms passed
+ * since the first of them.  The latency is the same for every port, so
+ * the pending list is ordered by deadline.
+ */
+static unsigned int rx_latency_ms;
+static size_t rx_threshold = GB_UART_DATA_SIZE_MAX;
+static int rx_credits = UART_RX_CREDITS;
+static TAILQ_HEAD(, gb_uart_port) rx_pending =
+	TAILQ_HEAD_INITIALIZER(rx_pending);
+/* Ports debouncing their modem lines, ordered by deadline too */
+static TAILQ_HEAD(, gb_uart_port) modem_pending =
+	TAILQ_HEAD_INITIALIZER(modem_pending);
+
+/* Parse "latency_ms[:threshold[:credits]]", 0 credits sends unacknowledged */
+int uart_rx_setup(char *spec)
+{
+	char *tok, *saveptr = NULL;
+
+	tok = strtok_r(spec, ":", &saveptr);
+	if (!tok)
+		return -EINVAL;
+	rx_latency_ms = strtoul(tok, NULL, 0);
+
+	if ((tok = strtok_r(NULL, ":", &saveptr)))
+		rx_threshold = strtoul(tok, NULL, 0);
+	if (!rx_threshold || rx_threshold > GB_UART_DATA_SIZE_MAX) {
+		gbsim_error("UART RX threshold must be 1 to %zu\n",
+			    GB_UART_DATA_SIZE_MAX);
+		return -EINVAL;
+	}
+
+	if ((tok = strtok_r(NULL, ":", &saveptr)))
+		rx_credits = strtol(tok, NULL, 0);
+	if (rx_credits < 0 || rx_credits > UART_RX_CREDITS_MAX) {
+		gbsim_error("UART RX credits must be 0 to %d\n",
+			    UART_RX_CREDITS_MAX);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Line emulation, set with -E: the ptys carry data at the rate the AP set,
+ * start, parity and stop bits included, and the data to the AP gets
+ * framing errors, parity errors and breaks at the given rates, in errors
+ * per million characters.
+ */
+static bool uart_line_emul;
+static unsigned int line_framing_ppm;
+static unsigned int line_parity_ppm;
+static unsigned int line_break_ppm;
+static TAILQ_HEAD(, gb_uart_port) line_waiting =
+	TAILQ_HEAD_INITIALIZER(line_waiting);
+
+/* Parse "framing_ppm[:parity_ppm[:break_ppm]]" */
+int uart_line_setup(char *spec)
+{
+	char *tok, *saveptr = NULL;
+
+	tok = strtok_r(spec, ":", &saveptr);
+	if (!tok)
+		return -EINVAL;
+	line_framing_ppm = strtoul(tok, NULL, 0);
+	if ((tok = strtok_r(NULL, ":", &saveptr)))
+		line_parity_ppm = strtoul(tok, NULL, 0);
+	if ((tok = strtok_r(NULL, ":", &saveptr)))
+		line_break_ppm = strtoul(tok, NULL, 0);
+
+	if (line_framing_ppm + line_parity_ppm + line_break_ppm > 1000000) {
+		gbsim_error("UART line errors must be at most 1000000 ppm\n");
+		return -EINVAL;
+	}
+	uart_line_emul = true;
+
+	return 0;
+}
+
+static uint64_t uart_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t uart_now_ms(void)
+{
+	return uart_now_ns() / 1000000;
+}
+
+/*
+ * Wait for what the port needs on its tty: input while it has credits left,
+ * room for output while TX data is blocked.  Relay thread only
+ */
+static void tty_update_events(int i)
+{
+	struct epoll_event ev = {
+		.data.u32 = i,
+	};
+
+	if (!up[i].init || up[i].pty_hup)
+		return;
+
+	if ((!rx_credits ||
+	     atomic_load_explicit(&up[i].rx_inflight,
+				  memory_order_relaxed) < rx_credits) &&
+	    !up[i].rx_line_wait)
+		ev.events |= EPOLLIN;
+	if (up[i].tx_blocked)
+		ev.events |= EPOLLOUT;
+	if (ev.events == up[i].events)
+		return;
+
+	up[i].events = ev.events;
+	if (epoll_ctl(uart_epoll_fd, EPOLL_CTL_MOD, up[i].fd, &ev) < 0)
+		gbsim_error("UART can't watch %s errno=%d\n", up[i].name,
+			    errno);
+}
+
+static void tty_kick(int i)
+{
+	if (eventfd_write(up[i].kick_fd, 1) < 0)
+		gbsim_error("UART can't kick %s errno=%d\n", up[i].name,
+			    errno);
+}
+
+/*
+ * Take a credit for a RECEIVE_DATA request, and return its operation id.
+ * The data read from the tty is always sent: once the credits run out the
+ * tty is paused, and data read meanwhile goes out unacknowledged, id 0.
+ * Relay thread only
+ */
+static uint16_t tty_rx_credit_get(int i)
+{
+	uint16_t operation_id;
+	int slot;
+
+	if (!rx_credits)
+		return 0;
+
+	for (slot = 0; slot < rx_credits; slot++)
+		if (!atomic_load_explicit(&up[i].rx_ops[slot].operation_id,
+					  memory_order_acquire))
+			break;
+	if (slot == rx_credits)
+		return 0;
+
+	/* Operation id 0 is for requests without a response */
+	if (!++up[i].rx_next_id)
+		up[i].rx_next_id = 1;
+	operation_id = up[i].rx_next_id;
+	up[i].rx_ops[slot].sent_ms = uart_now_ms();
+	atomic_store_explicit(&up[i].rx_ops[slot].operation_id, operation_id,
+			      memory_order_release);
+	atomic_fetch_add(&up[i].rx_inflight, 1);
+	tty_update_events(i);
+
+	return operation_id;
+}
+
+/*
+ * Give back the credit of request @operation_id.  If that lets a paused
+ * port read again, kick the relay thread to resume it.
+ */
+static void tty_rx_credit_put(int i, uint16_t operation_id)
+{
+	uint16_t expected;
+	int slot;
+
+	for (slot = 0; slot < rx_credits; slot++) {
+		expected = operation_id;
+		if (atomic_compare_exchange_strong(&up[i].rx_ops[slot].operation_id,
+						   &expected, 0))
+			break;
+	}
+	if (slot == rx_credits)
+		return;
+
+	if (atomic_fetch_sub(&up[i].rx_inflight, 1) == rx_credits)
+		tty_kick(i);
+}
+
+/* Give up on requests the AP didn't answer.  Relay thread only */
+static void tty_rx_credit_expire(int i)
+{
+	uint64_t now = uart_now_ms();
+	uint16_t operation_id;
+	int slot;
+
+	for (slot = 0; slot < rx_credits; slot++) {
+		operation_id = atomic_load(&up[i].rx_ops[slot].operation_id);
+		if (!operation_id ||
+		    now - up[i].rx_ops[slot].sent_ms < UART_RX_TIMEOUT_MS)
+			continue;
+		if (!atomic_compare_exchange_strong(&up[i].rx_ops[slot].operation_id,
+						    &operation_id, 0))
+			continue;
+		gbsim_error("UART %s RX operation %hu not answered\n",
+			    up[i].name, operation_id);
+		atomic_fetch_sub(&up[i].rx_inflight, 1);
+	}
+	tty_update_events(i);
+}
+
+/* Only used with a tty backend */
 static int gb_uart_send(int i, void *tbuf, size_t tsize, __u8 type, __u8 flags)
 {
-	char uart_buf[GB_OPERATION_DATA_SIZE_MAX] = { };
+	char uart_buf[sizeof(struct gb_operation_msg_hdr) +
+		      sizeof(struct gb_uart_recv_data_request) +
+		      GB_UART_DATA_SIZE_MAX] = { };
 	struct op_msg *msg = (struct op_msg *)uart_buf;
 	struct gb_operation_msg_hdr *oph = &msg->header;
 	size_t payload_size = 0;
 	uint16_t message_size = sizeof(*oph);
+	uint16_t operation_id = 0;
+	int ret;
 	struct gb_uart_recv_data_request *rdr =
 		(struct gb_uart_recv_data_request *)(uart_buf + sizeof(struct gb_operation_msg_hdr));
 	struct gb_uart_serial_state_request *ssr =
@@ -94,6 +452,7 @@ static int gb_uart_send(int i, void *tbuf, size_t tsize, __u8 type, __u8 flags)
 		rdr->flags = flags;
 		memcpy(&rdr->data, tbuf, tsize);
 		payload_size = sizeof(*rdr) + tsize;
+		operation_id = tty_rx_credit_get(i);
 		break;
 	case GB_UART_TYPE_SERIAL_STATE:
 		memcpy(&ssr->control, tbuf, sizeof(ssr->control));
@@ -106,163 +465,573 @@ static int gb_uart_send(int i, void *tbuf, size_t tsize, __u8 type, __u8 flags)
 	}
 	message_size += payload_size;
 
-	/* Operation id is 0 (unidirectional operation) */
+	/* Serial state changes are unidirectional, operation id 0 */
+	ret = send_request(up[i].hd_cport_id, msg, message_size, operation_id,
+			   type);
+	if (ret && operation_id) {
+		tty_rx_credit_put(i, operation_id);
+		tty_update_events(i);
+	}
+
+	return ret;
+}
+
+/* Send what the port holds back as one request.  Only with a tty backend */
+static void tty_rx_flush(int i)
+{
+	if (!up[i].rx_len)
+		return;
+
+	/* Dropped if the connection went away meanwhile */
+	TAILQ_REMOVE(&rx_pending, &up[i], rx_node);
+	if (up[i].init)
+		gb_uart_send(i, up[i].rx_buf, up[i].rx_len,
+			     GB_UART_TYPE_RECEIVE_DATA, 0);
+	up[i].rx_len = 0;
+}
+
+/*
+ * Hand received data to the AP, held back as the RX aggregation policy
+ * says.  Data flagged with a break or parity error flushes what is pending
+ * and goes out on its own, the flags apply to the whole request.
+ */
+static void tty_rx_queue(int i, unsigned char *data, size_t size,
+			 __u8 flags)
+{
+	size_t len;
+
+	if (flags) {
+		tty_rx_flush(i);
+		gb_uart_send(i, data, size, GB_UART_TYPE_RECEIVE_DATA, flags);
+		return;
+	}
+
+	while (size) {
+		if (!up[i].rx_len) {
+			up[i].rx_deadline = uart_now_ms() + rx_latency_ms;
+			TAILQ_INSERT_TAIL(&rx_pending, &up[i], rx_node);
+		}
+
+		len = rx_threshold - up[i].rx_len;
+		if (len > size)
+			len = size;
+		memcpy(&up[i].rx_buf[up[i].rx_len], data, len);
+		up[i].rx_len += len;
+		data += len;
+		size -= len;
 
-	return send_request(up[i].hd_cport_id, msg, message_size, 0, type);
+		if (up[i].rx_len >= rx_threshold || !rx_latency_ms)
+			tty_rx_flush(i);
+	}
 }
 
-static int tty_find_port(uint8_t module_id, uint16_t cport_id)
+/* How long a character takes on the line: start, data, parity, stop bits */
+static uint32_t tty_char_ns(struct gb_uart_set_line_coding_request *slc)
+{
+	uint32_t rate = le32toh(slc->rate);
+	unsigned int half_bits;
+
+	if (!rate)
+		return 0;
+
+	/* In half bits, for 1.5 stop bits */
+	half_bits = 2 * (1 + slc->data_bits + (slc->parity ? 1 : 0)) +
+		    2 + slc->format;
+
+	return (uint64_t)half_bits * 1000000000 / (2 * (uint64_t)rate);
+}
+
+/* Have port @i wait for the line until @deadline.  Relay thread only */
+static void tty_line_wait(int i, uint64_t deadline)
+{
+	if (!up[i].line_deadline)
+		TAILQ_INSERT_TAIL(&line_waiting, &up[i], line_node);
+	if (!up[i].line_deadline || deadline < up[i].line_deadline)
+		up[i].line_deadline = deadline;
+}
+
+/*
+ * How many characters, at most @max, the line has had time for since
+ * @line_ns.  Line time left unused is kept for a slice, so the relay
+ * thread waking up late doesn't cost throughput.  With no time for a
+ * character the port waits for the line.  Relay thread only
+ */
+static size_t tty_line_room(int i, uint64_t *line_ns, size_t max)
+{
+	uint32_t char_ns = atomic_load_explicit(&up[i].char_ns,
+						memory_order_relaxed);
+	uint64_t now, room;
+
+	if (!uart_line_emul || !char_ns)
+		return max;
+
+	now = uart_now_ns();
+	if (*line_ns + UART_LINE_SLICE_NS < now)
+		*line_ns = now - UART_LINE_SLICE_NS;
+	room = (now - *line_ns) / char_ns;
+	if (room)
+		return room < max ? room : max;
+
+	/* Half a slice of characters, or the one slow character */
+	if (char_ns < UART_LINE_SLICE_NS / 2)
+		tty_line_wait(i, *line_ns + UART_LINE_SLICE_NS / 2);
+	else
+		tty_line_wait(i, *line_ns + char_ns);
+	return 0;
+}
+
+/* @n characters went over the line.  Relay thread only */
+static void tty_line_use(int i, uint64_t *line_ns, size_t n)
+{
+	if (uart_line_emul)
+		*line_ns += n * atomic_load_explicit(&up[i].char_ns,
+						     memory_order_relaxed);
+}
+
+/*
+ * Hand data to the AP with the line errors of -E: the character an error
+ * hits goes out flagged, a break replaces it with a 0.  Parity errors
+ * only come with a parity bit.  Relay thread only
+ */
+static void tty_rx_line_errors(int i, unsigned char *data, size_t size)
+{
+	unsigned int ppm = line_framing_ppm + line_break_ppm;
+	unsigned int r;
+	size_t len;
+	__u8 flags;
+
+	if (atomic_load_explicit(&up[i].parity, memory_order_relaxed))
+		ppm += line_parity_ppm;
+	if (!ppm) {
+		tty_rx_queue(i, data, size, 0);
+		return;
+	}
+
+	while (size) {
+		/* Spread evenly around one error every 1000000 / ppm */
+		if (!up[i].line_error_in)
+			up[i].line_error_in = 1 + rand_r(&up[i].line_seed) %
+						  (2000000 / ppm);
+		if (up[i].line_error_in > size) {
+			up[i].line_error_in -= size;
+			tty_rx_queue(i, data, size, 0);
+			return;
+		}
+
+		len = up[i].line_error_in - 1;
+		tty_rx_queue(i, data, len, 0);
+		data += len;
+		size -= len;
+
+		r = rand_r(&up[i].line_seed) % ppm;
+		if (r < line_break_ppm) {
+			flags = GB_UART_RECV_FLAG_BREAK;
+			*data = 0;
+		} else if (r < line_break_ppm + line_framing_ppm) {
+			flags = GB_UART_RECV_FLAG_FRAMING;
+		} else {
+			flags = GB_UART_RECV_FLAG_PARITY;
+		}
+		tty_rx_queue(i, data, 1, flags);
+		data++;
+		size--;
+		up[i].line_error_in = 0;
+	}
+}
+
+/*
+ * Pick a free port slot: the /dev/ttyO<portno> one if the fleet
+ * configuration asked for a specific serial port, the first unused
+ * one otherwise.
+ */
+static int tty_claim_port(const struct gbsim_cport_params *params)
 {
 	int i;
 
-	for (i = 0; i < port_count; i++) {
-		if (up[i].cport_id == cport_id &&
-		    up[i].module_id == module_id)
-		    break;
+	if (params && params->uart_portno >= 0) {
+		for (i = 0; i < up_count; i++)
+			if (up[i].portno == params->uart_portno)
+				return up[i].init || atomic_load(&up[i].releasing) ?
+				       -EBUSY : i;
+		gbsim_error("UART port ttyO%d not opened\n",
+			    params->uart_portno);
+		return -ENODEV;
 	}
-	return i;
+
+	/* With the hardware backend only the opened ttys can be used */
+	for (i = 0; i < (uart_pty_dir ? GB_UART_MAX : up_count); i++)
+		if (!up[i].init && !atomic_load(&up[i].releasing))
+			return i;
+
+	return -ENODEV;
 }
 
-/* Only used when bbb_backend is true */
-static void tty_poll_modem_state(int i)
+/* The modem lines of port @i changed, report them once they settle */
+static void tty_modem_changed(int i)
 {
-	int ret;
-	int tiocm_bits;
+	if (up[i].modem_deadline)
+		return;
+
+	up[i].modem_deadline = uart_now_ms() + UART_MODEM_DEBOUNCE_MS;
+	TAILQ_INSERT_TAIL(&modem_pending, &up[i], modem_node);
+}
+
+/* Tell the AP about the settled modem lines, if they changed */
+static void tty_modem_report(int i)
+{
+	int tiocm_bits = atomic_load(&up[i].tiocm_bits);
+	uint16_t control;
+	__le16 state;
+
+	TAILQ_REMOVE(&modem_pending, &up[i], modem_node);
+	up[i].modem_deadline = 0;
+
+	control =  tiocm_bits & TIOCM_CD  ? GB_UART_CTRL_DCD : 0;
+	control |= tiocm_bits & TIOCM_DSR ? GB_UART_CTRL_DSR : 0;
+	control |= tiocm_bits & TIOCM_RI  ? GB_UART_CTRL_RI  : 0;
+	if (!up[i].init || control == up[i].modem_sent)
+		return;
+
+	up[i].modem_sent = control;
+	state = htole16(control);
+	gb_uart_send(i, &state, sizeof(state), GB_UART_TYPE_SERIAL_STATE, 0);
+	if (verbose)
+		gbsim_debug("UART DCD=%d DSR=%d RI=%d\n",
+			    control & GB_UART_CTRL_DCD,
+			    control & GB_UART_CTRL_DSR,
+			    control & GB_UART_CTRL_RI);
+}
+
+/*
+ * Follow the modem lines of hardware port @param.  TIOCMIWAIT blocks until
+ * one of them changes, drivers without it are polled instead.
+ */
+static void *tty_modem_thread(void *param)
+{
+	struct gb_uart_port *port = param;
+	int i = port - up;
+	int tiocm_bits, oldtype, ret;
+	bool poll = false;
 	extern int errno;
 
-	pthread_mutex_lock(&up[i].uart_port);
-	ret = ioctl(up[i].fd, TIOCMGET, &tiocm_bits);
-	if (ret == 0 && up[i].tiocm_bits != tiocm_bits) {
-		up[i].tiocm_bits = tiocm_bits;
-		tiocm_bits =  up[i].tiocm_bits & TIOCM_CD  ? GB_UART_CTRL_DCD : 0;
-		tiocm_bits |= up[i].tiocm_bits & TIOCM_DSR ? GB_UART_CTRL_DSR : 0;
-		tiocm_bits |= up[i].tiocm_bits & TIOCM_RI  ? GB_UART_CTRL_RI  : 0;
-		gb_uart_send(i, &tiocm_bits, sizeof(tiocm_bits),
-			     GB_UART_TYPE_SERIAL_STATE, 0);
-		if (verbose)
-			gbsim_debug("UART DCD=%d DSR=%d RI=%d",
-				    tiocm_bits & GB_UART_CTRL_DCD,
-				    tiocm_bits & GB_UART_CTRL_DSR,
-				    tiocm_bits & GB_UART_CTRL_RI);
-	}
-	pthread_mutex_unlock(&up[i].uart_port);
-}
-
-/* Only used when bbb_backend is true */
-static unsigned char *gb_uart_send_escape_sequences(int i, unsigned char *data,
-						    int size)
-{
-	unsigned char *begin = data;
-	unsigned char *end = data + size;
-	unsigned char *send_data = data;
-	__u8 flags = 0;
-
-	while (data < end && flags == 0) {
-		/* With PARMRK set 0xff indicates an escape sequence */
-		if (*data == 0xff) {
-			data += 1;
-			if (data == end)
-				goto err;
-			switch (*data) {
-			case 0xff:
-				/* 0xff received : 0xff, 0xff */
-				*send_data = *data;
-				break;
-			case 0x00:
-				data += 1;
-				if (data == end)
-					goto err;
-				if (*data == 0x00) {
-					/* Break condition : 0xff, 0x00, 0x00 */
-					flags = GB_UART_RECV_FLAG_BREAK;
-				} else {
-					/* Pairty/framing error for byte 'n' : 0xff, 0x00, n */
-					*send_data = *data;
-					flags = GB_UART_RECV_FLAG_PARITY | GB_UART_RECV_FLAG_FRAMING;
-				}
-				break;
-			default:
-				gbsim_error("Unexpected byte in escape 0x%02x\n",
-					*data);
-			}
-		} else {
-			*send_data = *data;
+	for (;;) {
+		if (!ioctl(port->fd, TIOCMGET, &tiocm_bits) &&
+		    atomic_exchange(&port->tiocm_bits, tiocm_bits) != tiocm_bits &&
+		    port->init) {
+			atomic_store(&port->modem_changed, true);
+			tty_kick(i);
+		}
+
+		if (poll) {
+			usleep(UART_MODEM_POLL_MS * 1000);
+			continue;
+		}
+
+		/* Not a cancellation point, and there's nothing to clean up */
+		pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, &oldtype);
+		ret = ioctl(port->fd, TIOCMIWAIT,
+			    TIOCM_CD | TIOCM_DSR | TIOCM_RI);
+		pthread_setcanceltype(oldtype, NULL);
+		if (ret < 0 && errno != EINTR) {
+			gbsim_error("UART %s TIOCMIWAIT errno=%d, polling\n",
+				    port->name, errno);
+			poll = true;
 		}
-		data += 1;
-		send_data += 1;
 	}
 
-	/* Send the parsed message */
-	size = send_data - begin;
-	gb_uart_send(i, begin, size, GB_UART_TYPE_RECEIVE_DATA, flags);
+	return NULL;
+}
 
-	/* Return offset */
-	return data;
-err:
-	gbsim_error("UART: parsing esc sequence");
-	return end;
+/*
+ * The last tool closed the slave side of pty @i.  The master keeps hanging
+ * up until one opens it again, it leaves the epoll set meanwhile.
+ * Relay thread only
+ */
+static void tty_pty_hangup(int i)
+{
+	if (epoll_ctl(uart_epoll_fd, EPOLL_CTL_DEL, up[i].fd, NULL) < 0 &&
+	    errno != ENOENT)
+		gbsim_error("UART can't unwatch %s errno=%d\n", up[i].name,
+			    errno);
+	if (up[i].pty_hup)
+		return;
 
+	up[i].pty_hup = true;
+	atomic_store(&up[i].tiocm_bits, 0);
+	tty_modem_changed(i);
 }
 
-/* Only used when bbb_backend is true */
+/* A tool opened the slave side of pty @i.  Relay thread only */
+static void tty_pty_open(int i)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.u32 = i,
+	};
+
+	if (up[i].pty_hup && up[i].init) {
+		if (epoll_ctl(uart_epoll_fd, EPOLL_CTL_ADD, up[i].fd, &ev) < 0 &&
+		    errno != EEXIST)
+			gbsim_error("UART can't watch %s errno=%d\n",
+				    up[i].name, errno);
+		up[i].events = ev.events;
+	}
+	up[i].pty_hup = false;
+	tty_update_events(i);
+	atomic_store(&up[i].tiocm_bits, TIOCM_CD | TIOCM_DSR);
+	tty_modem_changed(i);
+}
+
+/* Tools opening the slave side of the ptys.  Relay thread only */
+static void tty_pty_events(void)
+{
+	char buf[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *event;
+	ssize_t len;
+	char *ptr;
+	int i;
+
+	while ((len = read(uart_inotify_fd, buf, sizeof(buf))) > 0) {
+		for (ptr = buf; ptr < buf + len;
+		     ptr += sizeof(*event) + event->len) {
+			event = (struct inotify_event *)ptr;
+			for (i = 0; i < GB_UART_MAX; i++)
+				if (up[i].pty_wd == event->wd)
+					break;
+			if (i < GB_UART_MAX && event->mask & IN_OPEN)
+				tty_pty_open(i);
+		}
+	}
+}
+
+/*
+ * Hand the bytes flagged with a break or a parity error over to the AP.
+ * The flags apply to every byte of a request, so a run of bytes with the
+ * same flags goes out as one.
+ */
+static void tty_rx_flagged(int i, unsigned char *flagged, size_t *len,
+			   __u8 flags)
+{
+	if (!*len)
+		return;
+
+	tty_rx_queue(i, flagged, *len, flags);
+	*len = 0;
+}
+
+/*
+ * With PARMRK set 0xff starts an escape sequence:
+ *   0xff, 0xff	0xff received
+ *   0xff, 0x00, 0x00	break condition
+ *   0xff, 0x00, n	parity/framing error for byte 'n'
+ * memchr() finds the escapes, the clean spans between them go out straight
+ * from the read buffer.  Returns how many bytes at the end are a partial
+ * escape sequence, to be completed by the next read.
+ * Only used with a tty backend
+ */
+static size_t tty_rx_unescape(int i, unsigned char *data, size_t size)
+{
+	unsigned char flagged[GB_UART_DATA_SIZE_MAX / 3 + 1];
+	unsigned char *end = data + size;
+	unsigned char *esc;
+	size_t nflagged = 0;
+	__u8 flags = 0, fl;
+	bool escaped;
+
+	while (data < end) {
+		esc = memchr(data, 0xff, end - data);
+		if (!esc)
+			esc = end;
+
+		/* An escaped 0xff ends the clean span, and is sent with it */
+		escaped = end - esc >= 2 && esc[1] == 0xff;
+		if (esc + escaped > data) {
+			tty_rx_flagged(i, flagged, &nflagged, flags);
+			tty_rx_queue(i, data, esc + escaped - data, 0);
+		}
+		data = esc;
+		if (escaped) {
+			data += 2;
+			continue;
+		}
+		if (end - esc < 2)
+			break;
+
+		if (esc[1] != 0x00) {
+			gbsim_error("Unexpected byte in escape 0x%02x\n",
+				    esc[1]);
+			data = esc + 1;
+			continue;
+		}
+		if (end - esc < 3)
+			break;
+
+		if (esc[2] == 0x00)
+			fl = GB_UART_RECV_FLAG_BREAK;
+		else
+			fl = GB_UART_RECV_FLAG_PARITY | GB_UART_RECV_FLAG_FRAMING;
+		if (fl != flags)
+			tty_rx_flagged(i, flagged, &nflagged, flags);
+		flags = fl;
+		flagged[nflagged++] = esc[2];
+		data = esc + 3;
+	}
+	tty_rx_flagged(i, flagged, &nflagged, flags);
+
+	return end - data;
+}
+
+/* Only used with a tty backend */
 static int tty_read(int i)
 {
-	unsigned char data[GB_UART_DATA_SIZE_MAX];
-	unsigned char *next_frame;
-	unsigned char *end;
+	unsigned char data[UART_ESC_MAX + GB_UART_DATA_SIZE_MAX];
+	size_t carry = up[i].esc_len;
+	size_t size;
 	int ret;
 	extern int errno;
 
-	pthread_mutex_lock(&up[i].uart_port);
-	ret = read(up[i].fd, data, sizeof(data));
-	pthread_mutex_unlock(&up[i].uart_port);
+	/* No more than the line had time for, resumed by tty_line_wake() */
+	size = tty_line_room(i, &up[i].rx_line_ns, GB_UART_DATA_SIZE_MAX);
+	if (!size) {
+		up[i].rx_line_wait = true;
+		tty_update_events(i);
+		return 0;
+	}
+
+	/* The start of an escape sequence the last read ended with */
+	memcpy(data, up[i].esc_buf, carry);
+	up[i].esc_len = 0;
+
+	ret = read(up[i].fd, data + carry, size);
 	if (ret < 0) {
-		if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+		/* A pty with its slave closed reads EIO until it's reopened */
+		if (errno != EAGAIN && errno != EWOULDBLOCK &&
+		    !(uart_pty_dir && errno == EIO))
 			return ret;
-	} else {
-		if (up[i].esc) {
-			next_frame = data;
-			end = &data[ret];
-			while (next_frame < end) {
-				next_frame = gb_uart_send_escape_sequences(i, next_frame, ret);
-				ret = end-next_frame;
-			}
-		} else {
-			gb_uart_send(i, data, ret, GB_UART_TYPE_RECEIVE_DATA, 0);
-		}
+		ret = 0;
+	}
+	tty_line_use(i, &up[i].rx_line_ns, ret);
+
+	if (atomic_load_explicit(&up[i].esc, memory_order_relaxed)) {
+		up[i].esc_len = tty_rx_unescape(i, data, carry + ret);
+		memcpy(up[i].esc_buf, data + carry + ret - up[i].esc_len,
+		       up[i].esc_len);
+	} else if (uart_line_emul) {
+		tty_rx_line_errors(i, data, carry + ret);
+	} else if (carry + ret) {
+		tty_rx_queue(i, data, carry + ret, 0);
 	}
 	return 0;
 }
 
-static int tty_write(uint8_t module_id, uint16_t cport_id, void *tbuf, size_t tsize)
+/*
+ * Put the tty in the break state the AP asked for, a break only once what
+ * was written before it left the tty.  Relay thread only
+ */
+static void tty_tx_break(int i)
 {
-	int i;
-	int ret = 0;
+	int outq = 0, lsr = TIOCSER_TEMT;
 	extern int errno;
 
-	if (!bbb_backend)
-		return tsize;
+	/* tcdrain() without blocking the relay thread */
+	if (up[i].break_on) {
+		ioctl(up[i].fd, TIOCOUTQ, &outq);
+		ioctl(up[i].fd, TIOCSERGETLSR, &lsr);
+		if (outq || !(lsr & TIOCSER_TEMT)) {
+			tty_line_wait(i, uart_now_ns() + UART_BREAK_POLL_NS);
+			return;
+		}
+	}
 
-	i = tty_find_port(module_id, cport_id);
-	if (i == port_count || up[i].init == false) {
-		gbsim_error("UART Module %hhu AP Cport %hu not connected\n",
-			     module_id, cport_id);
-		return -EINVAL;
+	if (ioctl(up[i].fd, up[i].break_on ? TIOCSBRK : TIOCCBRK) < 0)
+		gbsim_error("UART %s break errno=%d\n", up[i].name, errno);
+	up[i].tx_break = up[i].break_on;
+	atomic_store_explicit(&up[i].break_req, false, memory_order_release);
+
+	/* Write what was held back during the break */
+	if (!up[i].tx_break)
+		tty_kick(i);
+}
+
+/* Write out what the TX ring holds, until the tty is full.  Relay only */
+static void tty_tx_drain(int i)
+{
+	size_t head, tail, len;
+	bool brk;
+	ssize_t ret;
+	extern int errno;
+
+	head = atomic_load_explicit(&up[i].tx.head, memory_order_acquire);
+	tail = atomic_load_explicit(&up[i].tx.tail, memory_order_relaxed);
+	up[i].tx_blocked = false;
+
+	/* The data queued before a break goes out first, none while it's on */
+	brk = atomic_load_explicit(&up[i].break_req, memory_order_acquire);
+	if (brk && up[i].break_on)
+		head = up[i].break_head;
+	else if (up[i].tx_break)
+		head = tail;
+
+	while (tail != head) {
+		/* Up to the end of the ring buffer at once */
+		len = UART_TX_RING_SIZE - (tail & (UART_TX_RING_SIZE - 1));
+		if (len > head - tail)
+			len = head - tail;
+		len = tty_line_room(i, &up[i].tx_line_ns, len);
+		if (!len)
+			break;
+
+		ret = write(up[i].fd,
+			    &up[i].tx.buf[tail & (UART_TX_RING_SIZE - 1)], len);
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			up[i].tx_blocked = true;
+			break;
+		}
+		if (ret < 0) {
+			gbsim_error("UART write -> %s failed errno=%d\n",
+				    up[i].name, errno);
+			ret = len;	/* dropped */
+		}
+
+		tail += ret;
+		atomic_store_explicit(&up[i].tx.tail, tail,
+				      memory_order_release);
+		tty_line_use(i, &up[i].tx_line_ns, ret);
 	}
+	if (brk && tail == head)
+		tty_tx_break(i);
+	tty_update_events(i);
+}
+
+/* Queue AP data for the relay thread to write to the tty */
+static int tty_write(int i, void *tbuf, size_t tsize)
+{
+	size_t head, tail, len;
 
-	pthread_mutex_lock(&up[i].uart_port);
-	ret = write(up[i].fd, tbuf, tsize);
-	pthread_mutex_unlock(&up[i].uart_port);
+	if (!uart_tty)
+		return tsize;
 
-	if (ret < 0)
-		gbsim_error("UART write -> %s failed errno=%d\n",
-			    up[i].name, errno);
+	/* A slow line holds the AP back, as a full FIFO would */
+	head = atomic_load_explicit(&up[i].tx.head, memory_order_relaxed);
+	tail = atomic_load_explicit(&up[i].tx.tail, memory_order_acquire);
+	if (tsize > UART_TX_RING_SIZE - (head - tail))
+		return -EAGAIN;
+
+	len = UART_TX_RING_SIZE - (head & (UART_TX_RING_SIZE - 1));
+	if (len > tsize)
+		len = tsize;
+	memcpy(&up[i].tx.buf[head & (UART_TX_RING_SIZE - 1)], tbuf, len);
+	memcpy(up[i].tx.buf, (char *)tbuf + len, tsize - len);
+	atomic_store_explicit(&up[i].tx.head, head + tsize,
+			      memory_order_release);
+	tty_kick(i);
 
 	if (verbose) {
 		gbsim_debug("AP -> UART %s length %zu\n", up[i].name, tsize);
 		gbsim_dump(tbuf, tsize);
 	}
-	return ret;
+	return tsize;
 }
 
 static int tty_set_line_coding(int i,
@@ -273,7 +1042,7 @@ static int tty_set_line_coding(int i,
 
 	gbsim_debug("UART line coding rate %u format %u parity %u data_bits %u\n",
 		     slc->rate, slc->format, slc->parity, slc->data_bits);
-	if (bbb_backend)
+	if (uart_tty)
 		tcgetattr(up[i].fd, &newtios);
 
 	newtios.c_cflag &= ~CBAUD;
@@ -440,17 +1209,22 @@ static int tty_set_line_coding(int i,
 	newtios.c_cc[VTIME] = 0;   /* inter-character timer unused */
 	newtios.c_cc[VMIN]  = 1;   /* blocking read until 1 chars received */
 
-	if (bbb_backend) {
-		pthread_mutex_lock(&up[i].uart_port);
+	/* Nothing marks the parity errors of what a pty slave writes */
+	if (uart_tty) {
 		tcsetattr(up[i].fd, TCSAFLUSH, &newtios);
-		up[i].esc = newtios.c_cflag & PARENB ? true : false;
-		pthread_mutex_unlock(&up[i].uart_port);
+		atomic_store(&up[i].esc, !uart_pty_dir &&
+			     (newtios.c_cflag & PARENB));
 	}
 
+	/* For the line emulation */
+	up[i].line_coding = *slc;
+	atomic_store(&up[i].parity, slc->parity != GB_SERIAL_NO_PARITY);
+	atomic_store(&up[i].char_ns, tty_char_ns(slc));
+
 	return 0;
 }
 
-/* Only used when bbb_backend is true */
+/* Only used with a tty backend */
 static int tty_set_control_line_state(int i,
 				      struct gb_uart_set_control_line_state_request *sls)
 {
@@ -460,7 +1234,8 @@ static int tty_set_control_line_state(int i,
 		    sls->control & GB_UART_CTRL_DTR,
 		    sls->control & GB_UART_CTRL_RTS);
 
-	if (!bbb_backend)
+	/* A pty has no modem lines */
+	if (!uart_tty || uart_pty_dir)
 		return 0;
 
 	ret = ioctl(up[i].fd, TIOCMGET, &status);
@@ -471,58 +1246,208 @@ static int tty_set_control_line_state(int i,
 	status |= ((sls->control & GB_UART_CTRL_DTR ? TIOCM_DTR : 0)|
 		   (sls->control & GB_UART_CTRL_RTS ? TIOCM_RTS : 0));
 
-	pthread_mutex_lock(&up[i].uart_port);
 	ret = ioctl(up[i].fd, TIOCMSET, &status);
-	pthread_mutex_unlock(&up[i].uart_port);
 err:
 	return ret;
 }
 
-/* Only used when bbb_backend is true */
+/*
+ * Have the relay thread turn the break on or off, the AP times it.  Only
+ * used with a tty backend
+ */
 static int tty_send_break(int i, struct gb_uart_set_break_request *set_break)
 {
-	int ret;
-
-	if (!bbb_backend)
+	if (!uart_tty || uart_pty_dir)
 		return 0;
 
-	pthread_mutex_lock(&up[i].uart_port);
-	ret = tcdrain(i);
-	if (ret)
+	/* The last one isn't on the line yet */
+	if (atomic_load_explicit(&up[i].break_req, memory_order_acquire))
+		return -EAGAIN;
+
+	up[i].break_on = set_break->state;
+	up[i].break_head = atomic_load_explicit(&up[i].tx.head,
+						memory_order_relaxed);
+	atomic_store_explicit(&up[i].break_req, true, memory_order_release);
+	tty_kick(i);
+
+	return 0;
+}
+
+/* Have uart_thread() relay what the tty receives.  Only with a tty backend */
+static int uart_watch_port(int i)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.u32 = i | UART_EPOLL_KICK,
+	};
+
+	/* The kick eventfd stays with the port slot */
+	if (up[i].kick_fd < 0) {
+		up[i].kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (up[i].kick_fd < 0 ||
+		    epoll_ctl(uart_epoll_fd, EPOLL_CTL_ADD, up[i].kick_fd,
+			      &ev) < 0) {
+			gbsim_error("UART can't kick %s errno=%d\n",
+				    up[i].name, errno);
+			return -errno;
+		}
+	}
+
+	ev.data.u32 = i;
+	up[i].events = ev.events;
+	up[i].tx_blocked = false;
+	if (epoll_ctl(uart_epoll_fd, EPOLL_CTL_ADD, up[i].fd, &ev) < 0) {
+		gbsim_error("UART can't watch %s errno=%d\n", up[i].name,
+			    errno);
+		return -errno;
+	}
+
+	return 0;
+}
+
+/*
+ * Give port @i a pseudo-terminal.  What the AP sends while no tool has the
+ * slave open waits in the pty for the next one.  The pty stays with the
+ * port slot when the connection goes away, for the next one.
+ */
+static int tty_open_pty(int i)
+{
+	struct termios tios;
+
+	up[i].fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (up[i].fd < 0)
 		goto err;
+	if (grantpt(up[i].fd) || unlockpt(up[i].fd) ||
+	    ptsname_r(up[i].fd, up[i].name, sizeof(up[i].name)))
+		goto err_close;
+
+	/* Until the first tool opens the slave the master doesn't hang up */
+	up[i].pty_hup = false;
+	up[i].pty_wd = inotify_add_watch(uart_inotify_fd, up[i].name,
+					 IN_OPEN);
+	if (up[i].pty_wd < 0)
+		gbsim_error("UART can't follow %s errno=%d\n", up[i].name,
+			    errno);
+
+	/* Raw until the AP sets the line coding, no echo back to it */
+	tcgetattr(up[i].fd, &tios);
+	cfmakeraw(&tios);
+	tcsetattr(up[i].fd, TCSANOW, &tios);
 
-	ret = tcsendbreak(up[i].fd, BREAK_DURATION_MS);
+	return 0;
+
+err_close:
+	gbsim_error("UART pty setup failed errno=%d\n", errno);
+	close(up[i].fd);
 err:
-	pthread_mutex_unlock(&up[i].uart_port);
-	return ret;
+	up[i].fd = -1;
+	return -errno;
+}
+
+/* Link the pty of port @i as ttyGB<bridge>.<interface>.<cport> */
+static void tty_link_pty(int i, struct gbsim_connection *connection)
+{
+	if (asprintf(&up[i].pty_link, "%s/ttyGB%d.%u.%u", uart_pty_dir,
+		     connection->intf->svc->bridge->id,
+		     connection->intf->interface_id, connection->cport_id) < 0) {
+		up[i].pty_link = NULL;
+		return;
+	}
+
+	unlink(up[i].pty_link);
+	if (symlink(up[i].name, up[i].pty_link) < 0)
+		gbsim_error("UART can't link %s errno=%d\n", up[i].pty_link,
+			    errno);
+	else
+		gbsim_info("UART %s -> %s\n", up[i].pty_link, up[i].name);
 }
 
-static int uart_init_port(uint8_t module_id, uint16_t cport_id,
-			  uint16_t hd_cport_id, uint8_t id)
+static void tty_unlink_pty(int i)
+{
+	if (!up[i].pty_link)
+		return;
+
+	unlink(up[i].pty_link);
+	free(up[i].pty_link);
+	up[i].pty_link = NULL;
+}
+
+/*
+ * Give @connection a port of its own, on its first request.  The port is
+ * hung off the connection, so requests find it without a lookup and the
+ * same CPort number on different interfaces or bridges gets its own port.
+ */
+static int uart_init_port(struct gbsim_connection *connection, uint8_t id)
 {
+	struct gbsim_interface *intf = connection->intf;
 	int i;
 
-	i = tty_find_port(module_id, cport_id);
-	if (i < port_count)
+	i = tty_claim_port(connection->params);
+	if (i < 0) {
+		gbsim_error("No UART available for AP %d Interface %u CPort %u\n",
+			    intf->svc->bridge->id, intf->interface_id,
+			    connection->cport_id);
 		return i;
-
-	if (port_count >= GB_UART_MAX) {
-		gbsim_error("All UARTs used Module %u CPort %u\n",
-			    module_id, cport_id);
-		return -ENODEV;
 	}
-	up[port_count].module_id = module_id;
-	up[port_count].cport_id = cport_id;
-	up[port_count].hd_cport_id = hd_cport_id;
-	up[port_count].id = id;
-	up[port_count].init = true;
-	gbsim_info("UART Module %u Cport %u HDCport %u port-index %d\n",
-		   module_id, cport_id, hd_cport_id, port_count);
-	i = port_count;
-	port_count++;
+	if (uart_pty_dir && up[i].fd < 0 && tty_open_pty(i))
+		return -EIO;
+
+	/* The relay thread cleared what the last connection left */
+	memset(&up[i].line_coding, 0, sizeof(up[i].line_coding));
+	atomic_store(&up[i].char_ns, 0);
+	atomic_store(&up[i].parity, false);
+	atomic_store(&up[i].esc, false);
+	atomic_store(&up[i].modem_changed, true);
+
+	if (uart_tty && uart_watch_port(i))
+		return -EIO;
+	if (uart_pty_dir)
+		tty_link_pty(i, connection);
+
+	up[i].connection = connection;
+	up[i].cport_id = connection->cport_id;
+	up[i].hd_cport_id = connection->hd_cport_id;
+	up[i].id = id;
+	up[i].init = true;
+	connection->priv = &up[i];
+	/* The AP hears of the modem lines already set */
+	if (uart_tty)
+		tty_kick(i);
+	gbsim_info("UART AP %d Interface %u Cport %u HDCport %u port-index %d\n",
+		   intf->svc->bridge->id, intf->interface_id,
+		   connection->cport_id, connection->hd_cport_id, i);
+	if (i >= port_count)
+		port_count = i + 1;
 	return i;
 }
 
+/*
+ * The AP released the connection: give its port back.  The relay thread
+ * may still hold data or be writing for it, so the slot is only claimed
+ * again once the relay thread let go of it in tty_release()
+ */
+void uart_conn_destroy(struct gbsim_connection *connection)
+{
+	struct gb_uart_port *port = connection->priv;
+	int i;
+
+	if (!port)
+		return;
+
+	i = port - up;
+	connection->priv = NULL;
+
+	if (uart_tty)
+		atomic_store(&up[i].releasing, true);
+	up[i].init = false;
+	up[i].connection = NULL;
+	if (uart_tty)
+		tty_kick(i);
+
+	tty_unlink_pty(i);
+	gbsim_info("UART port-index %d released\n", i);
+}
+
 int uart_handler(struct gbsim_connection *connection, void *rbuf,
 		 size_t rsize, void *tbuf, size_t tsize)
 {
@@ -533,29 +1458,32 @@ int uart_handler(struct gbsim_connection *connection, void *rbuf,
 	uint16_t message_size;
 	uint16_t cport_id = connection->cport_id;
 	uint16_t hd_cport_id = connection->hd_cport_id;
-	uint8_t module_id;
 	uint8_t result = PROTOCOL_STATUS_SUCCESS;
 	struct gb_uart_set_break_request *set_break;
 	struct gb_uart_send_data_request *send_data;
 	struct gb_uart_set_line_coding_request *line_coding;
 	struct gb_uart_set_control_line_state_request *line_state;
-	int i;
+	int i, ret;
 	extern int errno;
 
-	module_id = cport_to_module_id(cport_id);
-
 	op_rsp = (struct op_msg *)tbuf;
 	oph = (struct gb_operation_msg_hdr *)&op_req->header;
 
-	/* Associate the module_id and cport_id with the device fd */
-	i = uart_init_port(module_id, cport_id, hd_cport_id, oph->operation_id);
+	/* Associate the connection with the device fd */
+	if (connection->priv)
+		i = (struct gb_uart_port *)connection->priv - up;
+	else
+		i = uart_init_port(connection, oph->operation_id);
 	if (i < 0)
 		return i;
 
 	switch (oph->type) {
 	case GB_UART_TYPE_SEND_DATA:
 		send_data = &op_req->uart_send_data_req;
-		if (tty_write(module_id, cport_id, send_data->data, send_data->size) < send_data->size)
+		ret = tty_write(i, send_data->data, send_data->size);
+		if (ret == -EAGAIN)
+			result = PROTOCOL_STATUS_RETRY;
+		else if (ret < send_data->size)
 			result = PROTOCOL_STATUS_INVALID;
 		gbsim_debug("UART send len %hu\n", send_data->size);
 		break;
@@ -574,13 +1502,22 @@ int uart_handler(struct gbsim_connection *connection, void *rbuf,
 		break;
 	case GB_UART_TYPE_SEND_BREAK:
 		set_break = &op_req->uart_sb_req;
-		if (tty_send_break(i, set_break))
+		ret = tty_send_break(i, set_break);
+		if (ret == -EAGAIN)
+			result = PROTOCOL_STATUS_RETRY;
+		else if (ret)
 			result = PROTOCOL_STATUS_INVALID;
 		break;
 	case (OP_RESPONSE | GB_UART_TYPE_RECEIVE_DATA):
+		if (uart_tty && oph->operation_id) {
+			tty_rx_credit_put(i, oph->operation_id);
+			return 0;
+		}
+		/* fall through */
 	case (OP_RESPONSE | GB_UART_TYPE_SERIAL_STATE):
-		gbsim_error("AP -> Module %hhu CPort %hu unsol resp %02x\n",
-			    module_id, cport_id, oph->type);
+		gbsim_error("AP -> Interface %u CPort %hu unsol resp %02x\n",
+			    connection->intf->interface_id, cport_id,
+			    oph->type);
 		return 0;
 	case GB_REQUEST_TYPE_CPORT_SHUTDOWN:
 		payload_size = 0;
@@ -594,58 +1531,154 @@ int uart_handler(struct gbsim_connection *connection, void *rbuf,
 			oph->operation_id, oph->type, result);
 }
 
-/* Only used when bbb_backend is true */
+/*
+ * Let the ports whose wait for the line is over go on, and return when the
+ * next one is due.  Relay thread only
+ */
+static uint64_t tty_line_wake(uint64_t now)
+{
+	struct gb_uart_port *port, *next;
+	uint64_t deadline = UINT64_MAX;
+
+	for (port = TAILQ_FIRST(&line_waiting); port; port = next) {
+		next = TAILQ_NEXT(port, line_node);
+		if (port->line_deadline > now) {
+			if (port->line_deadline < deadline)
+				deadline = port->line_deadline;
+			continue;
+		}
+
+		TAILQ_REMOVE(&line_waiting, port, line_node);
+		port->line_deadline = 0;
+		port->rx_line_wait = false;
+		/* Write what's queued, and read again */
+		if (port->init)
+			tty_tx_drain(port - up);
+		if (port->line_deadline && port->line_deadline < deadline)
+			deadline = port->line_deadline;
+	}
+
+	return deadline;
+}
+
+/*
+ * Forget what the last connection of port @i left: held back data, modem
+ * lines and line waits, the TX ring and the credits.  Relay thread only
+ */
+static void tty_release(int i)
+{
+	extern int errno;
+
+	/* A hung up pty isn't in the epoll set */
+	if (epoll_ctl(uart_epoll_fd, EPOLL_CTL_DEL, up[i].fd, NULL) < 0 &&
+	    errno != ENOENT)
+		gbsim_error("UART can't unwatch %s errno=%d\n", up[i].name,
+			    errno);
+
+	if (up[i].rx_len)
+		TAILQ_REMOVE(&rx_pending, &up[i], rx_node);
+	up[i].rx_len = 0;
+	if (up[i].modem_deadline)
+		TAILQ_REMOVE(&modem_pending, &up[i], modem_node);
+	up[i].modem_deadline = 0;
+	up[i].modem_sent = 0;
+	if (up[i].line_deadline)
+		TAILQ_REMOVE(&line_waiting, &up[i], line_node);
+	up[i].line_deadline = 0;
+	up[i].rx_line_wait = false;
+	up[i].esc_len = 0;
+
+	if (up[i].tx_break && ioctl(up[i].fd, TIOCCBRK) < 0)
+		gbsim_error("UART %s break errno=%d\n", up[i].name, errno);
+	up[i].tx_break = false;
+	atomic_store(&up[i].break_req, false);
+	atomic_store(&up[i].tx.head, 0);
+	atomic_store(&up[i].tx.tail, 0);
+	memset(up[i].rx_ops, 0, sizeof(up[i].rx_ops));
+	atomic_store(&up[i].rx_inflight, 0);
+
+	atomic_store_explicit(&up[i].releasing, false, memory_order_release);
+}
+
+/* Only used with a tty backend */
 static void *uart_thread(void *param)
 {
-	fd_set fdset;
-	int i, ret;
-	int max = uart_sig_pipe[UART_IDX_RX];
-	struct timeval tv;
+	struct epoll_event events[UART_EPOLL_EVENTS];
+	struct gb_uart_port *port;
+	uint64_t now, next_poll = 0, wakeup, line;
+	eventfd_t kicks;
+	int i, n, ret;
 	extern int errno;
 
 	pthread_barrier_wait(&uart_barrier);
 
-	for (i = 0; i < up_count; i++)
-		if (max < up[i].fd)
-			max = up[i].fd;
 	while (!terminate_thread) {
-		for (i = 0; i < up_count; i++) {
-			if (up[i].init == true)
-				tty_poll_modem_state(i);
+		now = uart_now_ms();
+		if (now >= next_poll) {
+			for (i = 0; i < port_count; i++)
+				if (up[i].init == true)
+					tty_rx_credit_expire(i);
+			next_poll = now + UART_RX_EXPIRE_POLL_MS;
 		}
 
-		FD_ZERO(&fdset);
-		FD_SET(uart_sig_pipe[UART_IDX_RX] , &fdset);
-		for (i = 0; i < up_count; i++) {
-			if (up[i].init == true)
-				FD_SET(up[i].fd , &fdset);
+		/* Wake up for the latency timer of the oldest pending data */
+		wakeup = next_poll;
+		port = TAILQ_FIRST(&rx_pending);
+		if (port && port->rx_deadline < wakeup)
+			wakeup = port->rx_deadline > now ? port->rx_deadline : now;
+		/* And for the modem lines to settle */
+		port = TAILQ_FIRST(&modem_pending);
+		if (port && port->modem_deadline < wakeup)
+			wakeup = port->modem_deadline > now ?
+				 port->modem_deadline : now;
+		/* And for the ports waiting for the line, rounded up */
+		line = tty_line_wake(uart_now_ns()) / 1000000 + 1;
+		if (line < wakeup)
+			wakeup = line > now ? line : now;
+
+		ret = epoll_wait(uart_epoll_fd, events, UART_EPOLL_EVENTS,
+				 wakeup - now);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			gbsim_error("%s : epoll_wait errno=%d\n", __func__,
+				    errno);
+			break;
 		}
 
-		tv.tv_sec = 1;
-		tv.tv_usec = 0;
-		ret = select(1 + max, &fdset, 0, 0, &tv);
-		switch (ret) {
-		case -1:
-			gbsim_error("%s : select errno=%d\n", __func__, errno);
-			terminate_thread = true;
-			break;
-		case 0:
-			break;
-		default:
-			if (FD_ISSET(uart_sig_pipe[UART_IDX_RX], &fdset)) {
+		for (n = 0; n < ret && !terminate_thread; n++) {
+			i = events[n].data.u32;
+			if (i == UART_EPOLL_SIG) {
 				terminate_thread = true;
-				break;
-			}
-			for (i = 0; i < up_count; i++) {
-				if (FD_ISSET(up[i].fd, &fdset)) {
-					if (tty_read(i)) {
-						terminate_thread = true;
-						break;
-					}
-				}
+			} else if (i == UART_EPOLL_PTY) {
+				tty_pty_events();
+			} else if (i & UART_EPOLL_KICK) {
+				/* TX data queued, credits given back, modem lines */
+				i &= ~UART_EPOLL_KICK;
+				eventfd_read(up[i].kick_fd, &kicks);
+				if (atomic_load(&up[i].releasing))
+					tty_release(i);
+				if (atomic_exchange(&up[i].modem_changed, false))
+					tty_modem_changed(i);
+				if (up[i].init)
+					tty_tx_drain(i);
+			} else if (up[i].init) {
+				if (events[n].events & EPOLLOUT)
+					tty_tx_drain(i);
+				if (events[n].events & ~EPOLLOUT && tty_read(i))
+					terminate_thread = true;
+				if (uart_pty_dir && events[n].events & EPOLLHUP)
+					tty_pty_hangup(i);
 			}
-			break;
 		}
+
+		now = uart_now_ms();
+		while ((port = TAILQ_FIRST(&rx_pending)) &&
+		       port->rx_deadline <= now)
+			tty_rx_flush(port - up);
+		while ((port = TAILQ_FIRST(&modem_pending)) &&
+		       port->modem_deadline <= now)
+			tty_modem_report(port - up);
 	}
 	gbsim_info("UART thread exit\n");
 	pthread_exit(NULL);
@@ -658,6 +1691,15 @@ void uart_cleanup(void)
 	char c;
 	extern int errno;
 
+	/* The modem threads may kick the relay thread, they go first */
+	for (i = 0; i < up_count; i++) {
+		if (!up[i].modem_thread)
+			continue;
+		pthread_cancel(up[i].modem_pthread);
+		pthread_join(up[i].modem_pthread, NULL);
+		up[i].modem_thread = false;
+	}
+
 	if (thread_started) {
 		/* signal termination */
 		if (write(uart_sig_pipe[UART_IDX_TX], &c, 1) < 0)
@@ -673,27 +1715,38 @@ void uart_cleanup(void)
 		close(uart_sig_pipe[UART_IDX_TX]);
 	if (uart_sig_pipe[UART_IDX_RX] != -1)
 		close(uart_sig_pipe[UART_IDX_RX]);
+	if (uart_epoll_fd != -1)
+		close(uart_epoll_fd);
+	if (uart_inotify_fd != -1)
+		close(uart_inotify_fd);
+	uart_inotify_fd = -1;
 
 	/* Close fds to serial ports a signal pipes for ports */
 	for (i = 0; i < GB_UART_MAX; i++) {
 		if (up[i].fd != -1)
 			close(up[i].fd);
+		up[i].fd = -1;
+		if (up[i].kick_fd != -1)
+			close(up[i].kick_fd);
+		up[i].kick_fd = -1;
+		tty_unlink_pty(i);
 	}
+	uart_tty = false;
 }
 
-/* Only used when bbb_backend is true */
+/* Only used with a tty backend */
 static int uart_open(int idx)
 {
 	/* Open fd to serial port */
 	snprintf(up[up_count].name, sizeof(up[up_count].name), "/dev/ttyO%d", idx);
-	up[up_count].fd = open(up[up_count].name, O_RDWR);
-	if (up->fd < 0) {
+	up[up_count].portno = idx;
+	up[up_count].fd = open(up[up_count].name, O_RDWR | O_NONBLOCK);
+	if (up[up_count].fd < 0) {
 		fprintf(stderr, "cannot open %s errno=%d\n", up[up_count].name, errno);
 		uart_cleanup();
 		return EXIT_FAILURE;
 	}
 
-	pthread_mutex_init(&up[up_count].uart_port, 0);
 	up_count++;
 	return 0;
 }
@@ -724,13 +1777,25 @@ char *uart_get_operation(uint8_t type)
 
 void uart_init(void)
 {
+	struct epoll_event ev;
 	extern int errno;
 	int i, ret;
 
-	if (!bbb_backend)
+	for (i = 0; i < GB_UART_MAX; i++) {
+		up[i].fd = -1;
+		up[i].kick_fd = -1;
+		up[i].pty_wd = -1;
+		up[i].line_seed = i + 1;
+	}
+
+	if (uart_line_emul && !uart_pty_dir) {
+		gbsim_error("UART line emulation only with the pty backend\n");
+		uart_line_emul = false;
+	}
+	if (!bbb_backend && !uart_pty_dir)
 		return;
-	/* Loop through the /dev/tty0x entries */
-	for (i = 0; i < uart_count; i++)
+	/* Loop through the /dev/tty0x entries, ptys come with the CPorts */
+	for (i = 0; !uart_pty_dir && i < uart_count; i++)
 		if (uart_open(i + uart_portno))
 			return;
 
@@ -742,6 +1807,35 @@ void uart_init(void)
 		return;
 	}
 
+	/* The ports join the set as the AP connects to them */
+	uart_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (uart_epoll_fd < 0) {
+		perror("can't create uart epoll");
+		uart_cleanup();
+		return;
+	}
+	ev.events = EPOLLIN;
+	ev.data.u32 = UART_EPOLL_SIG;
+	if (epoll_ctl(uart_epoll_fd, EPOLL_CTL_ADD, uart_sig_pipe[UART_IDX_RX],
+		      &ev) < 0) {
+		perror("can't watch uart pipe");
+		uart_cleanup();
+		return;
+	}
+
+	/* Tools opening and closing the ptys drive their modem lines */
+	if (uart_pty_dir) {
+		uart_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		ev.data.u32 = UART_EPOLL_PTY;
+		if (uart_inotify_fd < 0 ||
+		    epoll_ctl(uart_epoll_fd, EPOLL_CTL_ADD, uart_inotify_fd,
+			      &ev) < 0) {
+			perror("can't watch uart ptys");
+			uart_cleanup();
+			return;
+		}
+	}
+
 	/* Init fdr thread */
 	pthread_barrier_init(&uart_barrier, 0, 2);
 	ret = pthread_create(&uart_pthread, NULL, uart_thread, NULL);
@@ -752,4 +1846,16 @@ void uart_init(void)
 	}
 	thread_started = 1;
 	pthread_barrier_wait(&uart_barrier);
+
+	for (i = 0; !uart_pty_dir && i < up_count; i++) {
+		ret = pthread_create(&up[i].modem_pthread, NULL,
+				     tty_modem_thread, &up[i]);
+		if (ret) {
+			gbsim_error("can't create uart modem thread %d\n", ret);
+			uart_cleanup();
+			return;
+		}
+		up[i].modem_thread = true;
+	}
+	uart_tty = true;
 }